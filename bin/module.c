@@ -3,6 +3,7 @@
 #include "elf.h"
 
 #include "../kernlib/kernmem.h"
+#include "../kernlib/kerncache.h"
 #include "dev/uart.h"
 
 #include "string.h"
@@ -52,7 +53,7 @@ void module_add_to_gmt(module* md)
 
 static const char* mdesc_wspaces = " ,\t\r\n";
 
-static char* mdesc_get_lexem(file_system* fs, void* desc_fd)
+static char* mdesc_get_lexem(file_system* fs, void* desc_fd, kmem_arena* arena)
 {
 	char c;
 	size_t rd = 0;
@@ -75,42 +76,36 @@ static char* mdesc_get_lexem(file_system* fs, void* desc_fd)
 	if(!rd) return NULL;
 
 	buf_it[strchr(mdesc_wspaces, *buf_it) ? 0 : 1] = '\0';
-	char* ret = kmalloc(strlen(buf) + 1);
-	strcpy(ret, buf);
+	char* ret = kmem_arena_alloc(arena, strlen(buf) + 1, 1);
+	if(ret)
+		strcpy(ret, buf);
 	return ret;
 }
 
-static char** mdesc_parse_list(file_system* fs, void* desc_fd)
+static char** mdesc_parse_list(file_system* fs, void* desc_fd, kmem_arena* arena)
 {
-	size_t list_ln = 0;
+	size_t list_ln = 0, list_cap = 0;
 	char** list = NULL;
 
 	while(1){
-		char* lx = mdesc_get_lexem(fs, desc_fd);
-		if(!lx) break;
-
-		if(!strcmp(lx, "}"))
-		{ kfree(lx); break; }
-
-		char** prev_list = list;
-		list = krealloc(list, (++list_ln) * sizeof(char*));
-		if(!list){
-			for(size_t i = 0; i < list_ln - 1; ++i)
-				kfree(prev_list[i]);
-			kfree(prev_list);
-			return NULL;
+		char* lx = mdesc_get_lexem(fs, desc_fd, arena);
+		if(!lx || !strcmp(lx, "}"))
+			break;
+
+		if(list_ln + 1 >= list_cap){ // arena can't grow an allocation, the list is copied to a twice as large one
+			char** prev_list = list;
+			list_cap = list_cap ? list_cap * 2 : 8;
+			list = kmem_arena_alloc(arena, list_cap * sizeof(char*), sizeof(char*));
+			if(!list)
+				return NULL;
+			if(prev_list)
+				memcpy(list, prev_list, list_ln * sizeof(char*));
 		}
-		list[list_ln - 1] = lx;
+		list[list_ln++] = lx;
 	}
-	char** prev_list = list;
-	list = krealloc(list, (++list_ln) * sizeof(char*));
-	if(!list){
-		for(size_t i = 0; i < list_ln - 1; ++i)
-			kfree(prev_list[i]);
-		kfree(prev_list);
+	if(!list && !(list = kmem_arena_alloc(arena, sizeof(char*), sizeof(char*))))
 		return NULL;
-	}
-	list[list_ln - 1] = NULL;
+	list[list_ln] = NULL;
 
 	return list;
 }
@@ -119,29 +114,26 @@ static char** mdesc_parse_list(file_system* fs, void* desc_fd)
 static module_desc mdesc_parse(file_system* fs, void* desc_fd)
 {
 	module_desc ret = {.dependencies = NULL};
+	kmem_arena_create(&ret.arena, 0);
 
-	char* prop_name = NULL;
 	while(1){
-		char* lx = mdesc_get_lexem(fs, desc_fd);
-		if(!lx) break;
-
-		if(!prop_name)
-			prop_name = lx;
-		else{
+		// property names and values that are not kept are read to the scratch arena
+		kmem_scratch scr;
+		kmem_scratch_begin(&scr);
+		kmem_arena* tmp = scr.arena ? scr.arena : &ret.arena;
+		char* prop_name = mdesc_get_lexem(fs, desc_fd, tmp);
+		char* lx = prop_name ? mdesc_get_lexem(fs, desc_fd, tmp) : NULL;
+		if(lx){
 			if(!strcmp(prop_name, "dependencies") && !strcmp(lx, "{")){
-				ret.dependencies = mdesc_parse_list(fs, desc_fd);
+				ret.dependencies = mdesc_parse_list(fs, desc_fd, &ret.arena);
 			}
 			/*else if(!strcmp(lx, "=")){
 
 			}*/
-
-			kfree(lx);
-			kfree(prop_name);
-			prop_name = NULL;
 		}
+		kmem_scratch_end(&scr);
+		if(!lx) break;
 	}
-	if(prop_name)
-		kfree(prop_name);
 
 	return ret;
 }
@@ -164,7 +156,7 @@ module_loader_api gmapi = {NULL, NULL, 0};
 void module_init_api()
 {
 	#define GMAPI_ENTRY(sym) { size_t i = __COUNTER__; gmapi.symbols[i] = (uint64_t)(sym); gmapi.names[i] = #sym; }
-	gmapi.length = 61;
+	gmapi.length = 77;
 	gmapi.symbols = kmalloc(sizeof(uint64_t) * gmapi.length);
 	gmapi.names = kmalloc(sizeof(const char*) * gmapi.length);
 
@@ -241,6 +233,24 @@ void module_init_api()
 		GMAPI_ENTRY(krealloc_align)
 		GMAPI_ENTRY(kfree)
 		GMAPI_ENTRY(print_kmem_llist)
+		GMAPI_ENTRY(kmem_get_stats)
+		GMAPI_ENTRY(print_kmem_stats)
+		// kernarena.h
+		GMAPI_ENTRY(kmem_arena_create)
+		GMAPI_ENTRY(kmem_arena_alloc)
+		GMAPI_ENTRY(kmem_arena_reset)
+		GMAPI_ENTRY(kmem_arena_destroy)
+		GMAPI_ENTRY(kmem_arena_save)
+		GMAPI_ENTRY(kmem_arena_restore)
+		GMAPI_ENTRY(kmem_scratch_begin)
+		GMAPI_ENTRY(kmem_scratch_alloc)
+		GMAPI_ENTRY(kmem_scratch_end)
+		// kerncache.h
+		GMAPI_ENTRY(kmem_cache_create)
+		GMAPI_ENTRY(kmem_cache_destroy)
+		GMAPI_ENTRY(kmem_cache_alloc)
+		GMAPI_ENTRY(kmem_cache_free)
+		GMAPI_ENTRY(kmem_cache_reserve)
 	// /log
 		// boot_log.h
 		GMAPI_ENTRY(boot_log_putchar)
@@ -2,10 +2,12 @@
 #define MODULE_H
 
 #include "../kernlib/kernmem.h"
+#include "../kernlib/kernarena.h"
 #include "../fs/fs.h"
 
 typedef struct{
 	char** dependencies;
+	kmem_arena arena; // holds all strings and lists of the description
 } module_desc;
 
 typedef struct{
@@ -16,6 +16,7 @@ int cpu_init()
 		return CPU_INITERR_NOCPUID;
 	if(!apic_check())
 		return CPU_INITERR_NOAPIC;
+	apic_cpu_id_init();
 
 	apic_timer_init();
 	pic_remap_irqs(0x20, 0x28);
@@ -9,6 +9,20 @@ static inline void cpu_interrupt_set(int enabled)
 	if(enabled)	asm volatile ("sti");
 	else		asm volatile ("cli");
 }
+/* Disables interrupts and returns previous state of the flags register, to be passed to cpu_interrupt_restore(). */
+static inline uint64_t cpu_interrupt_save()
+{
+	uint64_t flags;
+	asm volatile ("pushfq\n"
+				  "pop %0\n"
+				  "cli" : "=r"(flags) :: "memory");
+	return flags;
+}
+static inline void cpu_interrupt_restore(uint64_t flags)
+{
+	if(flags & 0x200) // IF bit
+		asm volatile ("sti" ::: "memory");
+}
 
 // Generic interrupt types
 #define CPU_INT_TYPE_INTERRUPT	0
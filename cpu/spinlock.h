@@ -11,15 +11,17 @@ inline void spinlock_lock(spinlock* s)
 {
 	unsigned char set = 0;
 	while(!set){
-		asm volatile ("lock cmpxchgl %2, %1\n"
+		int expected = 0; // cmpxchg overwrites eax on failure, so it has to be reset every try
+		asm volatile ("lock cmpxchgl %3, %1\n"
 					  "sete %0\n"
-					: "=q"(set), "=m" (*s)
-					: "r" (1), "m"(*s), "a"(0)
+					: "=q"(set), "+m" (*s), "+a"(expected)
+					: "r" (1)
 					: "memory");
 	}
 }
 inline void spinlock_unlock(spinlock* s)
 {
+	asm volatile ("" ::: "memory");
 	*s = 0;
 }
 
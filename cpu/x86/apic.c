@@ -24,6 +24,23 @@ void lapic_write(uint32_t reg, uint32_t val)
 	*(volatile uint32_t *)((uintptr_t)APIC_BASE + reg) = val;
 }
 
+#define MSR_TSC_AUX		0xC0000103
+
+uint8_t apic_cpu_id_src = APIC_CPU_ID_LAPIC;
+
+void apic_cpu_id_init()
+{
+	uint32_t eax, ebx, ecx, edx;
+	uint8_t src = APIC_CPU_ID_LAPIC;
+	if(cpuid(0x80000001, 0x0, &eax, &ebx, &ecx, &edx) && (edx & CPUID_EXT_FEAT_EDX_RDTSCP))
+		src = APIC_CPU_ID_RDTSCP;
+	if(cpuid(0x7, 0x0, &eax, &ebx, &ecx, &edx) && (ecx & CPUID_EXT7_ECX_RDPID))
+		src = APIC_CPU_ID_RDPID;
+	if(src != APIC_CPU_ID_LAPIC)
+		cpu_out_msr(MSR_TSC_AUX, lapic_read(LAPIC_REG_ID) >> 24);
+	apic_cpu_id_src = src; // the BSP sets it before APs are started
+}
+
 void apic_enable_spurious_ints()
 {
 	lapic_write(LAPIC_REG_SPURIOUS_INT, lapic_read(LAPIC_REG_SPURIOUS_INT) | 0x100);
@@ -18,6 +18,8 @@
 
 #define LAPIC_IPI_INIT			0x4500
 #define LAPIC_IPI_STARTUP		0x4600
+#define LAPIC_IPI_ALL_BUT_SELF	0xC4000	// fixed interrupt to all other CPUs, OR'ed with the vector
+#define LAPIC_ICR_PENDING		(1 << 12)	// the last IPI wasn't accepted yet
 
 /* Returns 0 if LAPIC is not supported, 1 otherwise. */
 int apic_check();
@@ -27,6 +29,32 @@ void lapic_write(uint32_t reg, uint32_t val);
 
 void apic_enable_spurious_ints(); // enables spurious interrupts on local APIC
 
+/* CPU identification
+*  Reading the LAPIC ID register is an uncached MMIO access, so every CPU also keeps it's LAPIC ID in IA32_TSC_AUX,
+*  where RDPID or RDTSCP read it back. apic_cpu_id_init() should be called by each CPU before it uses apic_cpu_id(),
+*  the BSP calls it first. The LAPIC register is still read if neither instruction is supported.
+*/
+#define APIC_CPU_ID_LAPIC		0
+#define APIC_CPU_ID_RDTSCP		1
+#define APIC_CPU_ID_RDPID		2
+extern uint8_t apic_cpu_id_src;
+
+void apic_cpu_id_init();
+static inline uint32_t apic_cpu_id()
+{
+	if(apic_cpu_id_src == APIC_CPU_ID_RDPID){
+		uint64_t id;
+		asm volatile("rdpid %0" : "=r"(id));
+		return (uint32_t)id;
+	}
+	if(apic_cpu_id_src == APIC_CPU_ID_RDTSCP){
+		uint32_t eax, edx, ecx;
+		asm volatile("rdtscp" : "=a"(eax), "=d"(edx), "=c"(ecx));
+		return ecx;
+	}
+	return lapic_read(LAPIC_REG_ID) >> 24;
+}
+
 /* APIC timer */
 void apic_timer_init();
 #define APIC_TIMER_ONESHOT		0
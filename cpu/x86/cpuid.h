@@ -4,9 +4,11 @@
 #include <stdint.h>
 
 #define CPUID_FEAT_EDX_APIC		(1 << 9)
+#define CPUID_EXT_FEAT_EDX_RDTSCP	(1 << 27)	// leaf 0x80000001
+#define CPUID_EXT7_ECX_RDPID		(1 << 22)	// leaf 0x7
 
 int cpuid_check();
-/* Return value: 0 if eax_in (leaf) is out of valid range, 1 otherwise */
+/* Return value: 0 if eax_in (leaf) is out of valid range (basic or extended, 0x80000000 and up), 1 otherwise */
 int cpuid(uint64_t eax_in, uint64_t ecx_in,
 			uint32_t* eax_out, uint32_t* ebx_out, uint32_t* ecx_out, uint32_t* edx_out);
 
@@ -19,8 +19,9 @@ cpuid:
 	mov r10, rdx
 	mov r11, rcx
 
-	; first check the leaf supplied in eax is within valid range
-	mov rax, 0x0
+	; first check the leaf supplied in eax is within valid range (of basic or extended leaves)
+	mov eax, edi
+	and eax, 0x80000000
 	mov rcx, 0x0
 	cpuid
 	cmp rax, rdi	; compare maximum CPUID value returned by CPUID with supplied leaf number
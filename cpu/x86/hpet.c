@@ -2,6 +2,7 @@
 #include "rsdp.h"
 #include "string.h"
 #include "kernlib/kernmem.h"
+#include "modules/vmemory/vmemory.h"
 
 static hpet_desc_table** hpet_timer_blocks = NULL;
 static size_t hpet_timer_blocks_cnt = 0;
@@ -26,7 +27,7 @@ int hpet_init(int (*map_phys)(void*, void*, uint64_t, int), uint64_t mem_unit_si
 			hpet_timer_blocks[hpet_timer_blocks_cnt - 1] = table;
 
 			void* base_addr_aligned = (void*)table->base_addr.addr - (uintptr_t)table->base_addr.addr % mem_unit_size;
-			map_phys(base_addr_aligned, base_addr_aligned, 1, 0);
+			map_phys(base_addr_aligned, base_addr_aligned, 1, VMEM_FLAG_UC);
 
 			ent += table->length;
 		}
@@ -2,6 +2,17 @@
 
 #include "../cstdlib/string.h"
 #include "../kernlib/kernmem.h"
+#include "../kernlib/kernarena.h"
+#include "../kernlib/kerncache.h"
+
+// Ends scratch scope scr and returns ret (nothing in void functions) if buf couldn't be allocated
+#define CHECK_SCRATCH_ALLOC(buf, scr, ret)\
+{\
+	if(!(buf)){\
+		kmem_scratch_end(&(scr));\
+		return ret;\
+	}\
+}
 
 // ---------------------
 // Public read interface
@@ -32,9 +43,12 @@ void fs_ext2_read_sb(ata_drive* drive, fs_ext2_sb* sb)
 	}
 }
 
-void fs_ext2_read_blkgrp_table(ata_drive* drive, fs_ext2_sb* sb, fs_ext2_blkgrp_table* table)
+int fs_ext2_read_blkgrp_table(ata_drive* drive, fs_ext2_sb* sb, fs_ext2_blkgrp_table* table)
 {
-	fs_ext2_blkgrp* rbuf = kmalloc(FS_EXT2_SB_BLOCKSIZE(*sb));
+	kmem_scratch scr;
+	kmem_scratch_begin(&scr);
+	fs_ext2_blkgrp* rbuf = kmem_scratch_alloc(&scr, FS_EXT2_SB_BLOCKSIZE(*sb));
+	CHECK_SCRATCH_ALLOC(rbuf, scr, FS_ERR_NO_MEMORY);
 
 	// Seeking to the beginning of the block after superblock
 	uint64_t table_lba;
@@ -54,22 +68,27 @@ void fs_ext2_read_blkgrp_table(ata_drive* drive, fs_ext2_sb* sb, fs_ext2_blkgrp_
 		b += db;
 	}
 
-	kfree(rbuf);
+	kmem_scratch_end(&scr);
+	return 0;
 }
 
-void fs_ext2_read_inode(ata_drive* drive, fs_ext2_sb* sb, fs_ext2_blkgrp_table* bt,
+int fs_ext2_read_inode(ata_drive* drive, fs_ext2_sb* sb, fs_ext2_blkgrp_table* bt,
 				uint32_t inode_num, fs_ext2_inode* _out)
 {
 	uint32_t blkgrp = (inode_num - 1) / sb->inodes_per_group;
 	uint32_t tind = (inode_num - 1) % sb->inodes_per_group;
 	uint32_t baddr = (tind * sb->inode_size) / FS_EXT2_SB_BLOCKSIZE(*sb);
 
-	void* buf = kmalloc(FS_EXT2_SB_BLOCKSIZE(*sb));
+	kmem_scratch scr;
+	kmem_scratch_begin(&scr);
+	void* buf = kmem_scratch_alloc(&scr, FS_EXT2_SB_BLOCKSIZE(*sb));
+	CHECK_SCRATCH_ALLOC(buf, scr, FS_ERR_NO_MEMORY);
 	drive->read(drive, (bt->groups[blkgrp].inode_table_addr + baddr) * FS_EXT2_SB_BLOCKSECTORS(*sb),
 			FS_EXT2_SB_BLOCKSECTORS(*sb), buf);
 	memcpy(_out, buf + (sb->inode_size * tind) % FS_EXT2_SB_BLOCKSIZE(*sb), sb->inode_size);
 
-	kfree(buf);
+	kmem_scratch_end(&scr);
+	return 0;
 }
 
 
@@ -186,7 +205,10 @@ int fs_ext2_iterate_dir_next(ata_drive* drive, fs_ext2_sb* sb, fs_ext2_dir_itera
 uint32_t fs_ext2_find_grp_unalloc_block(ata_drive* drive, fs_ext2_sb* sb,
 						fs_ext2_blkgrp_table* bt, uint32_t blkgrp)
 {
-	void* buf = kmalloc(FS_EXT2_SB_BLOCKSIZE(*sb));
+	kmem_scratch scr;
+	kmem_scratch_begin(&scr);
+	void* buf = kmem_scratch_alloc(&scr, FS_EXT2_SB_BLOCKSIZE(*sb));
+	CHECK_SCRATCH_ALLOC(buf, scr, (uint32_t)-1);
 
 	for(size_t bmb = bt->groups[blkgrp].block_bitmap_addr;
 		bmb < bt->groups[blkgrp].inode_bitmap_addr;
@@ -201,13 +223,13 @@ uint32_t fs_ext2_find_grp_unalloc_block(ata_drive* drive, fs_ext2_sb* sb,
 				uint8_t bsh = 0;
 				while(b & 0x80) { b <<= 1; bsh++; }
 
-				kfree(buf);
+				kmem_scratch_end(&scr);
 				return (bind * 8 + bsh);
 			}
 		}
 	}
 
-	kfree(buf);
+	kmem_scratch_end(&scr);
 	return (uint32_t)-1;
 }
 uint32_t fs_ext2_find_unalloc_block(ata_drive* drive, fs_ext2_sb* sb,
@@ -233,7 +255,10 @@ uint32_t fs_ext2_find_unalloc_block(ata_drive* drive, fs_ext2_sb* sb,
 uint32_t fs_ext2_find_grp_unalloc_inode(ata_drive* drive, fs_ext2_sb* sb,
 					fs_ext2_blkgrp_table* bt, uint32_t blkgrp)
 {
-	void* buf = kmalloc(FS_EXT2_SB_BLOCKSIZE(*sb));
+	kmem_scratch scr;
+	kmem_scratch_begin(&scr);
+	void* buf = kmem_scratch_alloc(&scr, FS_EXT2_SB_BLOCKSIZE(*sb));
+	CHECK_SCRATCH_ALLOC(buf, scr, 0);
 
 	for(size_t bmb = bt->groups[blkgrp].inode_bitmap_addr;
 		bmb < bt->groups[blkgrp].inode_bitmap_addr +
@@ -258,13 +283,13 @@ uint32_t fs_ext2_find_grp_unalloc_inode(ata_drive* drive, fs_ext2_sb* sb,
 					++bsh;
 				}
 
-				kfree(buf);
+				kmem_scratch_end(&scr);
 				return (bind * 8 + bsh) + 1;
 			}
 		}
 	}
 
-	kfree(buf);
+	kmem_scratch_end(&scr);
 	return 0;
 }
 uint32_t fs_ext2_find_unalloc_inode(ata_drive* drive, fs_ext2_sb* sb,
@@ -326,7 +351,10 @@ void fs_ext2_mark_alloc_inode(ata_drive* drive, fs_ext2_sb* sb,
 	uint32_t blkgrp = (inode_num - 1) / sb->inodes_per_group;
 	uint32_t tind = (inode_num - 1) % sb->inodes_per_group; // index withing block group
 
-	void* buf = kmalloc(ATA_SECTOR_SIZE);
+	kmem_scratch scr;
+	kmem_scratch_begin(&scr);
+	void* buf = kmem_scratch_alloc(&scr, ATA_SECTOR_SIZE);
+	CHECK_SCRATCH_ALLOC(buf, scr, );
 
 	uint32_t bmp_addr = bt->groups[blkgrp].inode_bitmap_addr * FS_EXT2_SB_BLOCKSECTORS(*sb)
 				+ tind / 8 / ATA_SECTOR_SIZE;
@@ -336,7 +364,7 @@ void fs_ext2_mark_alloc_inode(ata_drive* drive, fs_ext2_sb* sb,
 	((uint8_t*)buf)[bmp_byte] |= 1 << (7 - bmp_bit);
 	drive->write(drive, bmp_addr, 1, buf);
 
-	kfree(buf);
+	kmem_scratch_end(&scr);
 }
 
 void fs_ext2_mark_alloc_block(ata_drive* drive, fs_ext2_sb* sb,
@@ -345,7 +373,10 @@ void fs_ext2_mark_alloc_block(ata_drive* drive, fs_ext2_sb* sb,
 	uint32_t blkgrp = (block_num) / sb->blocks_per_group;
 	uint32_t tind = (block_num) % sb->blocks_per_group; // index withing block group
 
-	void* buf = kmalloc(ATA_SECTOR_SIZE);
+	kmem_scratch scr;
+	kmem_scratch_begin(&scr);
+	void* buf = kmem_scratch_alloc(&scr, ATA_SECTOR_SIZE);
+	CHECK_SCRATCH_ALLOC(buf, scr, );
 
 	uint32_t bmp_addr = bt->groups[blkgrp].block_bitmap_addr * FS_EXT2_SB_BLOCKSECTORS(*sb)
 				+ tind / 8 / ATA_SECTOR_SIZE;
@@ -355,7 +386,7 @@ void fs_ext2_mark_alloc_block(ata_drive* drive, fs_ext2_sb* sb,
 	((uint8_t*)buf)[bmp_byte] |= 1 << (7 - bmp_bit);
 	drive->write(drive, bmp_addr, 1, buf);
 
-	kfree(buf);
+	kmem_scratch_end(&scr);
 }
 
 void fs_ext2_mark_unalloc_inode(ata_drive* drive, fs_ext2_sb* sb,
@@ -364,7 +395,10 @@ void fs_ext2_mark_unalloc_inode(ata_drive* drive, fs_ext2_sb* sb,
 	uint32_t blkgrp = (inode_num - 1) / sb->inodes_per_group;
 	uint32_t tind = (inode_num - 1) % sb->inodes_per_group; // index withing block group
 
-	void* buf = kmalloc(ATA_SECTOR_SIZE);
+	kmem_scratch scr;
+	kmem_scratch_begin(&scr);
+	void* buf = kmem_scratch_alloc(&scr, ATA_SECTOR_SIZE);
+	CHECK_SCRATCH_ALLOC(buf, scr, );
 
 	uint32_t bmp_addr = bt->groups[blkgrp].inode_bitmap_addr * FS_EXT2_SB_BLOCKSECTORS(*sb)
 				+ tind / 8 / ATA_SECTOR_SIZE;
@@ -374,7 +408,7 @@ void fs_ext2_mark_unalloc_inode(ata_drive* drive, fs_ext2_sb* sb,
 	((uint8_t*)buf)[bmp_byte] &= ~(1 << (7 - bmp_bit));
 	drive->write(drive, bmp_addr, 1, buf);
 
-	kfree(buf);
+	kmem_scratch_end(&scr);
 }
 
 void fs_ext2_mark_unalloc_block(ata_drive* drive, fs_ext2_sb* sb,
@@ -383,7 +417,10 @@ void fs_ext2_mark_unalloc_block(ata_drive* drive, fs_ext2_sb* sb,
 	uint32_t blkgrp = (block_num - 1) / sb->blocks_per_group;
 	uint32_t tind = (block_num - 1) % sb->blocks_per_group; // index withing block group
 
-	void* buf = kmalloc(ATA_SECTOR_SIZE);
+	kmem_scratch scr;
+	kmem_scratch_begin(&scr);
+	void* buf = kmem_scratch_alloc(&scr, ATA_SECTOR_SIZE);
+	CHECK_SCRATCH_ALLOC(buf, scr, );
 
 	uint32_t bmp_addr = bt->groups[blkgrp].block_bitmap_addr * FS_EXT2_SB_BLOCKSECTORS(*sb)
 				+ tind / 8 / ATA_SECTOR_SIZE;
@@ -393,7 +430,7 @@ void fs_ext2_mark_unalloc_block(ata_drive* drive, fs_ext2_sb* sb,
 	((uint8_t*)buf)[bmp_byte] &= ~(1 << (7 - bmp_bit));
 	drive->write(drive, bmp_addr, 1, buf);
 
-	kfree(buf);
+	kmem_scratch_end(&scr);
 }
 
 
@@ -404,24 +441,27 @@ void fs_ext2_write_inode(ata_drive* drive, fs_ext2_sb* sb, fs_ext2_blkgrp_table*
 	uint32_t tind = (inode_num - 1) % sb->inodes_per_group;
 	uint32_t baddr = (tind * sb->inode_size) / FS_EXT2_SB_BLOCKSIZE(*sb);
 
-	void* buf = kmalloc(FS_EXT2_SB_BLOCKSIZE(*sb));
+	kmem_scratch scr;
+	kmem_scratch_begin(&scr);
+	void* buf = kmem_scratch_alloc(&scr, FS_EXT2_SB_BLOCKSIZE(*sb));
+	CHECK_SCRATCH_ALLOC(buf, scr, );
 	drive->read(drive, (bt->groups[blkgrp].inode_table_addr + baddr) * FS_EXT2_SB_BLOCKSECTORS(*sb),
 			FS_EXT2_SB_BLOCKSECTORS(*sb), buf);
 	memcpy(buf + sb->inode_size * tind, _in, sb->inode_size);
 	drive->write(drive, (bt->groups[blkgrp].inode_table_addr + baddr) * FS_EXT2_SB_BLOCKSECTORS(*sb),
 			FS_EXT2_SB_BLOCKSECTORS(*sb), buf);
 
-	kfree(buf);
+	kmem_scratch_end(&scr);
 }
 
 
-#define TRY_ALLOC_IBP(ibp, buf)\
+#define TRY_ALLOC_IBP(ibp, buf, scr)\
 {\
 	if(!(ibp)){\
 		uint32_t blkgrp_start = (inode_num - 1) / sb->inodes_per_group;\
 		(ibp) = fs_ext2_find_unalloc_block(drive, sb, bt, blkgrp_start);\
 		if(!(ibp)){\
-			kfree(buf);\
+			kmem_scratch_end(&(scr));\
 			return 0;\
 		}\
 		fs_ext2_mark_alloc_block(drive, sb, bt, (ibp));\
@@ -431,6 +471,7 @@ void fs_ext2_write_inode(ata_drive* drive, fs_ext2_sb* sb, fs_ext2_blkgrp_table*
 		drive->write(drive, (ibp) * FS_EXT2_SB_BLOCKSECTORS(*sb)\
 				+ (sibp_addr * sizeof(uint32_t) / ATA_SECTOR_SIZE),\
 				ATA_SECTOR_SIZE, buf);\
+		kmem_scratch_end(&(scr));\
 		return 1;\
 	}\
 }
@@ -447,9 +488,12 @@ int fs_ext2_write_inode_block_pointer(ata_drive* drive, fs_ext2_sb* sb, fs_ext2_
 	else if(bind < 12 + DBP_PER_BLOCK){ // accessing a SIBP
 		uint32_t sibp_addr = bind - 12;
 
-		void* buf = kmalloc(ATA_SECTOR_SIZE);
+		kmem_scratch scr;
+		kmem_scratch_begin(&scr);
+		void* buf = kmem_scratch_alloc(&scr, ATA_SECTOR_SIZE);
+		CHECK_SCRATCH_ALLOC(buf, scr, 0);
 
-		TRY_ALLOC_IBP(inode->sibp, buf);
+		TRY_ALLOC_IBP(inode->sibp, buf, scr);
 
 		drive->read(drive, inode->sibp * FS_EXT2_SB_BLOCKSECTORS(*sb)
 				+ (sibp_addr * sizeof(uint32_t) / ATA_SECTOR_SIZE),
@@ -459,14 +503,17 @@ int fs_ext2_write_inode_block_pointer(ata_drive* drive, fs_ext2_sb* sb, fs_ext2_
 				+ (sibp_addr * sizeof(uint32_t) / ATA_SECTOR_SIZE),
 				ATA_SECTOR_SIZE, buf);
 
-		kfree(buf);
+		kmem_scratch_end(&scr);
 	}
 	else if(bind < 12 + DBP_PER_BLOCK + DBP_PER_BLOCK * DBP_PER_BLOCK){ // accessing a DIBP
-		void* buf = kmalloc(ATA_SECTOR_SIZE);
+		kmem_scratch scr;
+		kmem_scratch_begin(&scr);
+		void* buf = kmem_scratch_alloc(&scr, ATA_SECTOR_SIZE);
+		CHECK_SCRATCH_ALLOC(buf, scr, 0);
 		uint32_t dibp_addr = (bind - 12 - DBP_PER_BLOCK) / DBP_PER_BLOCK; // address of SIBP block which contains the needed DBP
 		uint32_t sibp_addr = (bind - 12 - DBP_PER_BLOCK) % DBP_PER_BLOCK; // address of DBP inside the located SIBP
 
-		TRY_ALLOC_IBP(inode->dibp, buf);
+		TRY_ALLOC_IBP(inode->dibp, buf, scr);
 
 		drive->read(drive, inode->dibp * FS_EXT2_SB_BLOCKSECTORS(*sb),
 				FS_EXT2_SB_BLOCKSECTORS(*sb), buf); // read block DIBP is pointing to
@@ -480,15 +527,18 @@ int fs_ext2_write_inode_block_pointer(ata_drive* drive, fs_ext2_sb* sb, fs_ext2_
 				+ (sibp_addr * sizeof(uint32_t) / ATA_SECTOR_SIZE),
 				ATA_SECTOR_SIZE, buf);
 
-		kfree(buf);
+		kmem_scratch_end(&scr);
 	}
 	else{ // accessing a TIBP
-		void* buf = kmalloc(ATA_SECTOR_SIZE);
+		kmem_scratch scr;
+		kmem_scratch_begin(&scr);
+		void* buf = kmem_scratch_alloc(&scr, ATA_SECTOR_SIZE);
+		CHECK_SCRATCH_ALLOC(buf, scr, 0);
 		uint32_t tibp_addr = (bind - 12 - DBP_PER_BLOCK - DBP_PER_BLOCK * DBP_PER_BLOCK) / DBP_PER_BLOCK * DBP_PER_BLOCK; // address of DIBP block which contains the needed SIBP
 		uint32_t dibp_addr = (bind - 12 - DBP_PER_BLOCK - DBP_PER_BLOCK * DBP_PER_BLOCK) / DBP_PER_BLOCK; // address of SIBP block which contains the needed DBP
 		uint32_t sibp_addr = (bind - 12 - DBP_PER_BLOCK - DBP_PER_BLOCK * DBP_PER_BLOCK) % DBP_PER_BLOCK; // address of DBP inside the located SIBP
 
-		TRY_ALLOC_IBP(inode->tibp, buf);
+		TRY_ALLOC_IBP(inode->tibp, buf, scr);
 
 		drive->read(drive, inode->tibp * FS_EXT2_SB_BLOCKSECTORS(*sb),
 				FS_EXT2_SB_BLOCKSECTORS(*sb), buf); // read the block TIBP is pointing to
@@ -505,7 +555,7 @@ int fs_ext2_write_inode_block_pointer(ata_drive* drive, fs_ext2_sb* sb, fs_ext2_
 				+ (sibp_addr * sizeof(uint32_t) / ATA_SECTOR_SIZE),
 				ATA_SECTOR_SIZE, buf);
 
-		kfree(buf);
+		kmem_scratch_end(&scr);
 	}
 	return 1;
 }
@@ -582,6 +632,9 @@ int fs_ext2_write_inode_data(ata_drive* drive, fs_ext2_sb* sb, fs_ext2_inode* in
 typedef struct{
 	fs_ext2_sb sb;
 	fs_ext2_blkgrp_table bt;
+
+	kmem_cache* inode_cache;	// inodes of open files
+	kmem_cache* blk_cache;		// block buffers of open files and directory iterators
 } gfs_ext2_gdata;
 
 typedef struct{
@@ -624,19 +677,50 @@ int fs_ext2_gfs_detect(file_system* fs)
 	return 0;
 }
 
-void fs_ext2_gfs_init(file_system* fs)
+static void fs_ext2_gfs_deinit(file_system* fs)
+{
+	gfs_ext2_gdata* gdat = (gfs_ext2_gdata*)fs->gdata;
+	if(gdat->inode_cache)
+		kmem_cache_destroy(gdat->inode_cache);
+	if(gdat->blk_cache)
+		kmem_cache_destroy(gdat->blk_cache);
+	kfree(gdat->bt.groups);
+	kfree(gdat);
+	fs->gdata = NULL;
+}
+
+int fs_ext2_gfs_init(file_system* fs)
 {
 	fs->name = "ext2";
 
 	fs->gdata = kmalloc(sizeof(gfs_ext2_gdata));
+	if(!fs->gdata)
+		return FS_ERR_NO_MEMORY;
 	gfs_ext2_gdata* gdat = (gfs_ext2_gdata*)fs->gdata;
 
 	fs_ext2_read_sb(fs->drive, &gdat->sb);
 
 	gdat->bt = (fs_ext2_blkgrp_table){kmalloc(FS_EXT2_SB_BLOCKGROUPS_TOTAL(gdat->sb) * sizeof(fs_ext2_blkgrp)),
 			FS_EXT2_SB_BLOCKGROUPS_TOTAL(gdat->sb)};
-	fs_ext2_read_blkgrp_table(fs->drive, &gdat->sb, &gdat->bt);
+	gdat->inode_cache = gdat->blk_cache = NULL;
+	if(!gdat->bt.groups){
+		fs_ext2_gfs_deinit(fs);
+		return FS_ERR_NO_MEMORY;
+	}
+	int err = fs_ext2_read_blkgrp_table(fs->drive, &gdat->sb, &gdat->bt);
+	if(err){
+		fs_ext2_gfs_deinit(fs);
+		return err;
+	}
+
+	gdat->inode_cache = kmem_cache_create(gdat->sb.inode_size, 8, NULL);
+	gdat->blk_cache = kmem_cache_create(FS_EXT2_SB_BLOCKSIZE(gdat->sb), 16, NULL);
+	if(!gdat->inode_cache || !gdat->blk_cache){
+		fs_ext2_gfs_deinit(fs);
+		return FS_ERR_NO_MEMORY;
+	}
 
+	fs->deinit = &fs_ext2_gfs_deinit;
 	fs->fd_size = sizeof(gfs_ext2_fd);
 	fs->dit_size = sizeof(fs_ext2_dir_iterator);
 
@@ -651,6 +735,7 @@ void fs_ext2_gfs_init(file_system* fs)
 	fs->write = &fs_ext2_write;
 	fs->dir_iter_start = &fs_ext2_dir_iter_start;
 	fs->dir_iter_next = &fs_ext2_dir_iter_next;
+	return 0;
 }
 
 static inline int fs_ext2_type_fs2ext2_inode(int fs_type)
@@ -704,19 +789,26 @@ static int fs_ext2_find_final_inode(file_system* fs, const char* path,
 {
 	gfs_ext2_gdata* gdat = (gfs_ext2_gdata*)fs->gdata;
 
-	char* path_buf = kmalloc(strlen(path) + 1);
-	char* path_buf_fptr = path_buf;
+	kmem_scratch scr;
+	kmem_scratch_begin(&scr);
+	char* path_buf = kmem_scratch_alloc(&scr, strlen(path) + 1);
+	CHECK_SCRATCH_ALLOC(path_buf, scr, FS_ERR_NO_MEMORY);
 	strcpy(path_buf, path);
 
 	fs_ext2_inode cur_dir;
 	uint32_t cur_inode_num = FS_EXT2_ROOT_INODE;
 
 	fs_ext2_dir_iterator it;
-	void* it_buf = kmalloc(FS_EXT2_SB_BLOCKSIZE(gdat->sb));
+	void* it_buf = kmem_scratch_alloc(&scr, FS_EXT2_SB_BLOCKSIZE(gdat->sb));
+	CHECK_SCRATCH_ALLOC(it_buf, scr, FS_ERR_NO_MEMORY);
 	const char* fcur;
 	while( (fcur = fs_next_file(&path_buf)) )
 	{
-		fs_ext2_read_inode(fs->drive, &gdat->sb, &gdat->bt, cur_inode_num, &cur_dir);
+		int err = fs_ext2_read_inode(fs->drive, &gdat->sb, &gdat->bt, cur_inode_num, &cur_dir);
+		if(err){
+			kmem_scratch_end(&scr);
+			return err;
+		}
 		fs_ext2_iterate_dir_start(fs->drive, &gdat->sb, &cur_dir, &it, it_buf);
 
 		cur_inode_num = 0;
@@ -729,15 +821,16 @@ static int fs_ext2_find_final_inode(file_system* fs, const char* path,
 		}
 
 		if(!cur_inode_num){
-			kfree(it_buf); kfree(path_buf_fptr);
+			kmem_scratch_end(&scr);
 			return FS_ERR_DOESNT_EXIST;
 		}
 	}
 
-	fs_ext2_read_inode(fs->drive, &gdat->sb, &gdat->bt, cur_inode_num, _out);
-	*_num_out = cur_inode_num;
-	kfree(it_buf); kfree(path_buf_fptr);
-	return 0;
+	int err = fs_ext2_read_inode(fs->drive, &gdat->sb, &gdat->bt, cur_inode_num, _out);
+	if(!err)
+		*_num_out = cur_inode_num;
+	kmem_scratch_end(&scr);
+	return err;
 }
 
 #define SET_DIRENT_NAMELN(de_nameln, gdat, de)\
@@ -758,7 +851,10 @@ static int fs_ext2_occupy_vacant_dirent(file_system* fs, fs_ext2_inode* dir, uin
 
 	#define DIRENT_SZ_WO_NAME (sizeof(it.cur) - sizeof(it.cur.name))
 	fs_ext2_dir_iterator it;
-	void* it_buf = kmalloc(FS_EXT2_SB_BLOCKSIZE(gdat->sb));
+	kmem_scratch scr;
+	kmem_scratch_begin(&scr);
+	void* it_buf = kmem_scratch_alloc(&scr, FS_EXT2_SB_BLOCKSIZE(gdat->sb));
+	CHECK_SCRATCH_ALLOC(it_buf, scr, 0);
 	fs_ext2_iterate_dir_start(fs->drive, &gdat->sb, dir, &it, it_buf);
 	while(fs_ext2_iterate_dir_next(fs->drive, &gdat->sb, &it))
 	{
@@ -777,7 +873,7 @@ static int fs_ext2_occupy_vacant_dirent(file_system* fs, fs_ext2_inode* dir, uin
 
 			// finally flushing changes to both entries to disk
 			fs_ext2_write_inode_data(fs->drive, &gdat->sb, dir, it.blki, it.blkbuf);
-			kfree(it_buf);
+			kmem_scratch_end(&scr);
 			return 1;
 		}
 
@@ -819,7 +915,7 @@ static int fs_ext2_occupy_vacant_dirent(file_system* fs, fs_ext2_inode* dir, uin
 
 			// finally flushing changes to both entries to disk
 			fs_ext2_write_inode_data(fs->drive, &gdat->sb, dir, it.blki, it.blkbuf);
-			kfree(it_buf);
+			kmem_scratch_end(&scr);
 			return 1;
 		}
 	}
@@ -827,8 +923,10 @@ static int fs_ext2_occupy_vacant_dirent(file_system* fs, fs_ext2_inode* dir, uin
 	uint32_t new_blk_grp = fs_ext2_get_inode_pointer(fs->drive, &gdat->sb, dir, it.blki, it.blkbuf) / gdat->sb.blocks_per_group;
 	uint32_t new_blk = fs_ext2_find_unalloc_block(fs->drive, &gdat->sb, &gdat->bt,
 					new_blk_grp);
-	if(!new_blk)
+	if(!new_blk){
+		kmem_scratch_end(&scr);
 		return 0;
+	}
 
 	fs_ext2_mark_alloc_block(fs->drive, &gdat->sb, &gdat->bt, new_blk);
 	// TODO: optimise to avoid 2 writes to disk
@@ -853,7 +951,7 @@ static int fs_ext2_occupy_vacant_dirent(file_system* fs, fs_ext2_inode* dir, uin
 	// writing changes on the buffer
 	fs_ext2_write_inode_data(fs->drive, &gdat->sb, dir, it.blki, it.blkbuf);
 
-	kfree(it_buf);
+	kmem_scratch_end(&scr);
 	return 1;
 	#undef DIRENT_SZ_WO_NAME
 }
@@ -886,15 +984,20 @@ static int fs_ext2_create(file_system* fs, const char* path, int type)
 	// directory that will store the new file
 	fs_ext2_inode fnode; uint32_t fnode_num;
 
-	char* path_buf = kmalloc(strlen(path) + 1);
+	kmem_scratch scr;
+	kmem_scratch_begin(&scr);
+	char* path_buf = kmem_scratch_alloc(&scr, strlen(path) + 1);
+	CHECK_SCRATCH_ALLOC(path_buf, scr, FS_ERR_NO_MEMORY);
 	const char* de_name;
 	fs_ext2_sep_fname_and_dir(path, path_buf, &de_name);
 	// don't allow empty names
-	if(*de_name == '\0')
+	if(*de_name == '\0'){
+		kmem_scratch_end(&scr);
 		return FS_ERR_INVALID_FILENAME;
+	}
 
 	int err = fs_ext2_find_final_inode(fs, path_buf, &fnode, &fnode_num);
-	kfree(path_buf);
+	kmem_scratch_end(&scr);
 	if(err)
 		return err;
 
@@ -953,7 +1056,10 @@ static void fs_ext2_remove_dirent(file_system* fs, fs_ext2_inode* dir, uint32_t
 	fs_ext2_dir_iterator it, it_prev;
 	#define DIRENT_SZ_WO_NAME (sizeof(it.cur) - sizeof(it.cur.name))
 	it_prev.is_valid = 0;
-	void* it_buf = kmalloc(FS_EXT2_SB_BLOCKSIZE(gdat->sb));
+	kmem_scratch scr;
+	kmem_scratch_begin(&scr);
+	void* it_buf = kmem_scratch_alloc(&scr, FS_EXT2_SB_BLOCKSIZE(gdat->sb));
+	CHECK_SCRATCH_ALLOC(it_buf, scr, );
 	fs_ext2_iterate_dir_start(fs->drive, &gdat->sb, dir, &it, it_buf);
 
 	while(fs_ext2_iterate_dir_next(fs->drive, &gdat->sb, &it))
@@ -976,8 +1082,10 @@ static void fs_ext2_remove_dirent(file_system* fs, fs_ext2_inode* dir, uint32_t
 				memcpy(it.blkbuf + it.byteaddr - it.cur.entry_sz, &it.cur, DIRENT_SZ_WO_NAME);
 				fs_ext2_write_inode_data(fs->drive, &gdat->sb, dir, it.blki, it.blkbuf);
 
-				void* tbuf = kmalloc(FS_EXT2_SB_BLOCKSIZE(gdat->sb));
-				if(it.cur.entry_sz == FS_EXT2_SB_BLOCKSIZE(gdat->sb)
+				kmem_scratch tscr;
+				kmem_scratch_begin(&tscr);
+				void* tbuf = kmem_scratch_alloc(&tscr, FS_EXT2_SB_BLOCKSIZE(gdat->sb));
+				if(tbuf && it.cur.entry_sz == FS_EXT2_SB_BLOCKSIZE(gdat->sb)
 				&& !fs_ext2_get_inode_pointer(fs->drive, &gdat->sb, dir, it.blki+1, tbuf))
 				{ // an empty direntry spans accross the whole block, meaning it can be safely freed if it's the last of pointers
 					fs_ext2_mark_unalloc_block(fs->drive, &gdat->sb, &gdat->bt,
@@ -985,7 +1093,7 @@ static void fs_ext2_remove_dirent(file_system* fs, fs_ext2_inode* dir, uint32_t
 					fs_ext2_write_inode_block_pointer(fs->drive, &gdat->sb, &gdat->bt,
 										dir, dir_num, it.blki, 0);
 				}
-				kfree(tbuf);
+				kmem_scratch_end(&tscr);
 			}
 			/* search continues to make sure duplicate entries are removed as well
 			 * (in case of hard links to file in the same directories)
@@ -994,14 +1102,17 @@ static void fs_ext2_remove_dirent(file_system* fs, fs_ext2_inode* dir, uint32_t
 		it_prev = it;
 	}
 
-	kfree(it_buf);
+	kmem_scratch_end(&scr);
 	#undef DIRENT_SZ_WO_NAME
 }
 
 static void fs_ext2_free_file(file_system* fs, fs_ext2_inode* file, uint32_t file_num)
 {
 	gfs_ext2_gdata* gdat = (gfs_ext2_gdata*)fs->gdata;
-	void* it_buf = kmalloc(FS_EXT2_SB_BLOCKSIZE(gdat->sb));
+	kmem_scratch scr;
+	kmem_scratch_begin(&scr);
+	void* it_buf = kmem_scratch_alloc(&scr, FS_EXT2_SB_BLOCKSIZE(gdat->sb));
+	CHECK_SCRATCH_ALLOC(it_buf, scr, );
 
 	// mark all dedicated blocks as free
 	uint32_t ptr;
@@ -1015,7 +1126,7 @@ static void fs_ext2_free_file(file_system* fs, fs_ext2_inode* file, uint32_t fil
 	// mark file inode as free
 	fs_ext2_mark_unalloc_inode(fs->drive, &gdat->sb, &gdat->bt, file_num);
 
-	kfree(it_buf);
+	kmem_scratch_end(&scr);
 }
 
 
@@ -1033,13 +1144,16 @@ static int fs_ext2_unlink(file_system* fs, const char* path)
 		return err;
 
 	// Finding directory to unlink the file from
-	char* path_buf = kmalloc(strlen(path) + 1);
+	kmem_scratch scr;
+	kmem_scratch_begin(&scr);
+	char* path_buf = kmem_scratch_alloc(&scr, strlen(path) + 1);
+	CHECK_SCRATCH_ALLOC(path_buf, scr, FS_ERR_NO_MEMORY);
 	const char* dir_name;
 	fs_ext2_sep_fname_and_dir(path, path_buf, &dir_name);
 
 	fs_ext2_inode dirnode; uint32_t dirnode_num;
 	err = fs_ext2_find_final_inode(fs, path_buf, &dirnode, &dirnode_num);
-	kfree(path_buf);
+	kmem_scratch_end(&scr);
 	if(err)
 		return err;
 
@@ -1072,8 +1186,14 @@ static int fs_ext2_unlink(file_system* fs, const char* path)
 static int fs_ext2_rename(file_system* fs, const char* old, const char* _new)
 {
 	// finding old and new directories for the file
-	char* old_buf = kmalloc(strlen(old) + 1);
-	char* new_buf = kmalloc(strlen(_new) + 1);
+	kmem_scratch scr;
+	kmem_scratch_begin(&scr);
+	char* old_buf = kmem_scratch_alloc(&scr, strlen(old) + 1);
+	char* new_buf = kmem_scratch_alloc(&scr, strlen(_new) + 1);
+	if(!old_buf || !new_buf){
+		kmem_scratch_end(&scr);
+		return FS_ERR_NO_MEMORY;
+	}
 	const char* new_fname;
 	fs_ext2_sep_fname_and_dir(old, old_buf, &new_fname);
 	fs_ext2_sep_fname_and_dir(_new, new_buf, &new_fname);
@@ -1081,14 +1201,13 @@ static int fs_ext2_rename(file_system* fs, const char* old, const char* _new)
 	fs_ext2_inode old_dir_node, new_dir_node;
 	uint32_t old_dir_num, new_dir_num;
 	int err = fs_ext2_find_final_inode(fs, old_buf, &old_dir_node, &old_dir_num);
-	kfree(old_buf);
 	if(err){
-		kfree(new_buf);
+		kmem_scratch_end(&scr);
 		return err;
 	}
 	err = fs_ext2_find_final_inode(fs, new_buf, &new_dir_node, &new_dir_num);
 	if(err){
-		kfree(new_buf);
+		kmem_scratch_end(&scr);
 		return err;
 	}
 
@@ -1096,7 +1215,7 @@ static int fs_ext2_rename(file_system* fs, const char* old, const char* _new)
 	fs_ext2_inode fnode; uint32_t fnode_num;
 	err = fs_ext2_find_final_inode(fs, old, &fnode, &fnode_num);
 	if(err){
-		kfree(new_buf);
+		kmem_scratch_end(&scr);
 		return err;
 	}
 
@@ -1104,11 +1223,11 @@ static int fs_ext2_rename(file_system* fs, const char* old, const char* _new)
 	fs_ext2_remove_dirent(fs, &old_dir_node, old_dir_num, fnode_num);
 	if(!fs_ext2_occupy_vacant_dirent(fs, &new_dir_node, new_dir_num,
 				fnode_num, new_fname, fs_ext2_type_ext22fs_inode(fnode.type_perms))){
-		kfree(new_buf);
+		kmem_scratch_end(&scr);
 		return FS_ERR_NO_SPACE;
 	}
 
-	kfree(new_buf);
+	kmem_scratch_end(&scr);
 	return 0;
 }
 
@@ -1121,7 +1240,9 @@ static int fs_ext2_open(file_system* fs, void* fd, const char* path, int flags)
 	gfs_ext2_fd* _fd = (gfs_ext2_fd*)fd;
 
 	_fd->ptr.is_buf_init = 0;
-	_fd->inode = kmalloc(gdat->sb.inode_size);
+	_fd->inode = kmem_cache_alloc(gdat->inode_cache);
+	if(!_fd->inode)
+		return FS_ERR_NO_MEMORY;
 
 	int err = fs_ext2_find_final_inode(fs, path, _fd->inode, &_fd->inode_num);
 	if(err){
@@ -1130,22 +1251,26 @@ static int fs_ext2_open(file_system* fs, void* fd, const char* path, int flags)
 		{
 			err = fs_ext2_create(fs, path, FS_CREATE_TYPE_FILE);
 			if(err){
-				kfree(_fd->inode);
+				kmem_cache_free(gdat->inode_cache, _fd->inode);
 				return err;
 			}
 			err = fs_ext2_find_final_inode(fs, path, _fd->inode, &_fd->inode_num);
 			if(err){
-				kfree(_fd->inode);
+				kmem_cache_free(gdat->inode_cache, _fd->inode);
 				return err;
 			}
 		}
 		else{
-			kfree(_fd->inode);
+			kmem_cache_free(gdat->inode_cache, _fd->inode);
 			return err;
 		}
 	}
 
-	_fd->ptr.blkbuf = kmalloc(FS_EXT2_SB_BLOCKSIZE(gdat->sb));
+	_fd->ptr.blkbuf = kmem_cache_alloc(gdat->blk_cache);
+	if(!_fd->ptr.blkbuf){
+		kmem_cache_free(gdat->inode_cache, _fd->inode);
+		return FS_ERR_NO_MEMORY;
+	}
 
 	if( (flags & FS_OPEN_RECREATE) && (flags & FS_OPEN_WRITE) )
 	{
@@ -1194,9 +1319,10 @@ static int fs_ext2_open(file_system* fs, void* fd, const char* path, int flags)
 // ++++++
 static void fs_ext2_close(file_system* fs, void* fd)
 {
+	gfs_ext2_gdata* gdat = (gfs_ext2_gdata*)fs->gdata;
 	gfs_ext2_fd* _fd = (gfs_ext2_fd*)fd;
-	kfree(_fd->ptr.blkbuf);
-	kfree(_fd->inode);
+	kmem_cache_free(gdat->blk_cache, _fd->ptr.blkbuf);
+	kmem_cache_free(gdat->inode_cache, _fd->inode);
 }
 
 // ++++++++++
@@ -1386,7 +1512,9 @@ static int fs_ext2_dir_iter_start(file_system* fs, void* iter, const char* path)
 	if(err)
 		return err;
 
-	void* it_buf = kmalloc(FS_EXT2_SB_BLOCKSIZE(gdat->sb));
+	void* it_buf = kmem_cache_alloc(gdat->blk_cache);
+	if(!it_buf)
+		return FS_ERR_NO_MEMORY;
 	fs_ext2_iterate_dir_start(fs->drive, &gdat->sb, &it_inode, it, it_buf);
 	return 0;
 }
@@ -1407,6 +1535,6 @@ static int fs_ext2_dir_iter_next(file_system* fs, void* iter, file_system_dirent
 		dent->type = FS_CREATE_TYPE_UNKNOWN;
 
 	if(!ret)
-		kfree(it->blkbuf);
+		kmem_cache_free(gdat->blk_cache, it->blkbuf);
 	return ret;
 }
@@ -262,10 +262,12 @@ void fs_ext2_read_sb(ata_drive* drive, fs_ext2_sb* sb);
 /* table is considered already allocated and it's size set to FS_EXT2_SB_BLOCKGROUPS_TOTAL, ex.:
  * fs_ext2_blkgrp_table bgrp_table = {malloc(FS_EXT2_SB_BLOCKGROUPS_TOTAL(sb) * sizeof(fs_ext2_blkgrp)),
  * 					FS_EXT2_SB_BLOCKGROUPS_TOTAL(sb)};
+*  Returns 0 on success or FS_ERR_NO_MEMORY if no read buffer could be allocated.
 */
-void fs_ext2_read_blkgrp_table(ata_drive* drive, fs_ext2_sb* sb, fs_ext2_blkgrp_table* table);
+int fs_ext2_read_blkgrp_table(ata_drive* drive, fs_ext2_sb* sb, fs_ext2_blkgrp_table* table);
 
-void fs_ext2_read_inode(ata_drive* drive, fs_ext2_sb* sb, fs_ext2_blkgrp_table* bt,
+/* Returns 0 on success or FS_ERR_NO_MEMORY if no read buffer could be allocated, _out is left untouched then. */
+int fs_ext2_read_inode(ata_drive* drive, fs_ext2_sb* sb, fs_ext2_blkgrp_table* bt,
 				uint32_t inode_num, fs_ext2_inode* _out);
 
 
@@ -363,7 +365,10 @@ int fs_ext2_write_inode_data(ata_drive* drive, fs_ext2_sb* sb, fs_ext2_inode* in
 // ---------
 
 int fs_ext2_gfs_detect(file_system* fs);
-void fs_ext2_gfs_init(file_system* fs);
+/* Return value:
+*  0 on success, FS_ERR_NO_MEMORY if kernel memory couldn't be allocated.
+*/
+int fs_ext2_gfs_init(file_system* fs);
 
 #endif
 
@@ -1,16 +1,29 @@
 #include "fs.h"
 
 #include "ext2.h"
+#include "../kernlib/kernmem.h"
+
 int fs_scan(file_system* fs, ata_drive* drive)
 {
 	fs->drive = drive;
-	if(fs_ext2_gfs_detect(fs))
-	{ fs_ext2_gfs_init(fs); return 1; }
+	fs->gdata = NULL;
+	fs->deinit = NULL;
+	if(fs_ext2_gfs_detect(fs) && !fs_ext2_gfs_init(fs))
+		return 1;
 
 	fs->name = "none";
 	return 0;
 }
 
+void fs_deinit(file_system* fs)
+{
+	if(fs->deinit)
+		fs->deinit(fs);
+	else if(fs->gdata)
+		kfree(fs->gdata);
+	fs->gdata = NULL;
+}
+
 //-----------------------
 // Path parsing functions
 //-----------------------
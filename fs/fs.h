@@ -31,8 +31,8 @@ typedef struct _file_system
 
 	void* gdata;		// generic data, depending on underlying file system
 				// (ex. superblock data for ext2)
-				// should be dynamically allocated, and kfree() is called
-				// on deinitialization if not NULL
+				// should be dynamically allocated, it's released by deinit()
+				// (or kfree() is called if deinit is NULL)
 
 
 	/* - Most file operations use a generic void pointer file handler.
@@ -76,6 +76,8 @@ typedef struct _file_system
 
 	int (*dir_iter_start)(struct _file_system* fs, void* iter, const char* path);
 	int (*dir_iter_next)(struct _file_system* fs, void* iter, file_system_dirent* dent);
+
+	void (*deinit)(struct _file_system* fs);	// releases gdata and everything it holds
 } file_system;
 
 
@@ -119,6 +121,7 @@ typedef struct _file_system
 #define FS_ERR_NO_SPACE			-5	// Not enough free space for operation.
 #define FS_ERR_TYPE_UNSUPPORTED		-6	// The operation does not support specified type
 						// (ex. create()).
+#define FS_ERR_NO_MEMORY		-7	// Kernel memory couldn't be allocated for operation.
 
 
 /* Scans specified drive, trying to identify a valid file system.
@@ -126,9 +129,12 @@ typedef struct _file_system
 *  where XX - certain file system name. All probed file systems headers
 *  and source files are in fs directory.
 *  When a valid file system is found, it is initialized by a function such as
-*  "fs_XX_gfs_init(file_system*)", and 1 is returned. Otherwise, 0 is returned.
+*  "int fs_XX_gfs_init(file_system*)", and 1 is returned. Otherwise, or if
+*  initialization fails, 0 is returned.
 */
 int fs_scan(file_system* fs, ata_drive* drive);
+/* Releases data of a file system initialized by fs_scan(). */
+void fs_deinit(file_system* fs);
 
 //-----------------------
 // Path parsing functions
@@ -214,8 +214,8 @@ void kernel_main(struct stivale2_struct* stivale2_struct)
 	boot_log_printf_status(BOOT_LOG_STATUS_NLINE, "Memory limit: 0x%p", (void*)memory_limit);
 
 	boot_log_printf_status(BOOT_LOG_STATUS_RUNNING, "Initializing memory virtualization module");
-	int(*vmemory_init)() = elf_get_function_module(&module_vmemory, "vmemory_init");
-	err = vmemory_init(memory_limit);
+	int(*vmemory_init_memmap)() = elf_get_function_module(&module_vmemory, "vmemory_init_memmap");
+	err = vmemory_init_memmap(mmap_struct_tag->memmap, mmap_struct_tag->entries);
 	if(err)
 		boot_log_printf_status(BOOT_LOG_STATUS_FAIL, "Initializing memory virtualization module: error code %d", err);
 	else
@@ -231,7 +231,23 @@ void kernel_main(struct stivale2_struct* stivale2_struct)
 	void* kernel_mem_hndl = kmalloc(mem_hndl_size);
 	int(*create_mem_hndl)() = elf_get_function_module(&module_vmemory, "create_mem_hndl");
 	int(*select_mem_hndl)() = elf_get_function_module(&module_vmemory, "select_mem_hndl");
-	err = create_mem_hndl(kernel_mem_hndl);
+	// physical memory of the heap is marked as usable in the memory map, it's reserved before the module takes any frames
+	int(*vmemory_reserve_phys)() = elf_get_function_module(&module_vmemory, "reserve_phys");
+	void* kmem_heap_reserved = kmem_get_heap_end();
+	kmem_heap_reserved += (vmemory_mem_unit_size - (uint64_t)kmem_heap_reserved % vmemory_mem_unit_size) % vmemory_mem_unit_size;
+	err = vmemory_reserve_phys(KMEM_HEAP_BASE, kmem_heap_reserved - KMEM_HEAP_BASE, VMEM_FLAG_SIZE_IN_BYTES);
+	// so is usable memory the kernel image mapping reaches into, apart from the heap
+	struct stivale2_struct_tag_kernel_base_address *kbase_tag = stivale2_get_tag(stivale2_struct, STIVALE2_STRUCT_TAG_KERNEL_BASE_ADDRESS_ID);
+	#define KERN_IMG_SIZE (8 * 1024 * 1024)
+	void* kimg_beg = (void*)kbase_tag->physical_base_address;
+	void* kimg_end = kimg_beg + KERN_IMG_SIZE;
+	if(!err && kimg_beg < KMEM_HEAP_BASE)
+		err = vmemory_reserve_phys(kimg_beg, (kimg_end < KMEM_HEAP_BASE ? kimg_end : KMEM_HEAP_BASE) - kimg_beg, VMEM_FLAG_SIZE_IN_BYTES);
+	if(!err && kimg_end > kmem_heap_reserved)
+		err = vmemory_reserve_phys(kimg_beg > kmem_heap_reserved ? kimg_beg : kmem_heap_reserved,
+						kimg_end - (kimg_beg > kmem_heap_reserved ? kimg_beg : kmem_heap_reserved), VMEM_FLAG_SIZE_IN_BYTES);
+	if(!err)
+		err = create_mem_hndl(kernel_mem_hndl);
 	if(err)
 		boot_log_printf_status(BOOT_LOG_STATUS_FAIL, "Creating memory context for kernel: error code %d", err);
 	else{
@@ -246,17 +262,15 @@ void kernel_main(struct stivale2_struct* stivale2_struct)
 	int(*vmemory_map_phys)() = elf_get_function_module(&module_vmemory, "map_phys");
 
 	void* kmem_heap_end = kmem_get_heap_end();
-	struct stivale2_struct_tag_kernel_base_address *kbase_tag = stivale2_get_tag(stivale2_struct, STIVALE2_STRUCT_TAG_KERNEL_BASE_ADDRESS_ID);
-
-	#define KERN_IMG_SIZE (8 * 1024 * 1024)
 	void* err_addr = NULL;
 	struct mmap_entry ments[] = {
-					// identity map memory heap
-					{KMEM_HEAP_BASE, KMEM_HEAP_BASE, kmem_heap_end - KMEM_HEAP_BASE, VMEM_FLAG_SIZE_IN_BYTES},
+					// identity map memory heap, including the part it grew by after the reservation
+					{KMEM_HEAP_BASE, KMEM_HEAP_BASE, kmem_heap_reserved - KMEM_HEAP_BASE, VMEM_FLAG_SIZE_IN_BYTES | VMEM_FLAG_RESERVED},
+					{kmem_heap_reserved, kmem_heap_reserved, kmem_heap_end > kmem_heap_reserved ? kmem_heap_end - kmem_heap_reserved : 0, VMEM_FLAG_SIZE_IN_BYTES},
 					// identity map APIC base
-					{(void*)0xfee00000, (void*)0xfee00000, 0x400/*APIC_REG_SIZE*/, VMEM_FLAG_SIZE_IN_BYTES},
+					{(void*)0xfee00000, (void*)0xfee00000, 0x400/*APIC_REG_SIZE*/, VMEM_FLAG_SIZE_IN_BYTES | VMEM_FLAG_UC},
 					// identity map kernel image
-					{(void*)kbase_tag->virtual_base_address, (void*)kbase_tag->physical_base_address, KERN_IMG_SIZE, VMEM_FLAG_SIZE_IN_BYTES}
+					{(void*)kbase_tag->virtual_base_address, (void*)kbase_tag->physical_base_address, KERN_IMG_SIZE, VMEM_FLAG_SIZE_IN_BYTES | VMEM_FLAG_RESERVED}
 				    };
 	for(size_t i = 0; i < sizeof(ments) / sizeof(ments[0]); ++i){
 		err = vmemory_map_phys(ments[i].vaddr, ments[i].paddr, ments[i].usize, ments[i].flags);
@@ -303,7 +317,8 @@ void kernel_main(struct stivale2_struct* stivale2_struct)
 		boot_log_printf_status(BOOT_LOG_STATUS_SUCCESS, "Selecting kernel memory context");
 
 	int(*vmemory_map_alloc)() = elf_get_function_module(&module_vmemory, "map_alloc");
-	kmem_set_map_functions(vmemory_map_alloc, vmemory_get_mem_unit_size);
+	int(*vmemory_unmap)() = elf_get_function_module(&module_vmemory, "unmap");
+	kmem_set_map_functions(vmemory_map_alloc, vmemory_unmap, vmemory_get_mem_unit_size);
 
 	boot_log_printf_status(BOOT_LOG_STATUS_RUNNING, "Loading multitasking module");
 	module module_mtask = {.name = "modload_mtask"};
@@ -326,6 +341,7 @@ void kernel_main(struct stivale2_struct* stivale2_struct)
 	void(*mtask_scheduler_queue_thread)(thread*) = elf_get_function_module(&module_mtask, "scheduler_queue_thread");
 	void(*mtask_scheduler_dequeue_thread)(thread*) = elf_get_function_module(&module_mtask, "scheduler_dequeue_thread");
 	void(*mtask_scheduler_sleep_thread)(thread*, uint64_t) = elf_get_function_module(&module_mtask, "scheduler_sleep_thread");
+	thread*(*mtask_thread_alloc)() = elf_get_function_module(&module_mtask, "thread_alloc");
 
 	uart_printf("MTASK base: %p\r\n", module_mtask.elf_data);
 	boot_log_printf_status(BOOT_LOG_STATUS_RUNNING, "Initializing multitasking module");
@@ -342,8 +358,7 @@ void kernel_main(struct stivale2_struct* stivale2_struct)
 	for(size_t i = 0; i < 8; ++i)
 	{ // schedule test code
 		process pr; mtask_create_process(&pr);
-		thread* th_pt = kmalloc_align(sizeof(thread), 16);
-		memset(th_pt, 0, sizeof(thread));
+		thread* th_pt = mtask_thread_alloc();
 		threads[i] = th_pt;
 		MTASK_SAVE_CONTEXT(th_pt);
 		switch(i % 4){
@@ -355,6 +370,7 @@ void kernel_main(struct stivale2_struct* stivale2_struct)
 		void* ap_test_stack = kmalloc(512);
 		th_pt->state.rsp = (uintptr_t)ap_test_stack + 512;
 		th_pt->weight = 1024 + 128 * i;
+		th_pt->mem_hndl = kernel_mem_hndl;
 		//mtask_process_add_thread(&pr, th_pt);
 		mtask_scheduler_queue_thread(th_pt);
 		//kfree(th_pt);
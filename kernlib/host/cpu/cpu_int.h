@@ -0,0 +1,15 @@
+#ifndef CPU_INT_H
+#define CPU_INT_H
+
+/* Host stand-in for cpu/cpu_int.h, used by kmem_bench.
+*  User-space code can't mask interrupts, and there are no interrupt handlers to be protected from.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+static inline void cpu_interrupt_set(int enabled) {}
+static inline uint64_t cpu_interrupt_save() { return 0; }
+static inline void cpu_interrupt_restore(uint64_t flags) {}
+
+#endif
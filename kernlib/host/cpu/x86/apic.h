@@ -0,0 +1,23 @@
+#ifndef X86_APIC_H
+#define X86_APIC_H
+
+/* Host stand-in for cpu/x86/apic.h, used by kmem_bench.
+*  Every benchmark thread acts as a separate CPU, it's LAPIC ID is kept in a thread-local variable.
+*/
+
+#include <stdint.h>
+
+#define LAPIC_REG_ID			0x20
+
+extern __thread uint32_t kmem_bench_cpu;
+
+static inline uint32_t lapic_read(uint32_t reg)
+{
+	return reg == LAPIC_REG_ID ? kmem_bench_cpu << 24 : 0;
+}
+static inline uint32_t apic_cpu_id()
+{
+	return kmem_bench_cpu;
+}
+
+#endif
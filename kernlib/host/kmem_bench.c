@@ -0,0 +1,361 @@
+/* Host-side benchmark of the kernel heap (kernlib/kernmem.c).
+*  kernmem.c and cstdlib/string.c are built as a normal Linux program: the heap region is reserved with mmap()
+*  at KMEM_HEAP_BASE, and mock map_alloc()/unmap() functions of the virtual memory module commit and release
+*  it's pages with mprotect()/madvise(). Headers in kernlib/host replace the ones that need a real CPU.
+*
+*  Every trace runs in it's own process, so it starts with an empty heap, and is generated from a fixed seed,
+*  so runs are repeatable. Results are reported as wall-clock ns per operation and peak committed memory.
+*
+*  Usage: kmem_bench [trace|all] [ops per thread]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "kernlib/kernmem.h"
+#include "cstdlib/string.h"
+#include "modules/vmemory/vmemory.h"
+
+#define BENCH_HEAP_SPAN			(1024UL * 1024 * 1024)	// address space reserved for the heap
+#define BENCH_PAGE_SIZE			4096
+#define BENCH_MAX_THREADS		16
+#define BENCH_SLOTS				8192					// live allocations kept by each thread
+#define BENCH_RING_SIZE			1024					// objects handed over to another thread for freeing
+
+__thread uint32_t kmem_bench_cpu;
+
+void uart_printf(const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+}
+
+
+/* Mock virtual memory module */
+
+static size_t bench_mapped, bench_mapped_peak;		// only changed with kmem_spinlock held
+
+static int bench_map_alloc(void* vaddr, uint64_t usize, int flags)
+{
+	if(!(flags & VMEM_FLAG_SIZE_IN_BYTES))
+		usize *= BENCH_PAGE_SIZE;
+	usize = (usize + BENCH_PAGE_SIZE - 1) / BENCH_PAGE_SIZE * BENCH_PAGE_SIZE;
+	if(vaddr < KMEM_HEAP_BASE || vaddr + usize > KMEM_HEAP_BASE + BENCH_HEAP_SPAN)
+		return VMEM_ERR_NOSPACE;
+	if(mprotect(vaddr, usize, PROT_READ | PROT_WRITE))
+		return VMEM_ERR_NOSPACE;
+	bench_mapped += usize;
+	if(bench_mapped > bench_mapped_peak)
+		bench_mapped_peak = bench_mapped;
+	return 0;
+}
+static int bench_unmap(void* vaddr, uint64_t usize, int flags)
+{
+	if(!(flags & VMEM_FLAG_SIZE_IN_BYTES))
+		usize *= BENCH_PAGE_SIZE;
+	usize = (usize + BENCH_PAGE_SIZE - 1) / BENCH_PAGE_SIZE * BENCH_PAGE_SIZE;
+	madvise(vaddr, usize, MADV_DONTNEED);
+	mprotect(vaddr, usize, PROT_NONE);
+	bench_mapped -= usize;
+	return 0;
+}
+static uint64_t bench_get_mem_unit_size() { return BENCH_PAGE_SIZE; }
+
+// Sets up the heap the way kernel.c does: it's used unmapped by the boot code first, then handed to the module.
+static int bench_heap_init()
+{
+	void* heap = mmap(KMEM_HEAP_BASE, BENCH_HEAP_SPAN, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+	if(heap != KMEM_HEAP_BASE){
+		perror("kmem_bench: reserving heap region");
+		return 1;
+	}
+	mprotect(heap, BENCH_PAGE_SIZE, PROT_READ | PROT_WRITE); // covers the head node
+	kmem_init();
+	bench_mapped = bench_mapped_peak = BENCH_PAGE_SIZE;
+	kmem_set_map_functions(bench_map_alloc, bench_unmap, bench_get_mem_unit_size);
+	return 0;
+}
+
+
+/* Trace generation */
+
+static uint64_t bench_rand(uint64_t* state) // xorshift64*
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 2685821657736338717ULL;
+}
+
+// Size distribution skewed towards small objects, with a tail of large buffers.
+static size_t bench_size(uint64_t* rng)
+{
+	uint64_t r = bench_rand(rng) % 100;
+	if(r < 70)	return 8 + bench_rand(rng) % 248;
+	if(r < 95)	return 256 + bench_rand(rng) % 3840;
+	if(r < 99)	return 4096 + bench_rand(rng) % 61440;
+	return 65536 + bench_rand(rng) % 458752;
+}
+
+typedef struct {
+	void* ptr;
+	size_t size;
+} bench_slot;
+
+typedef struct {
+	void* objs[BENCH_RING_SIZE];
+	volatile size_t head, tail;		// single producer, single consumer
+} bench_ring;
+
+typedef struct bench_trace bench_trace;
+typedef struct {
+	const bench_trace* trace;
+	uint32_t id, thread_cnt;
+	uint64_t ops;
+	bench_ring* rings;				// thread i hands objects to thread i + 1 through rings[i]
+	int failed;
+} bench_thread;
+
+struct bench_trace {
+	const char* name;
+	uint32_t threads;
+	void (*step)(bench_thread* t, bench_slot* slots, uint64_t* rng);
+};
+
+// Objects are tagged with their first and last byte, checked when they are freed.
+static void bench_tag(void* ptr, size_t size, uint8_t tag)
+{
+	if(size){
+		((uint8_t*)ptr)[0] = tag;
+		((uint8_t*)ptr)[size - 1] = tag;
+	}
+}
+static int bench_check(void* ptr, size_t size, uint8_t tag)
+{
+	return !size || (((uint8_t*)ptr)[0] == tag && ((uint8_t*)ptr)[size - 1] == tag);
+}
+#define BENCH_TAG(slot)		((uint8_t)((uintptr_t)(slot) >> 4))
+
+static void bench_free_slot(bench_thread* t, bench_slot* s)
+{
+	if(!bench_check(s->ptr, s->size, BENCH_TAG(s)))
+		t->failed = 1;
+	kfree(s->ptr);
+	s->ptr = NULL;
+}
+
+// Random sizes: 60% allocations, 30% frees, 10% reallocations of random slots.
+static void bench_step_mixed(bench_thread* t, bench_slot* slots, uint64_t* rng)
+{
+	bench_slot* s = &slots[bench_rand(rng) % BENCH_SLOTS];
+	uint64_t r = bench_rand(rng) % 10;
+	if(!s->ptr){
+		if(r < 6){
+			s->size = bench_size(rng);
+			if(!(s->ptr = kmalloc(s->size)))
+				t->failed = 1;
+			else
+				bench_tag(s->ptr, s->size, BENCH_TAG(s));
+		}
+	}
+	else if(r < 9)
+		bench_free_slot(t, s);
+	else{
+		size_t size = bench_size(rng);
+		if(!bench_check(s->ptr, s->size, BENCH_TAG(s)))
+			t->failed = 1;
+		void* ptr = krealloc(s->ptr, size);
+		if(!ptr)
+			t->failed = 1;
+		else{
+			s->ptr = ptr;
+			s->size = size;
+			bench_tag(s->ptr, s->size, BENCH_TAG(s));
+		}
+	}
+}
+
+// Page-aligned requests of 1-4 pages (page tables, DMA buffers) interleaved with small objects.
+static void bench_step_page(bench_thread* t, bench_slot* slots, uint64_t* rng)
+{
+	bench_slot* s = &slots[bench_rand(rng) % BENCH_SLOTS];
+	if(s->ptr){
+		bench_free_slot(t, s);
+		return;
+	}
+	if(bench_rand(rng) % 2){
+		s->size = BENCH_PAGE_SIZE * (1 + bench_rand(rng) % 4);
+		s->ptr = kmalloc_align(s->size, BENCH_PAGE_SIZE);
+		if((uintptr_t)s->ptr % BENCH_PAGE_SIZE)
+			t->failed = 1;
+	}
+	else{
+		s->size = 8 + bench_rand(rng) % 248;
+		s->ptr = kmalloc(s->size);
+	}
+	if(!s->ptr)
+		t->failed = 1;
+	else
+		bench_tag(s->ptr, s->size, BENCH_TAG(s));
+}
+
+// Buffers grown by small steps with krealloc, then dropped (string builders, growing tables).
+static void bench_step_grow(bench_thread* t, bench_slot* slots, uint64_t* rng)
+{
+	bench_slot* s = &slots[bench_rand(rng) % (BENCH_SLOTS / 16)];
+	if(s->ptr && s->size > 65536){
+		bench_free_slot(t, s);
+		return;
+	}
+	size_t size = s->size + 16 + bench_rand(rng) % 1024;
+	void* ptr = krealloc(s->ptr, size);
+	if(!ptr){
+		t->failed = 1;
+		return;
+	}
+	if(s->ptr && !bench_check(ptr, s->size, BENCH_TAG(s)))
+		t->failed = 1;
+	s->ptr = ptr;
+	s->size = size;
+	bench_tag(s->ptr, s->size, BENCH_TAG(s));
+}
+
+/* Same as mixed, but a quarter of frees hand the object over to the next thread, which frees it
+*  (producer/consumer pattern, objects are freed on a different CPU than they were allocated on).
+*/
+static void bench_step_cross(bench_thread* t, bench_slot* slots, uint64_t* rng)
+{
+	bench_ring* in = &t->rings[(t->id + t->thread_cnt - 1) % t->thread_cnt];
+	if(in->head != in->tail){
+		kfree(in->objs[in->tail % BENCH_RING_SIZE]);
+		__atomic_store_n(&in->tail, in->tail + 1, __ATOMIC_RELEASE);
+	}
+
+	bench_slot* s = &slots[bench_rand(rng) % BENCH_SLOTS];
+	bench_ring* out = &t->rings[t->id];
+	if(s->ptr && bench_rand(rng) % 4 == 0
+	&& __atomic_load_n(&out->tail, __ATOMIC_ACQUIRE) + BENCH_RING_SIZE != out->head){
+		out->objs[out->head % BENCH_RING_SIZE] = s->ptr;
+		__atomic_store_n(&out->head, out->head + 1, __ATOMIC_RELEASE);
+		s->ptr = NULL;
+		return;
+	}
+	bench_step_mixed(t, slots, rng);
+}
+
+static const bench_trace bench_traces[] = {
+	{"mixed", 1, bench_step_mixed},
+	{"page", 1, bench_step_page},
+	{"grow", 1, bench_step_grow},
+	{"mixed-4t", 4, bench_step_mixed},
+	{"mixed-8t", 8, bench_step_mixed},
+	{"cross-4t", 4, bench_step_cross},
+};
+#define BENCH_TRACE_CNT		(sizeof(bench_traces) / sizeof(bench_traces[0]))
+
+
+/* Driver */
+
+static pthread_barrier_t bench_start;
+
+static void* bench_thread_main(void* arg)
+{
+	bench_thread* t = arg;
+	kmem_bench_cpu = t->id;
+	uint64_t rng = 0x9E3779B97F4A7C15ULL * (t->id + 1);
+	bench_slot* slots = calloc(BENCH_SLOTS, sizeof(bench_slot)); // bookkeeping stays out of the measured heap
+
+	pthread_barrier_wait(&bench_start);
+	for(uint64_t i = 0; i < t->ops; ++i)
+		t->trace->step(t, slots, &rng);
+	pthread_barrier_wait(&bench_start);
+
+	// tear down outside of the measured interval
+	pthread_barrier_wait(&bench_start);
+	for(size_t i = 0; i < BENCH_SLOTS; ++i)
+		if(slots[i].ptr)
+			bench_free_slot(t, &slots[i]);
+	free(slots);
+	return NULL;
+}
+
+static double bench_now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int bench_run(const bench_trace* trace, uint64_t ops)
+{
+	if(bench_heap_init())
+		return 1;
+
+	bench_thread threads[BENCH_MAX_THREADS];
+	pthread_t handles[BENCH_MAX_THREADS];
+	bench_ring* rings = calloc(trace->threads, sizeof(bench_ring));
+	pthread_barrier_init(&bench_start, NULL, trace->threads + 1);
+	for(uint32_t i = 0; i < trace->threads; ++i){
+		threads[i] = (bench_thread){.trace = trace, .id = i, .thread_cnt = trace->threads, .ops = ops, .rings = rings};
+		pthread_create(&handles[i], NULL, bench_thread_main, &threads[i]);
+	}
+
+	pthread_barrier_wait(&bench_start);
+	double beg = bench_now_ns();
+	pthread_barrier_wait(&bench_start);
+	double ns = bench_now_ns() - beg;
+
+	size_t peak = bench_mapped_peak;
+	kmem_stats st;
+	kmem_get_stats(&st);
+	pthread_barrier_wait(&bench_start);
+	int failed = 0;
+	for(uint32_t i = 0; i < trace->threads; ++i){
+		pthread_join(handles[i], NULL);
+		failed |= threads[i].failed;
+	}
+
+	uint64_t total = ops * trace->threads;
+	printf("%-10s %2u thr %10lu ops %8.1f ns/op   peak %8lu KiB   live at end %8lu KiB   largest gap %6lu KiB%s\n",
+		trace->name, trace->threads, total, ns / total, peak / 1024,
+		st.bytes_live / 1024, st.largest_gap / 1024, failed ? "   FAILED" : "");
+	return failed;
+}
+
+int main(int argc, char** argv)
+{
+	const char* only = argc > 1 && strcmp(argv[1], "all") ? argv[1] : NULL;
+	uint64_t ops = argc > 2 ? strtoull(argv[2], NULL, 0) : 1000000;
+	setvbuf(stdout, NULL, _IONBF, 0);
+
+	int err = 0, found = 0;
+	for(size_t i = 0; i < BENCH_TRACE_CNT; ++i){
+		if(only && strcmp(only, bench_traces[i].name))
+			continue;
+		found = 1;
+		pid_t pid = fork();
+		if(!pid)
+			return bench_run(&bench_traces[i], ops);
+		int status;
+		waitpid(pid, &status, 0);
+		if(!WIFEXITED(status) || WEXITSTATUS(status)){
+			printf("%-10s failed (status %d)\n", bench_traces[i].name, status);
+			err = 1;
+		}
+	}
+	if(!found){
+		fprintf(stderr, "kmem_bench: unknown trace %s\n", only);
+		return 1;
+	}
+	return err;
+}
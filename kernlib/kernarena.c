@@ -0,0 +1,155 @@
+#include "kernarena.h"
+
+#include "kernmem.h"
+
+#include "cpu/cpu_int.h"
+#include "cpu/x86/apic.h"
+
+struct kmem_arena_page
+{
+	kmem_arena_page* next;
+	size_t size;		// including this header
+};
+
+#define KMEM_ARENA_ALIGN_UP(ptr, align)		((void*)(((uintptr_t)(ptr) + ((align) - 1)) & ~((uintptr_t)(align) - 1)))
+
+// Makes a page with at least min_size free bytes the current one.
+static int kmem_arena_add_page(kmem_arena* a, size_t min_size)
+{
+	size_t need = sizeof(kmem_arena_page) + min_size;
+
+	kmem_arena_page** it = &a->spare;
+	while(*it && (*it)->size < need)
+		it = &(*it)->next;
+	kmem_arena_page* pg = *it;
+	if(pg)
+		*it = pg->next;
+	else{
+		size_t size = (need + (KMEM_ARENA_PAGE_SIZE - 1)) / KMEM_ARENA_PAGE_SIZE * KMEM_ARENA_PAGE_SIZE;
+		if(!(pg = kmalloc_align(size, KMEM_ARENA_PAGE_SIZE)))
+			return 1;
+		pg->size = size;
+	}
+
+	pg->next = a->pages;
+	a->pages = pg;
+	a->cur = pg + 1;
+	a->end = (void*)pg + pg->size;
+	return 0;
+}
+
+int kmem_arena_create(kmem_arena* a, size_t size)
+{
+	a->pages = a->spare = NULL;
+	a->cur = a->end = NULL;
+	if(size && kmem_arena_add_page(a, size))
+		return 1;
+	return 0;
+}
+
+void* kmem_arena_alloc(kmem_arena* a, size_t size, size_t align)
+{
+	void* ptr = KMEM_ARENA_ALIGN_UP(a->cur, align);
+	if(!a->pages || ptr + size > a->end){
+		if(kmem_arena_add_page(a, size + align - 1))
+			return NULL;
+		ptr = KMEM_ARENA_ALIGN_UP(a->cur, align);
+	}
+	a->cur = ptr + size;
+	return ptr;
+}
+
+kmem_arena_mark kmem_arena_save(kmem_arena* a)
+{
+	return (kmem_arena_mark){a->pages, a->cur};
+}
+void kmem_arena_restore(kmem_arena* a, kmem_arena_mark mark)
+{
+	while(a->pages != mark.page){ // pages added after the mark become spare
+		kmem_arena_page* pg = a->pages;
+		a->pages = pg->next;
+		pg->next = a->spare;
+		a->spare = pg;
+	}
+	a->cur = mark.cur;
+	a->end = mark.page ? (void*)mark.page + mark.page->size : NULL;
+}
+
+void kmem_arena_reset(kmem_arena* a)
+{
+	kmem_arena_restore(a, (kmem_arena_mark){NULL, NULL});
+}
+
+void kmem_arena_destroy(kmem_arena* a)
+{
+	kmem_arena_reset(a);
+	while(a->spare){
+		kmem_arena_page* pg = a->spare;
+		a->spare = pg->next;
+		kfree(pg);
+	}
+}
+
+
+/* Scratch arenas
+*  A scope takes an arena from the free list of the current CPU and gives it back to the list of the CPU it ends on,
+*  so the arena belongs to the scope even if the thread is preempted or moved to another CPU. Interrupts are only
+*  disabled while a list is changed. Arenas are never freed: a CPU keeps as many as there were scopes open on it at once.
+*/
+
+#define KMEM_SCRATCH_MAX_CPUS		256		// LAPIC IDs are 8-bit
+#define KMEM_SCRATCH_INIT_SIZE		(4 * KMEM_ARENA_PAGE_SIZE - sizeof(kmem_arena_page))
+
+typedef struct kmem_scratch_arena kmem_scratch_arena;
+struct kmem_scratch_arena
+{
+	kmem_arena arena;		// goes first, kmem_scratch::arena points to the whole structure
+	kmem_scratch_arena* next;
+};
+
+static kmem_scratch_arena* kmem_scratch_free[KMEM_SCRATCH_MAX_CPUS];
+
+void kmem_scratch_begin(kmem_scratch* s)
+{
+	uint64_t flags = cpu_interrupt_save();
+	uint32_t cpu = apic_cpu_id();
+	kmem_scratch_arena* sa = cpu < KMEM_SCRATCH_MAX_CPUS ? kmem_scratch_free[cpu] : NULL;
+	if(sa)
+		kmem_scratch_free[cpu] = sa->next;
+	cpu_interrupt_restore(flags);
+
+	if(!sa){
+		sa = kmalloc(sizeof(kmem_scratch_arena));
+		if(sa && kmem_arena_create(&sa->arena, KMEM_SCRATCH_INIT_SIZE)){
+			kfree(sa);
+			sa = NULL;
+		}
+	}
+	s->arena = sa ? &sa->arena : NULL;
+}
+
+void* kmem_scratch_alloc(kmem_scratch* s, size_t size)
+{
+	return s->arena ? kmem_arena_alloc(s->arena, size, 16) : NULL;
+}
+
+void kmem_scratch_end(kmem_scratch* s)
+{
+	kmem_scratch_arena* sa = (kmem_scratch_arena*)s->arena;
+	if(!sa)
+		return;
+	kmem_arena_reset(&sa->arena);
+
+	uint64_t flags = cpu_interrupt_save();
+	uint32_t cpu = apic_cpu_id();
+	if(cpu < KMEM_SCRATCH_MAX_CPUS){
+		sa->next = kmem_scratch_free[cpu];
+		kmem_scratch_free[cpu] = sa;
+		sa = NULL;
+	}
+	cpu_interrupt_restore(flags);
+	if(sa){
+		kmem_arena_destroy(&sa->arena);
+		kfree(sa);
+	}
+}
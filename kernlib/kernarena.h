@@ -0,0 +1,67 @@
+// Header for region (arena) allocation of short-lived kernel memory
+
+#ifndef KERNARENA_H
+#define KERNARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Arena is a bump-pointer allocator backed by whole pages taken from the kernel heap.
+*  Individual allocations are never freed: the whole arena is reset (or rolled back to a mark) at once.
+*  Pages released by a reset are kept by the arena and reused, so a reset arena doesn't touch the heap again
+*  until it needs more memory than it had before.
+*/
+
+#define KMEM_ARENA_PAGE_SIZE	4096
+
+typedef struct kmem_arena_page kmem_arena_page;
+typedef struct {
+	kmem_arena_page* pages;		// pages in use, the most recent (which is allocated from) first
+	kmem_arena_page* spare;		// pages released by kmem_arena_reset() and kmem_arena_restore()
+	void* cur;					// bump pointer inside the first page
+	void* end;
+} kmem_arena;
+
+typedef struct {
+	kmem_arena_page* page;
+	void* cur;
+} kmem_arena_mark;
+
+/* Initializes an arena, reserving size bytes right away (can be 0).
+*  Return value:
+*	0			OK
+*	non-zero	kernel heap couldn't allocate the reserved pages
+*/
+int kmem_arena_create(kmem_arena* a, size_t size);
+/* Returns size bytes aligned by align (power of 2), or NULL if the kernel heap is out of memory. */
+void* kmem_arena_alloc(kmem_arena* a, size_t size, size_t align);
+/* Frees all allocations made from the arena, keeping it's pages. */
+void kmem_arena_reset(kmem_arena* a);
+/* Returns all pages of the arena to the kernel heap. */
+void kmem_arena_destroy(kmem_arena* a);
+
+/* Saves current position of the arena, so allocations made after it can be freed by kmem_arena_restore(). */
+kmem_arena_mark kmem_arena_save(kmem_arena* a);
+void kmem_arena_restore(kmem_arena* a, kmem_arena_mark mark);
+
+
+/* Per-CPU scratch arena for transient buffers.
+*  Usage:
+*	kmem_scratch scr;
+*	kmem_scratch_begin(&scr);
+*	void* buf = kmem_scratch_alloc(&scr, size);
+*	...
+*	kmem_scratch_end(&scr);
+*  Every scope gets an arena of it's own for as long as it lasts, so code inside a scope can be preempted,
+*  wait for a device or open nested scopes. Arenas of ended scopes are kept by CPUs and reused.
+*/
+typedef struct {
+	kmem_arena* arena;		// NULL if an arena couldn't be created
+} kmem_scratch;
+
+void kmem_scratch_begin(kmem_scratch* s);
+/* Returns size bytes aligned by 16, or NULL if out of memory. */
+void* kmem_scratch_alloc(kmem_scratch* s, size_t size);
+void kmem_scratch_end(kmem_scratch* s);
+
+#endif
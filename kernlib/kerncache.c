@@ -0,0 +1,134 @@
+#include "kerncache.h"
+
+#include "kernmem.h"
+
+#include "cpu/cpu_int.h"
+#include "cpu/spinlock.h"
+
+typedef struct kmem_cache_chunk kmem_cache_chunk;
+struct kmem_cache_chunk
+{
+	kmem_cache_chunk* next;
+};
+
+struct kmem_cache
+{
+	size_t link_off;		// offset of the free list link, which is kept past the object so it doesn't break constructed state
+	size_t stride;			// distance between objects in a chunk
+	size_t align;
+	size_t chunk_objs;
+	size_t obj_off;			// offset of the first object in a chunk
+	void (*ctor)(void*);
+
+	void* free;				// most recently freed object
+	size_t free_cnt;
+	kmem_cache_chunk* chunks;
+	spinlock lock;
+};
+
+#define KMEM_CACHE_CHUNK_SIZE		4096
+#define KMEM_CACHE_MIN_OBJS			8		// objects per chunk, for large objects
+
+#define KMEM_CACHE_ROUND_UP(x, align)	(((x) + ((align) - 1)) / (align) * (align))
+#define KMEM_CACHE_LINK(c, obj)			(*(void**)((obj) + (c)->link_off))
+
+kmem_cache* kmem_cache_create(size_t size, size_t align, void (*ctor)(void*))
+{
+	kmem_cache* c = kmalloc(sizeof(kmem_cache));
+	if(!c)
+		return NULL;
+	if(align < sizeof(void*))
+		align = sizeof(void*);
+
+	c->link_off = KMEM_CACHE_ROUND_UP(size, sizeof(void*));
+	c->stride = KMEM_CACHE_ROUND_UP(c->link_off + sizeof(void*), align);
+	c->align = align;
+	c->obj_off = KMEM_CACHE_ROUND_UP(sizeof(kmem_cache_chunk), align);
+	c->chunk_objs = (KMEM_CACHE_CHUNK_SIZE - c->obj_off) / c->stride;
+	if(c->chunk_objs < KMEM_CACHE_MIN_OBJS)
+		c->chunk_objs = KMEM_CACHE_MIN_OBJS;
+	c->ctor = ctor;
+
+	c->free = NULL;
+	c->free_cnt = 0;
+	c->chunks = NULL;
+	spinlock_init(&c->lock);
+	return c;
+}
+
+void kmem_cache_destroy(kmem_cache* c)
+{
+	while(c->chunks){
+		kmem_cache_chunk* ch = c->chunks;
+		c->chunks = ch->next;
+		kfree(ch);
+	}
+	kfree(c);
+}
+
+/* Adds a chunk of constructed objects to the cache. Returns 0 on success.
+*  The chunk is allocated and constructed without holding the lock: heap may call back
+*  into code that uses this cache while mapping memory.
+*/
+static int kmem_cache_grow(kmem_cache* c)
+{
+	kmem_cache_chunk* ch = kmalloc_align(c->obj_off + c->chunk_objs * c->stride, c->align);
+	if(!ch)
+		return 1;
+	void* objs = (void*)ch + c->obj_off;
+	for(size_t i = 0; i < c->chunk_objs; ++i){
+		if(c->ctor)
+			c->ctor(objs + i * c->stride);
+		KMEM_CACHE_LINK(c, objs + i * c->stride) = i + 1 < c->chunk_objs ? objs + (i + 1) * c->stride : NULL;
+	}
+
+	uint64_t flags = cpu_interrupt_save();
+	spinlock_lock(&c->lock);
+	ch->next = c->chunks;
+	c->chunks = ch;
+	KMEM_CACHE_LINK(c, objs + (c->chunk_objs - 1) * c->stride) = c->free;
+	c->free = objs;
+	c->free_cnt += c->chunk_objs;
+	spinlock_unlock(&c->lock);
+	cpu_interrupt_restore(flags);
+	return 0;
+}
+
+void* kmem_cache_alloc(kmem_cache* c)
+{
+	for(;;){
+		uint64_t flags = cpu_interrupt_save();
+		spinlock_lock(&c->lock);
+		void* obj = c->free;
+		if(obj){
+			c->free = KMEM_CACHE_LINK(c, obj);
+			--c->free_cnt;
+		}
+		spinlock_unlock(&c->lock);
+		cpu_interrupt_restore(flags);
+
+		if(obj)
+			return obj;
+		if(kmem_cache_grow(c))
+			return NULL;
+	}
+}
+
+void kmem_cache_free(kmem_cache* c, void* obj)
+{
+	uint64_t flags = cpu_interrupt_save();
+	spinlock_lock(&c->lock);
+	KMEM_CACHE_LINK(c, obj) = c->free;
+	c->free = obj;
+	++c->free_cnt;
+	spinlock_unlock(&c->lock);
+	cpu_interrupt_restore(flags);
+}
+
+int kmem_cache_reserve(kmem_cache* c, size_t cnt)
+{
+	while(c->free_cnt < cnt)
+		if(kmem_cache_grow(c))
+			return 1;
+	return 0;
+}
@@ -0,0 +1,38 @@
+// Header for typed object caches
+
+#ifndef KERNCACHE_H
+#define KERNCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Object cache hands out objects of a single type, carved out of chunks taken from the kernel heap.
+*  Objects are constructed once, when their chunk is added to the cache, and are expected to be returned
+*  to the cache in the constructed state. Freed objects are reused last in, first out, so an allocation
+*  usually gets an object that is still in the CPU cache.
+*  Chunks are never returned to the heap until the cache is destroyed.
+*/
+
+typedef struct kmem_cache kmem_cache;
+
+/* Creates a cache of objects of size bytes aligned by align (power of 2).
+*  ctor is called for every new object, can be NULL.
+*  Return value:
+*	a cache or NULL if out of memory.
+*/
+kmem_cache* kmem_cache_create(size_t size, size_t align, void (*ctor)(void*));
+/* Frees memory of all objects, which should all be returned to the cache by now. */
+void kmem_cache_destroy(kmem_cache* c);
+
+/* Returns an object or NULL if out of memory. */
+void* kmem_cache_alloc(kmem_cache* c);
+void kmem_cache_free(kmem_cache* c, void* obj);
+
+/* Makes sure at least cnt objects can be allocated without touching the heap.
+*  Return value:
+*	0			OK
+*	non-zero	out of memory
+*/
+int kmem_cache_reserve(kmem_cache* c, size_t cnt);
+
+#endif
@@ -6,18 +6,38 @@
 #include "cstdlib/string.h"
 
 #include "cpu/spinlock.h"
+#include "cpu/cpu_int.h"
+#include "cpu/x86/apic.h"
 #include "modules/vmemory/vmemory.h"
 
 // Basic kernel heap memory implementation.
 
 int (*vmemory_map_alloc)(void*, uint64_t, int) = NULL;
+int (*vmemory_unmap)(void*, uint64_t, int) = NULL;
 uint64_t (*vmemory_get_mem_unit_size)() = NULL;
-void kmem_set_map_functions(int (*alloc_func)(void*, uint64_t, int), uint64_t (*mem_unit_size_func)())
+static void kmem_heap_map_start();
+void kmem_set_map_functions(int (*alloc_func)(void*, uint64_t, int), int (*unmap_func)(void*, uint64_t, int),
+				uint64_t (*mem_unit_size_func)())
 {
 	vmemory_map_alloc = alloc_func;
+	vmemory_unmap = unmap_func;
 	vmemory_get_mem_unit_size = mem_unit_size_func;
+	kmem_heap_map_start();
 }
 
+/* Heap page bookkeeping.
+*  Per-page state (slab pages, pages returned to the virtual memory module) is kept in bitmaps
+*  covering the first KMEM_HEAP_LIMIT bytes of the heap.
+*/
+#define KMEM_PAGE_SIZE			4096
+#define KMEM_HEAP_LIMIT			(1024 * 1024 * 1024)
+#define KMEM_HEAP_PAGE_CNT		(KMEM_HEAP_LIMIT / KMEM_PAGE_SIZE)
+
+#define KMEM_PAGE_IDX(ptr)			(((uintptr_t)(ptr) - (uintptr_t)KMEM_HEAP_BASE) / KMEM_PAGE_SIZE)
+#define KMEM_PAGE_SET(map, idx)		{ (map)[(idx) / 64] |= (uint64_t)1 << ((idx) % 64); }
+#define KMEM_PAGE_CLEAR(map, idx)	{ (map)[(idx) / 64] &= ~((uint64_t)1 << ((idx) % 64)); }
+#define KMEM_PAGE_TEST(map, idx)	((map)[(idx) / 64] & ((uint64_t)1 << ((idx) % 64)))
+
 // Basic linked list implementation
 typedef struct kmem_node kmem_node;
 struct kmem_node
@@ -25,16 +45,111 @@ struct kmem_node
 	size_t sz;
 	struct kmem_node* next;
 	struct kmem_node* prev;
+
+	struct kmem_node* gap_next; // neighbours in the gap index bin, see kmem_gap_insert()
+	struct kmem_node* gap_prev;
 };
 kmem_node* kmem_head = (kmem_node*)KMEM_HEAP_BASE;
+static kmem_node* kmem_tail; // last node of the list (the farthest in memory)
+#define KMEM_NODE_END(n)	((void*)(n) + sizeof(kmem_node) + (n)->sz)
 void* occupied_to = KMEM_HEAP_BASE; // upper bound of memory currently mapped
 static spinlock kmem_spinlock;
+static volatile uint32_t kmem_lock_owner = (uint32_t)-1;	// LAPIC ID of the CPU holding kmem_spinlock
+static uint32_t kmem_lock_depth;
+
+static uint32_t kmem_cpu_id()
+{
+	return apic_cpu_id();
+}
+
+/* kmem_spinlock is also taken by code running in interrupt handlers, so interrupts are disabled while it's held.
+*  The CPU holding it may take it again: mapping and unmapping heap pages calls the virtual memory module,
+*  which allocates it's own structures from the heap.
+*/
+static uint64_t kmem_lock()
+{
+	uint64_t flags = cpu_interrupt_save();
+	uint32_t cpu = kmem_cpu_id();
+	if(kmem_lock_owner == cpu){
+		++kmem_lock_depth;
+		return flags;
+	}
+	spinlock_lock(&kmem_spinlock);
+	kmem_lock_owner = cpu;
+	kmem_lock_depth = 1;
+	return flags;
+}
+static void kmem_unlock(uint64_t flags)
+{
+	if(!--kmem_lock_depth){
+		kmem_lock_owner = (uint32_t)-1;
+		spinlock_unlock(&kmem_spinlock);
+	}
+	cpu_interrupt_restore(flags);
+}
+
+/* Slab front-end.
+*  Small requests are served from per-class slabs. Each slab is a single list block, placed so
+*  its kmem_node starts exactly at a KMEM_SLAB_SIZE boundary. Whether a heap page holds a slab
+*  is tracked in kmem_slab_pages, so kfree() can tell slab objects from list blocks without
+*  touching any object headers.
+*/
+#define KMEM_SLAB_SIZE			KMEM_PAGE_SIZE
+#define KMEM_SLAB_MAX_OBJ		512							// larger requests go to the linked list
+#define KMEM_SLAB_OBJ_ALIGN		16							// alignment of the first object in a slab
+
+typedef struct kmem_slab_cache kmem_slab_cache;
+typedef struct kmem_slab kmem_slab;
+struct kmem_slab
+{
+	kmem_slab_cache* cache;
+	kmem_slab* next;		// neighbours in the cache list of partial slabs
+	kmem_slab* prev;
+	void* free;				// singly-linked list of free objects, pointer is stored in the object itself
+	uint32_t inuse, total;
+};
+struct kmem_slab_cache
+{
+	size_t obj_size;
+	size_t obj_align;		// alignment every object of the cache is guaranteed to have
+	kmem_slab* partial;		// slabs that have at least 1 free object
+	kmem_slab* empty;		// 1 completely free slab is kept around so alloc/free pairs don't thrash the list
+};
+
+#define KMEM_SLAB_OBJ_OFFSET	((sizeof(kmem_node) + sizeof(kmem_slab) + (KMEM_SLAB_OBJ_ALIGN - 1)) / KMEM_SLAB_OBJ_ALIGN * KMEM_SLAB_OBJ_ALIGN)
+
+static kmem_slab_cache kmem_slab_caches[KMEM_STAT_SLAB_CLASSES] = {
+	{.obj_size = 8}, {.obj_size = 16}, {.obj_size = 32}, {.obj_size = 48},
+	{.obj_size = 64}, {.obj_size = 96}, {.obj_size = 128}, {.obj_size = 192},
+	{.obj_size = 256}, {.obj_size = 384}, {.obj_size = 512}
+};
+#define KMEM_SLAB_CACHE_CNT		(sizeof(kmem_slab_caches) / sizeof(kmem_slab_caches[0]))
+static uint8_t kmem_slab_class[KMEM_SLAB_MAX_OBJ / 8 + 1];	// (size + 7) / 8 -> index of the smallest fitting cache
+static uint64_t kmem_slab_pages[KMEM_HEAP_PAGE_CNT / 64];	// 1 bit per heap page, set if the page is a slab
+static int64_t kmem_slab_live[KMEM_SLAB_CACHE_CNT];		// objects allocated bypassing per-CPU magazines, see kmem_get_stats()
+
+static void kmem_cpu_init();
 
 void kmem_init()
 {
 	// initializing the dummy node, which would store the 1st element of the list
+	kmem_head->sz = 0;
 	kmem_head->next = kmem_head->prev = NULL;
+	kmem_tail = kmem_head;
+	occupied_to = KMEM_NODE_END(kmem_head);
 	spinlock_init(&kmem_spinlock);
+	kmem_cpu_init();
+
+	for(size_t i = 0, c = 0; i < sizeof(kmem_slab_class); ++i){
+		while(kmem_slab_caches[c].obj_size < i * 8)
+			++c;
+		kmem_slab_class[i] = c;
+	}
+	for(size_t c = 0; c < KMEM_SLAB_CACHE_CNT; ++c){
+		size_t sz = kmem_slab_caches[c].obj_size;
+		kmem_slab_caches[c].obj_align = (sz & -sz) < KMEM_SLAB_OBJ_ALIGN ? (sz & -sz) : KMEM_SLAB_OBJ_ALIGN;
+		kmem_slab_caches[c].partial = kmem_slab_caches[c].empty = NULL;
+	}
 }
 void* kmem_get_heap_end()
 {
@@ -51,61 +166,683 @@ void print_kmem_llist()
 }
 
 
-void* kmalloc(size_t size)
+/* Linked list functions (kmem_spinlock should be held by the caller) */
+
+/* Gap index.
+*  Every node owns the gap between the end of it's block and the next node. Gaps big enough to hold a node
+*  are kept in doubly-linked bins by floor(log2(gap size)), with a bitmap of non-empty bins, so a fitting gap
+*  is found without walking the list. Gap after the last node is not indexed, it's extended by growing the heap.
+*  Functions that change geometry of a node remove it's gap from the index first and re-add it afterwards.
+*/
+#define KMEM_GAP_BINS		64
+#define KMEM_GAP_MIN		(sizeof(kmem_node) + 1)
+#define KMEM_GAP_SCAN		16			// gaps checked for a tight fit before falling back to bins that always fit
+#define KMEM_GAP_RESCAN		256			// gaps checked after that if no bin always fits, before growing the heap
+
+static kmem_node* kmem_gap_bins[KMEM_GAP_BINS];
+static uint64_t kmem_gap_bitmap;			// bit i is set if kmem_gap_bins[i] is not empty
+static size_t kmem_gap_cnt[KMEM_GAP_BINS];
+#define KMEM_GAP_SIZE(n)	((size_t)((void*)(n)->next - KMEM_NODE_END(n)))
+#define KMEM_GAP_BIN(sz)	(63 - __builtin_clzl(sz))
+
+static void kmem_gap_insert(kmem_node* n)
 {
-	return kmalloc_align(size, 1);
+	if(!n->next || KMEM_GAP_SIZE(n) < KMEM_GAP_MIN)
+		return;
+	unsigned b = KMEM_GAP_BIN(KMEM_GAP_SIZE(n));
+	n->gap_prev = NULL;
+	n->gap_next = kmem_gap_bins[b];
+	if(n->gap_next)
+		n->gap_next->gap_prev = n;
+	kmem_gap_bins[b] = n;
+	kmem_gap_bitmap |= (uint64_t)1 << b;
+	++kmem_gap_cnt[b];
 }
-void* kmalloc_align(size_t size, size_t align)
+static void kmem_gap_remove(kmem_node* n)
 {
-	spinlock_lock(&kmem_spinlock);
-	kmem_node* it = kmem_head;
-	while(it->next){
-		// calculate the gap between current and next memory node
-		void* gap_beg = (void*)it + sizeof(kmem_node) + it->sz;
-		void* gap_end = it->next;
-		if(((uint64_t)gap_beg + sizeof(kmem_node)) % align) // account for alignment
-			gap_beg += align - ((uint64_t)gap_beg + sizeof(kmem_node)) % align;
-		if(gap_end > gap_beg){
-			size_t gap = gap_end - gap_beg;
-			if(gap >= size + sizeof(kmem_node)){
-				kmem_node* it_next = it->next;
-				it->next = gap_beg;
-				it_next->prev = it->next;
-
-				it->next->sz = size;
-				it->next->next = it_next;
-				it->next->prev = it;
-				return it->next + 1;
-			}
+	if(!n->next || KMEM_GAP_SIZE(n) < KMEM_GAP_MIN)
+		return;
+	unsigned b = KMEM_GAP_BIN(KMEM_GAP_SIZE(n));
+	if(n->gap_prev)
+		n->gap_prev->gap_next = n->gap_next;
+	else if(!(kmem_gap_bins[b] = n->gap_next))
+		kmem_gap_bitmap &= ~((uint64_t)1 << b);
+	if(n->gap_next)
+		n->gap_next->gap_prev = n->gap_prev;
+	--kmem_gap_cnt[b];
+}
+
+/* Returns address of a node that would be put after n to fit the request, or NULL if it doesn't fit. */
+static void* kmem_gap_fit(kmem_node* n, size_t size, size_t align, size_t align_off)
+{
+	void* nblk = KMEM_NODE_END(n);
+	if(((uint64_t)nblk + sizeof(kmem_node) - align_off) % align) // account for alignment
+		nblk += align - ((uint64_t)nblk + sizeof(kmem_node) - align_off) % align;
+	if(n->next && nblk + sizeof(kmem_node) + size > (void*)n->next)
+		return NULL;
+	return nblk;
+}
+
+/* Finds a gap fitting the request, returns node owning the gap and writes new node address to nblk_out.
+*  Gaps that may or may not fit are checked in 2 passes: a short one before taking a gap that always fits,
+*  and a longer one, continuing from where the first stopped, if there is no such gap.
+*/
+static kmem_node* kmem_gap_find(size_t size, size_t align, size_t align_off, void** nblk_out)
+{
+	size_t need = size + sizeof(kmem_node);
+	unsigned b_lo = KMEM_GAP_BIN(need), b_hi = KMEM_GAP_BIN(need + align - 1);
+
+	// bins between these can contain gaps fitting the request, depending on alignment padding
+	unsigned b = b_lo;
+	kmem_node* n = kmem_gap_bins[b];
+	for(int pass = 0; pass < 2; ++pass){
+		for(size_t scan = pass ? KMEM_GAP_RESCAN : KMEM_GAP_SCAN; scan; --scan, n = n->gap_next){
+			while(!n && b < b_hi)
+				n = kmem_gap_bins[++b];
+			if(!n)
+				break;
+			if((*nblk_out = kmem_gap_fit(n, size, align, align_off)))
+				return n;
 		}
+		if(pass)
+			break;
 
-		it = it->next;
+		// any gap in a bin above b_hi is at least 2^(b_hi + 1) > need + align - 1 bytes long, so it always fits
+		uint64_t fits = b_hi + 1 < KMEM_GAP_BINS ? kmem_gap_bitmap & ~(((uint64_t)1 << (b_hi + 1)) - 1) : 0;
+		if(fits){
+			kmem_node* any = kmem_gap_bins[__builtin_ctzl(fits)];
+			*nblk_out = kmem_gap_fit(any, size, align, align_off);
+			return any;
+		}
 	}
+	return NULL;
+}
 
-	// if no large enough gap was found, mark space after the last (thus farthest in the memory) node allocated
-	void* nblk = (void*)it + sizeof(kmem_node) + it->sz;
-	if(((uint64_t)nblk + sizeof(kmem_node)) % align)
-		nblk += align - ((uint64_t)nblk + sizeof(kmem_node)) % align;
-	if(nblk + sizeof(kmem_node) + size > occupied_to){
-		if(vmemory_map_alloc){
-			uint64_t mem_unit_size = vmemory_get_mem_unit_size();
-			void* occupied_to_aligned = occupied_to - (uint64_t)occupied_to % mem_unit_size;
-			if((uint64_t)((nblk + sizeof(kmem_node) + size) - occupied_to_aligned) > mem_unit_size){
-				vmemory_map_alloc(occupied_to_aligned + mem_unit_size,
-									(uint64_t)(nblk + sizeof(kmem_node) + size) - (uint64_t)occupied_to_aligned, VMEM_FLAG_SIZE_IN_BYTES);
+/* Heap mapping.
+*  Once the virtual memory module is present, [KMEM_HEAP_BASE, occupied_to) is page-aligned and mapped,
+*  except pages inside large gaps that were handed back to the module (marked in kmem_unmapped_pages).
+*  Free memory is returned with hysteresis, so an alloc/free pair on the boundary doesn't map and unmap the same pages:
+*  the tail is trimmed only when more than KMEM_TRIM_TAIL_THRES bytes past the last node are free, and KMEM_TRIM_TAIL_KEEP
+*  bytes are left mapped; a gap is trimmed only when it contains at least KMEM_TRIM_GAP_MIN bytes of whole pages.
+*  The module allocates it's own structures from the heap while mapping and unmapping, those nested allocations
+*  can't map memory themselves. They are served from KMEM_HEAP_RESERVE bytes that are kept mapped past the last node.
+*/
+#define KMEM_TRIM_TAIL_THRES	(256 * 1024)
+#define KMEM_TRIM_TAIL_KEEP		(64 * 1024)
+#define KMEM_TRIM_GAP_MIN		(64 * KMEM_PAGE_SIZE)
+#define KMEM_HEAP_RESERVE		(64 * 1024)				// should not exceed KMEM_TRIM_TAIL_KEEP
+#define KMEM_HEAP_GROW_STEP		(8 * 1024 * 1024)		// largest range mapped at once, bounds what the module allocates
+
+#define KMEM_PAGE_DOWN(ptr)		((void*)((uintptr_t)(ptr) / KMEM_PAGE_SIZE * KMEM_PAGE_SIZE))
+#define KMEM_PAGE_UP(ptr)		KMEM_PAGE_DOWN((uintptr_t)(ptr) + (KMEM_PAGE_SIZE - 1))
+
+static uint64_t kmem_unmapped_pages[KMEM_HEAP_PAGE_CNT / 64];	// 1 bit per heap page, set if the page was unmapped
+static int kmem_can_trim;	// pages are tracked with KMEM_PAGE_SIZE granularity, so it should match the module's memory unit
+static int kmem_heap_mapping;	// set while the module is called, allocations made by it can't grow the heap
+static size_t kmem_unmapped_cnt;	// pages marked in kmem_unmapped_pages
+static size_t kmem_mapped_peak;
+
+#define KMEM_BYTES_MAPPED()		((size_t)(occupied_to - KMEM_HEAP_BASE) - kmem_unmapped_cnt * KMEM_PAGE_SIZE)
+static void kmem_heap_update_peak()
+{
+	if(KMEM_BYTES_MAPPED() > kmem_mapped_peak)
+		kmem_mapped_peak = KMEM_BYTES_MAPPED();
+}
+
+static int kmem_heap_grow(void* new_end);
+static void kmem_heap_map_start()
+{
+	uint64_t flags = kmem_lock();
+	// module loader maps whole memory units up to the end of the heap
+	uint64_t mem_unit_size = vmemory_get_mem_unit_size();
+	occupied_to += (mem_unit_size - (uint64_t)occupied_to % mem_unit_size) % mem_unit_size;
+	kmem_can_trim = vmemory_unmap && mem_unit_size == KMEM_PAGE_SIZE;
+	kmem_heap_grow(KMEM_NODE_END(kmem_tail)); // set up the reserve
+	kmem_unlock(flags);
+}
+
+/* Makes sure memory up to new_end (plus the reserve) is backed by the virtual memory module (if it's present).
+*  Returns 0 on success.
+*/
+static int kmem_heap_grow(void* new_end)
+{
+	if(!vmemory_map_alloc){
+		if(new_end > occupied_to)
+			occupied_to = new_end;
+		kmem_heap_update_peak();
+		return 0;
+	}
+
+	new_end += KMEM_HEAP_RESERVE;
+	if(new_end <= occupied_to)
+		return 0;
+	if(kmem_heap_mapping) // the reserve has run out during a call to the module
+		return 1;
+	uint64_t mem_unit_size = vmemory_get_mem_unit_size();
+	new_end += (mem_unit_size - (uint64_t)new_end % mem_unit_size) % mem_unit_size;
+
+	int err = 0;
+	kmem_heap_mapping = 1;
+	while(occupied_to < new_end){
+		uint64_t sz = new_end - occupied_to < KMEM_HEAP_GROW_STEP ? new_end - occupied_to : KMEM_HEAP_GROW_STEP;
+		if((err = vmemory_map_alloc(occupied_to, sz, VMEM_FLAG_SIZE_IN_BYTES)))
+			break;
+		occupied_to += sz;
+	}
+	kmem_heap_mapping = 0;
+	kmem_heap_update_peak();
+	return err;
+}
+
+/* Maps back pages in [beg, end) that were unmapped by kmem_heap_trim(). Returns 0 on success. */
+static int kmem_heap_commit(void* beg, void* end)
+{
+	if(!kmem_can_trim || beg >= KMEM_HEAP_BASE + KMEM_HEAP_LIMIT)
+		return 0;
+	if(end > KMEM_HEAP_BASE + KMEM_HEAP_LIMIT)
+		end = KMEM_HEAP_BASE + KMEM_HEAP_LIMIT;
+
+	size_t idx = KMEM_PAGE_IDX(beg), idx_end = KMEM_PAGE_IDX(KMEM_PAGE_UP(end));
+	while(idx < idx_end){
+		if(!KMEM_PAGE_TEST(kmem_unmapped_pages, idx)){
+			++idx;
+			continue;
+		}
+		if(kmem_heap_mapping) // nested allocations can only use pages that are mapped already
+			return 1;
+		size_t run = idx;
+		while(run < idx_end && KMEM_PAGE_TEST(kmem_unmapped_pages, run))
+			++run;
+		kmem_heap_mapping = 1;
+		int err = vmemory_map_alloc(KMEM_HEAP_BASE + idx * KMEM_PAGE_SIZE, run - idx, 0);
+		kmem_heap_mapping = 0;
+		if(err)
+			return 1;
+		kmem_unmapped_cnt -= run - idx;
+		for(; idx < run; ++idx)
+			KMEM_PAGE_CLEAR(kmem_unmapped_pages, idx);
+		kmem_heap_update_peak();
+	}
+	return 0;
+}
+/* Unmaps pages in page-aligned range [beg, end) that are still mapped, going from the end down.
+*  Returns the lowest address p such that [p, end) is unmapped, which is beg unless the virtual memory module failed.
+*/
+static void* kmem_heap_decommit(void* beg, void* end)
+{
+	size_t idx = KMEM_PAGE_IDX(beg), idx_end = KMEM_PAGE_IDX(end);
+	while(idx_end > idx){
+		if(KMEM_PAGE_TEST(kmem_unmapped_pages, idx_end - 1)){
+			--idx_end;
+			continue;
+		}
+		size_t run = idx_end;
+		while(run > idx && !KMEM_PAGE_TEST(kmem_unmapped_pages, run - 1))
+			--run;
+		kmem_heap_mapping = 1;
+		int err = vmemory_unmap(KMEM_HEAP_BASE + run * KMEM_PAGE_SIZE, idx_end - run, 0);
+		kmem_heap_mapping = 0;
+		if(err)
+			break;
+		kmem_unmapped_cnt += idx_end - run;
+		for(; idx_end > run; --idx_end)
+			KMEM_PAGE_SET(kmem_unmapped_pages, idx_end - 1);
+	}
+	return KMEM_HEAP_BASE + idx_end * KMEM_PAGE_SIZE;
+}
+/* Returns whole free pages in the gap of node n and past the last node to the virtual memory module. */
+static void kmem_heap_trim(kmem_node* n)
+{
+	if(!kmem_can_trim || kmem_heap_mapping)
+		return;
+
+	if(n->next){
+		void* beg = KMEM_PAGE_UP(KMEM_NODE_END(n));
+		void* end = KMEM_PAGE_DOWN(n->next);
+		if(end > KMEM_HEAP_BASE + KMEM_HEAP_LIMIT)
+			end = KMEM_HEAP_BASE + KMEM_HEAP_LIMIT;
+		if(end > beg && (size_t)(end - beg) >= KMEM_TRIM_GAP_MIN){
+			kmem_gap_remove(n); // the module may allocate while unmapping, it shouldn't get pages of this gap
+			kmem_heap_decommit(beg, end);
+			kmem_gap_insert(n);
+		}
+	}
+
+	void* tail_end = KMEM_NODE_END(kmem_tail);
+	if((size_t)(occupied_to - tail_end) > KMEM_TRIM_TAIL_THRES && occupied_to <= KMEM_HEAP_BASE + KMEM_HEAP_LIMIT){
+		// only the part that was actually unmapped can be cut off
+		void* beg = kmem_heap_decommit(KMEM_PAGE_UP(tail_end + KMEM_TRIM_TAIL_KEEP), occupied_to);
+		// pages past occupied_to are unmapped by definition
+		for(size_t idx = KMEM_PAGE_IDX(beg); idx < KMEM_PAGE_IDX(occupied_to); ++idx)
+			if(KMEM_PAGE_TEST(kmem_unmapped_pages, idx)){
+				KMEM_PAGE_CLEAR(kmem_unmapped_pages, idx);
+				--kmem_unmapped_cnt;
 			}
-			occupied_to = nblk + sizeof(kmem_node) + size;
-			occupied_to += mem_unit_size - (uint64_t)occupied_to % mem_unit_size;
+		occupied_to = beg;
+	}
+	// the reserve may include pages of a trimmed gap that became the tail
+	kmem_heap_commit(tail_end, tail_end + KMEM_HEAP_RESERVE < occupied_to ? tail_end + KMEM_HEAP_RESERVE : occupied_to);
+}
+
+/* Allocates a block, aligning (returned pointer - align_off) by align. */
+static void* kmem_list_alloc(size_t size, size_t align, size_t align_off)
+{
+	void* nblk;
+	kmem_node* it = kmem_gap_find(size, align, align_off, &nblk);
+
+	if(it){ // put the new node in the gap, splitting it in 2
+		kmem_gap_remove(it);
+		if(kmem_heap_commit(nblk, nblk + sizeof(kmem_node) + size)){
+			kmem_gap_insert(it);
+			return NULL;
 		}
+		kmem_node* n = nblk;
+		n->sz = size;
+		n->next = it->next;
+		n->prev = it;
+		it->next->prev = n;
+		it->next = n;
+		kmem_gap_insert(it);
+		kmem_gap_insert(n);
+		return n + 1;
+	}
+
+	// if no large enough gap was found, mark space after the last (thus farthest in the memory) node allocated
+	for(;;){
+		it = kmem_tail;
+		nblk = kmem_gap_fit(it, size, align, align_off);
+		void* end = nblk + sizeof(kmem_node) + size;
+		if(kmem_heap_commit(nblk, end < occupied_to ? end : occupied_to) || kmem_heap_grow(end))
+			return NULL;
+		if(it == kmem_tail) // otherwise the module has allocated past the last node while mapping, try again
+			break;
+	}
+
+	kmem_node* n = nblk;
+	n->sz = size;
+	n->next = NULL;
+	n->prev = it;
+	it->next = n;
+	kmem_gap_insert(it); // tail gap of the previous last node becomes an interior one
+	kmem_tail = n;
+	return n + 1;
+}
+
+static void kmem_list_free(void* ptr)
+{
+	// unlink the node with previous and next ones, gap of the node is merged into gap of the previous one
+	kmem_node* it = (kmem_node*)ptr - 1;
+	kmem_gap_remove(it);
+	kmem_gap_remove(it->prev);
+	it->prev->next = it->next;
+	if(it->next)
+		it->next->prev = it->prev;
+	else
+		kmem_tail = it->prev;
+	kmem_gap_insert(it->prev);
+	kmem_heap_trim(it->prev);
+}
+
+/* Changes size of the block in place. The block can always shrink (the freed suffix joins it's gap),
+*  and can grow into it's gap or, if it's the last block, past the end of the heap.
+*  Returns 0 on success, non-zero if the block has to be moved.
+*/
+static int kmem_list_resize(kmem_node* n, size_t size)
+{
+	void* end = (void*)(n + 1) + size;
+	if(size > n->sz){
+		if(n == kmem_tail){
+			if(kmem_heap_commit(KMEM_NODE_END(n), end < occupied_to ? end : occupied_to) || kmem_heap_grow(end))
+				return 1;
+			// if the module has allocated past the block while mapping, it's gap is checked below
+		}
+		if(n->next && end > (void*)n->next)
+			return 1;
+	}
+
+	kmem_gap_remove(n);
+	if(size > n->sz && kmem_heap_commit(KMEM_NODE_END(n), end)){
+		kmem_gap_insert(n);
+		return 1;
+	}
+	int shrunk = size < n->sz;
+	n->sz = size;
+	kmem_gap_insert(n);
+	if(shrunk)
+		kmem_heap_trim(n);
+	return 0;
+}
+
+
+/* Slab functions (kmem_spinlock should be held by the caller) */
+
+/* Returns the slab containing ptr, or NULL if ptr is not a slab object. */
+static kmem_slab* kmem_slab_of(void* ptr)
+{
+	if(ptr < KMEM_HEAP_BASE || ptr >= KMEM_HEAP_BASE + KMEM_HEAP_LIMIT)
+		return NULL;
+	size_t idx = KMEM_PAGE_IDX(ptr);
+	if(!KMEM_PAGE_TEST(kmem_slab_pages, idx))
+		return NULL;
+	if(((uintptr_t)ptr - (uintptr_t)KMEM_HEAP_BASE) % KMEM_SLAB_SIZE < KMEM_SLAB_OBJ_OFFSET)
+		return NULL; // a zero-sized list block can end right where a slab begins
+
+	return (kmem_slab*)((kmem_node*)(KMEM_HEAP_BASE + idx * KMEM_SLAB_SIZE) + 1);
+}
+
+static void kmem_slab_link(kmem_slab** list, kmem_slab* s)
+{
+	s->prev = NULL;
+	s->next = *list;
+	if(*list)
+		(*list)->prev = s;
+	*list = s;
+}
+static void kmem_slab_unlink(kmem_slab** list, kmem_slab* s)
+{
+	if(s->prev)
+		s->prev->next = s->next;
+	else
+		*list = s->next;
+	if(s->next)
+		s->next->prev = s->prev;
+}
+
+static kmem_slab* kmem_slab_create(kmem_slab_cache* c)
+{
+	kmem_slab* s = kmem_list_alloc(KMEM_SLAB_SIZE - sizeof(kmem_node), KMEM_SLAB_SIZE, sizeof(kmem_node));
+	if(!s)
+		return NULL;
+	if((void*)s >= KMEM_HEAP_BASE + KMEM_HEAP_LIMIT){ // page can't be marked, let the list handle this request
+		kmem_list_free(s);
+		return NULL;
+	}
+	KMEM_PAGE_SET(kmem_slab_pages, KMEM_PAGE_IDX(s));
+
+	s->cache = c;
+	s->inuse = 0;
+	s->total = (KMEM_SLAB_SIZE - KMEM_SLAB_OBJ_OFFSET) / c->obj_size;
+	s->free = NULL;
+	void* objs = (void*)s - sizeof(kmem_node) + KMEM_SLAB_OBJ_OFFSET;
+	for(uint32_t i = s->total; i > 0; --i){ // build the free list so objects are handed out in address order
+		void* obj = objs + (i - 1) * c->obj_size;
+		*(void**)obj = s->free;
+		s->free = obj;
+	}
+	return s;
+}
+static void kmem_slab_destroy(kmem_slab* s)
+{
+	KMEM_PAGE_CLEAR(kmem_slab_pages, KMEM_PAGE_IDX(s));
+	kmem_list_free(s);
+}
+
+static void* kmem_slab_alloc(kmem_slab_cache* c)
+{
+	kmem_slab* s = c->partial;
+	if(!s){
+		if(c->empty){
+			s = c->empty;
+			c->empty = NULL;
+		}
+		else if(!(s = kmem_slab_create(c)))
+			return NULL;
+		kmem_slab_link(&c->partial, s);
+	}
+
+	void* obj = s->free;
+	s->free = *(void**)obj;
+	if(++s->inuse == s->total) // full slabs are not kept on any list, kmem_slab_free() will find them by address
+		kmem_slab_unlink(&c->partial, s);
+	return obj;
+}
+static void kmem_slab_free(kmem_slab* s, void* ptr)
+{
+	kmem_slab_cache* c = s->cache;
+	*(void**)ptr = s->free;
+	s->free = ptr;
+	if(s->inuse-- == s->total)
+		kmem_slab_link(&c->partial, s);
+
+	if(!s->inuse){
+		kmem_slab_unlink(&c->partial, s);
+		if(!c->empty)
+			c->empty = s;
 		else
-			occupied_to = nblk + sizeof(kmem_node) + size;
+			kmem_slab_destroy(s);
 	}
-	it->next = nblk;
-	it->next->sz = size;
-	it->next->next = NULL;
-	it->next->prev = it;
-	spinlock_unlock(&kmem_spinlock);
-	return it->next + 1;
+}
+
+/* Returns a slab cache suitable for the request, or NULL if it should be served by the list. */
+static kmem_slab_cache* kmem_slab_cache_for(size_t size, size_t align)
+{
+	if(size > KMEM_SLAB_MAX_OBJ || align > KMEM_SLAB_OBJ_ALIGN)
+		return NULL;
+	for(size_t c = kmem_slab_class[(size + 7) / 8]; c < KMEM_SLAB_CACHE_CNT; ++c)
+		if(kmem_slab_caches[c].obj_align >= align)
+			return &kmem_slab_caches[c];
+	return NULL;
+}
+
+
+/* Per-CPU magazine layer.
+*  Every CPU (identified by it's LAPIC ID) keeps 2 magazines of objects per slab cache: a loaded one
+*  and a previous one. Allocations and frees are served from them with interrupts disabled and no locks taken.
+*  Only when both magazines are empty (or both are full) a whole magazine is exchanged with the per-cache depot.
+*/
+#define KMEM_MAG_SIZE			30		// keeps sizeof(kmem_magazine) at 256 bytes, so magazines come from a slab cache
+#define KMEM_DEPOT_MAX_FULL		8		// full magazines kept by the depot per cache, excess is flushed back to slabs
+#define KMEM_MAX_CPUS			256		// LAPIC IDs are 8-bit
+
+typedef struct kmem_magazine kmem_magazine;
+struct kmem_magazine
+{
+	kmem_magazine* next;	// link in the depot lists
+	uint64_t cnt;
+	void* objs[KMEM_MAG_SIZE];
+};
+typedef struct {
+	kmem_magazine* loaded[KMEM_SLAB_CACHE_CNT];
+	kmem_magazine* prev[KMEM_SLAB_CACHE_CNT];
+	int64_t live[KMEM_SLAB_CACHE_CNT];		// objects allocated minus objects freed on this CPU, see kmem_get_stats()
+} kmem_cpu_cache;
+typedef struct {
+	kmem_magazine* full;
+	kmem_magazine* empty;
+	size_t full_cnt;
+	spinlock lock;
+} kmem_depot;
+
+static kmem_cpu_cache* kmem_cpu_caches[KMEM_MAX_CPUS];
+static kmem_depot kmem_depots[KMEM_SLAB_CACHE_CNT];
+
+static void kmem_cpu_init()
+{
+	for(size_t c = 0; c < KMEM_SLAB_CACHE_CNT; ++c){
+		kmem_depots[c].full = kmem_depots[c].empty = NULL;
+		kmem_depots[c].full_cnt = 0;
+		spinlock_init(&kmem_depots[c].lock);
+	}
+}
+
+static kmem_magazine* kmem_magazine_create()
+{
+	uint64_t flags = kmem_lock();
+	kmem_magazine* m = kmem_slab_alloc(kmem_slab_cache_for(sizeof(kmem_magazine), 1));
+	kmem_unlock(flags);
+	if(m)
+		m->cnt = 0;
+	return m;
+}
+// Returns all objects of a magazine to their slabs.
+static void kmem_magazine_flush(kmem_slab_cache* c, kmem_magazine* m)
+{
+	uint64_t flags = kmem_lock();
+	while(m->cnt){
+		void* obj = m->objs[--m->cnt];
+		kmem_slab_free(kmem_slab_of(obj), obj);
+	}
+	kmem_unlock(flags);
+}
+
+/* Returns per-CPU cache of the current CPU, with magazines of cache c ready to use,
+*  or NULL if it couldn't be set up (interrupts should be disabled by the caller).
+*/
+static kmem_cpu_cache* kmem_cpu_cache_get(size_t ci)
+{
+	uint32_t cpu = kmem_cpu_id();
+	if(cpu >= KMEM_MAX_CPUS)
+		return NULL;
+	kmem_cpu_cache* pc = kmem_cpu_caches[cpu];
+	if(!pc){
+		uint64_t flags = kmem_lock();
+		pc = kmem_slab_alloc(kmem_slab_cache_for(sizeof(kmem_cpu_cache), 1));
+		kmem_unlock(flags);
+		if(!pc)
+			return NULL;
+		memset(pc, 0, sizeof(kmem_cpu_cache));
+		kmem_cpu_caches[cpu] = pc;
+	}
+	if(!pc->loaded[ci] && !(pc->loaded[ci] = kmem_magazine_create()))
+		return NULL;
+	if(!pc->prev[ci] && !(pc->prev[ci] = kmem_magazine_create()))
+		return NULL;
+	return pc;
+}
+
+static void* kmem_cpu_alloc(kmem_slab_cache* c)
+{
+	size_t ci = c - kmem_slab_caches;
+	uint64_t flags = cpu_interrupt_save();
+	kmem_cpu_cache* pc = kmem_cpu_cache_get(ci);
+	if(!pc){
+		cpu_interrupt_restore(flags);
+		return NULL;
+	}
+
+	kmem_magazine* m = pc->loaded[ci];
+	if(!m->cnt){
+		if(pc->prev[ci]->cnt){ // previous magazine still has objects, swap
+			pc->loaded[ci] = pc->prev[ci];
+			pc->prev[ci] = m;
+		}
+		else{ // both are empty, try to exchange the empty previous magazine for a full one from the depot
+			kmem_depot* d = &kmem_depots[ci];
+			spinlock_lock(&d->lock);
+			if(d->full){
+				kmem_magazine* full = d->full;
+				d->full = full->next;
+				--d->full_cnt;
+				pc->prev[ci]->next = d->empty;
+				d->empty = pc->prev[ci];
+				pc->prev[ci] = m;
+				pc->loaded[ci] = full;
+			}
+			spinlock_unlock(&d->lock);
+		}
+		m = pc->loaded[ci];
+	}
+	if(!m->cnt){ // depot is empty as well, fill half of the magazine from slabs with a single lock
+		uint64_t lflags = kmem_lock();
+		while(m->cnt < KMEM_MAG_SIZE / 2){
+			void* obj = kmem_slab_alloc(c);
+			if(!obj)
+				break;
+			m->objs[m->cnt++] = obj;
+		}
+		kmem_unlock(lflags);
+	}
+
+	void* obj = NULL;
+	if(m->cnt){
+		obj = m->objs[--m->cnt];
+		++pc->live[ci];
+	}
+	cpu_interrupt_restore(flags);
+	return obj;
+}
+/* Returns 0 if the object couldn't be cached and should be freed to it's slab directly. */
+static int kmem_cpu_free(kmem_slab_cache* c, void* ptr)
+{
+	size_t ci = c - kmem_slab_caches;
+	uint64_t flags = cpu_interrupt_save();
+	kmem_cpu_cache* pc = kmem_cpu_cache_get(ci);
+	if(!pc){
+		cpu_interrupt_restore(flags);
+		return 0;
+	}
+
+	kmem_magazine* m = pc->loaded[ci];
+	if(m->cnt == KMEM_MAG_SIZE){
+		if(pc->prev[ci]->cnt < KMEM_MAG_SIZE){ // previous magazine has space, swap
+			pc->loaded[ci] = pc->prev[ci];
+			pc->prev[ci] = m;
+		}
+		else{ // both are full, hand the previous one to the depot in exchange for an empty one
+			kmem_depot* d = &kmem_depots[ci];
+			kmem_magazine* full = pc->prev[ci];
+			kmem_magazine* empty = NULL;
+			int flush = 0;
+			spinlock_lock(&d->lock);
+			if(d->full_cnt < KMEM_DEPOT_MAX_FULL){
+				full->next = d->full;
+				d->full = full;
+				++d->full_cnt;
+				if(d->empty){
+					empty = d->empty;
+					d->empty = empty->next;
+				}
+			}
+			else
+				flush = 1;
+			spinlock_unlock(&d->lock);
+
+			if(flush){ // depot already holds enough, objects go back to slabs and the magazine is reused
+				kmem_magazine_flush(c, full);
+				empty = full;
+			}
+			else if(!empty && !(empty = kmem_magazine_create())){
+				pc->prev[ci] = NULL; // will be recreated on next use
+				cpu_interrupt_restore(flags);
+				return 0;
+			}
+			pc->prev[ci] = m;
+			pc->loaded[ci] = empty;
+		}
+		m = pc->loaded[ci];
+	}
+
+	m->objs[m->cnt++] = ptr;
+	--pc->live[ci];
+	cpu_interrupt_restore(flags);
+	return 1;
+}
+
+
+/* Public interface */
+
+static size_t kmem_list_live, kmem_list_live_bytes;		// allocations served by the list, see kmem_get_stats()
+
+void* kmalloc(size_t size)
+{
+	return kmalloc_align(size, 1);
+}
+void* kmalloc_align(size_t size, size_t align)
+{
+	void* ptr = NULL;
+	kmem_slab_cache* c = kmem_slab_cache_for(size, align);
+	if(c && (ptr = kmem_cpu_alloc(c)))
+		return ptr;
+
+	uint64_t flags = kmem_lock();
+	if(c && (ptr = kmem_slab_alloc(c)))
+		++kmem_slab_live[c - kmem_slab_caches];
+	if(!ptr && (ptr = kmem_list_alloc(size, align, 0))){
+		++kmem_list_live;
+		kmem_list_live_bytes += size;
+	}
+	kmem_unlock(flags);
+	return ptr;
 }
 
 void* krealloc(void* ptr, size_t size)
@@ -117,37 +854,96 @@ void* krealloc_align(void* ptr, size_t size, size_t align)
 	if(!ptr)
 		return kmalloc_align(size, align);
 
-	spinlock_lock(&kmem_spinlock);
-	kmem_node* kn = ptr; kn--;
-
-	if(kn->next){ // if it's not the last element on the list, try to resize in the gap first
-		void* gap_beg = ptr;
-		void* gap_end = kn->next;
-		size_t gap = gap_end - gap_beg;
-		if(gap >= size + sizeof(kmem_node)){
-			kn->sz = size;
-			return kn + 1;
+	size_t old_size;
+	kmem_slab* s = kmem_slab_of(ptr);
+	if(s){ // slab objects can be resized in place as long as the size class fits
+		old_size = s->cache->obj_size;
+		if(size <= old_size && (uintptr_t)ptr % align == 0)
+			return ptr;
+	}
+	else{
+		uint64_t flags = kmem_lock();
+		kmem_node* kn = (kmem_node*)ptr - 1;
+		old_size = kn->sz;
+		if((uintptr_t)ptr % align == 0 && !kmem_list_resize(kn, size)){
+			kmem_list_live_bytes += size - old_size;
+			kmem_unlock(flags);
+			return ptr;
 		}
+		kmem_unlock(flags);
 	}
-	// otherwise try to allocate space somewhere else
+
+	// otherwise move the block
 	void* nptr = kmalloc_align(size, align);
 	if(!nptr)
 		return NULL;
 
-	memcpy(nptr, ptr, kn->sz);
+	memcpy(nptr, ptr, old_size < size ? old_size : size);
 	kfree(ptr);
-	spinlock_unlock(&kmem_spinlock);
 	return nptr;
 }
 
 void kfree(void* ptr)
 {
-	// just unlink the node with previous and next ones, if they exist
-	spinlock_lock(&kmem_spinlock);
-	kmem_node* it = (kmem_node*)ptr - 1;
-	if(it->prev)
-		it->prev->next = it->next;
-	if(it->next)
-		it->next->prev = it->prev;
-	spinlock_unlock(&kmem_spinlock);
+	if(!ptr)
+		return;
+	// slab bitmap bit and cache of a slab don't change while it has live objects, no need for the lock here
+	kmem_slab* s = kmem_slab_of(ptr);
+	if(s && kmem_cpu_free(s->cache, ptr))
+		return;
+
+	uint64_t flags = kmem_lock();
+	if(s){
+		--kmem_slab_live[s->cache - kmem_slab_caches];
+		kmem_slab_free(s, ptr);
+	}
+	else{
+		--kmem_list_live;
+		kmem_list_live_bytes -= ((kmem_node*)ptr - 1)->sz;
+		kmem_list_free(ptr);
+	}
+	kmem_unlock(flags);
+}
+
+void kmem_get_stats(kmem_stats* st)
+{
+	memset(st, 0, sizeof(kmem_stats));
+	uint64_t flags = kmem_lock();
+	st->bytes_mapped = KMEM_BYTES_MAPPED();
+	st->bytes_mapped_peak = kmem_mapped_peak;
+
+	for(size_t b = 0; b < KMEM_GAP_BINS; ++b)
+		st->gap_cnt[b] = kmem_gap_cnt[b];
+	if(kmem_gap_bitmap) // only the highest non-empty bin can hold the largest gap
+		for(kmem_node* n = kmem_gap_bins[KMEM_GAP_BIN(kmem_gap_bitmap)]; n; n = n->gap_next)
+			if(KMEM_GAP_SIZE(n) > st->largest_gap)
+				st->largest_gap = KMEM_GAP_SIZE(n);
+
+	for(size_t c = 0; c < KMEM_SLAB_CACHE_CNT; ++c){
+		int64_t live = kmem_slab_live[c];
+		for(size_t cpu = 0; cpu < KMEM_MAX_CPUS; ++cpu) // counters of other CPUs are read without synchronization
+			if(kmem_cpu_caches[cpu])
+				live += kmem_cpu_caches[cpu]->live[c];
+		st->slab_obj_size[c] = kmem_slab_caches[c].obj_size;
+		st->slab_allocs[c] = live > 0 ? live : 0; // an object can be freed on another CPU, so a single counter can be negative
+		st->bytes_live += st->slab_allocs[c] * st->slab_obj_size[c];
+	}
+	st->list_allocs = kmem_list_live;
+	st->bytes_live += kmem_list_live_bytes;
+	kmem_unlock(flags);
+}
+
+void print_kmem_stats()
+{
+	kmem_stats st;
+	kmem_get_stats(&st);
+	uart_printf("kmem: live %lu B, mapped %lu B (peak %lu B), largest gap %lu B, list allocs %lu, slab allocs",
+			st.bytes_live, st.bytes_mapped, st.bytes_mapped_peak, st.largest_gap, st.list_allocs);
+	for(size_t c = 0; c < KMEM_STAT_SLAB_CLASSES; ++c)
+		uart_printf(" %lu:%lu", st.slab_obj_size[c], st.slab_allocs[c]);
+	uart_printf(", gaps");
+	for(size_t b = 0; b < KMEM_STAT_GAP_BINS; ++b)
+		if(st.gap_cnt[b])
+			uart_printf(" 2^%lu:%lu", b, st.gap_cnt[b]);
+	uart_printf("\r\n");
 }
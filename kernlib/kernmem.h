@@ -9,12 +9,32 @@
 #define KMEM_HEAP_BASE ((void*)0x200000)
 
 void kmem_init();
-void kmem_set_map_functions(int (*alloc_func)(void*, uint64_t, int),
+/* Makes the heap grow through the virtual memory module (map_alloc()) and return freed pages with unmap(). */
+void kmem_set_map_functions(int (*alloc_func)(void*, uint64_t, int), int (*unmap_func)(void*, uint64_t, int),
 				uint64_t (*mem_unit_size_func)());
 
 void* kmem_get_heap_end();
 void print_kmem_llist();
 
+#define KMEM_STAT_GAP_BINS			64
+#define KMEM_STAT_SLAB_CLASSES		11
+
+typedef struct {
+	size_t bytes_live;				// bytes handed out to callers, slab objects are counted by their size class
+	size_t bytes_mapped;			// heap memory currently backed by the virtual memory module
+	size_t bytes_mapped_peak;		// high-water mark of bytes_mapped
+	size_t largest_gap;				// largest free space between 2 blocks (free space past the last block is not counted)
+	size_t gap_cnt[KMEM_STAT_GAP_BINS];				// free gaps by floor(log2(gap size))
+	size_t slab_obj_size[KMEM_STAT_SLAB_CLASSES];	// object size of each size class
+	size_t slab_allocs[KMEM_STAT_SLAB_CLASSES];		// live allocations by size class
+	size_t list_allocs;				// live allocations that are too large or too aligned for a size class
+} kmem_stats;
+
+/* Fills st with current heap statistics. Counters are maintained on alloc/free paths, so this doesn't walk the heap. */
+void kmem_get_stats(kmem_stats* st);
+/* Prints heap statistics as a single line. */
+void print_kmem_stats();
+
 void* kmalloc(size_t size);
 void* kmalloc_align(size_t size, size_t align);
 void* krealloc(void* ptr, size_t size);
@@ -7,6 +7,9 @@ _ts_scheduler_prev_threads:
 global _ts_scheduler_switch_enable_flag
 _ts_scheduler_switch_enable_flag:
 	dq 0x0
+global _ts_load_mem_hndl
+_ts_load_mem_hndl:
+	dq 0x0
 
 global ap_periodic_switch
 ap_periodic_switch:
@@ -138,6 +141,25 @@ global load_context
 load_context:
 	mov rax, [rsp+8]
 
+	; Page tables go first, the call clobbers caller-saved registers.
+	; A saved PCID may belong to another address space by now, so the memory handler of the thread is loaded with the PCID it has now.
+	mov rbx, [rax+168]	; CR4 goes first: CR4.PCIDE can only be set while CR3 holds PCID 0
+	mov cr4, rbx
+	mov rdi, [rax+736]	; mem_hndl
+	test rdi, rdi
+	jz .load_raw_cr3
+	push rax
+	mov rbx, _ts_load_mem_hndl
+	mov rbx, [rbx]
+	call rbx
+	pop rax
+	jmp .end_cr3
+	.load_raw_cr3:
+	mov rbx, [rax+160]
+	and rbx, -4096	; PCID 0, it's translations are flushed
+	mov cr3, rbx
+	.end_cr3:
+
 	; General-purpose registers (except RAX and RBX)
 	mov rcx, [rax+16]
 	mov rdx, [rax+24]
@@ -161,10 +183,6 @@ load_context:
 	mov cr0, rbx
 	mov rbx, [rax+152]
 	mov cr2, rbx
-	mov rbx, [rax+160]
-	mov cr3, rbx
-	mov rbx, [rax+168]
-	mov cr4, rbx
 	; Debug registers
 	mov rbx, [rax+176]
 	mov dr0, rbx
@@ -19,6 +19,7 @@
 #include "ap_periodic_switch.h"
 #include "acpi.h"
 #include "scheduler.h"
+#include "process.h"
 
 #include "modules/vmemory/vmemory.h"
 
@@ -84,7 +85,10 @@ int mtask_init()
 	boot_log_printf_status(BOOT_LOG_STATUS_SUCCESS, "Detected %u APs, trying to start them", core_num - 1);
 
 	// init scheduler
-	int err = scheduler_init();
+	int err = process_init();
+	if(err)
+		return err;
+	err = scheduler_init();
 	if(err)
 		return err;
 
@@ -125,7 +129,7 @@ int start_ap(size_t core_ind, uint32_t task_reg)
 	uint64_t cr3;
 	asm volatile("mov %%cr3, %%rax\n\t"
 				 "mov %%rax, %0" : "=m" (cr3));
-	tramp_data->page_table = cr3;
+	tramp_data->page_table = cr3 & ~(uint64_t)0xFFF; // PCID bits can't be loaded before long mode is enabled
 
 	tramp_data->boot_flag = 0;
 	tramp_data->jmp_loc = (uintptr_t)(&core_info[core_ind].jmp_loc);
@@ -172,6 +176,8 @@ int ap_jump(size_t ap_idx, void* loc)
 
 int ap_set_timer()
 {
+	apic_cpu_id_init(); // before anything allocates from the heap
+	vmemory_init_ap();
 	apic_enable_spurious_ints();
 	apic_set_timer(APIC_TIMER_PERIODIC, MTASK_SWITCH_TIMER_TIME, MTASK_SWITCH_TIMER_GATE);
 	return 0;
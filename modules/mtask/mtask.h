@@ -10,6 +10,7 @@
 #define MTASK_ERR_CANT_FIND_RSDP		-1
 #define MTASK_ERR_AP_IDX_DOESNT_EXIST	-2
 #define MTASK_ERR_GATE_OOB				-3
+#define MTASK_ERR_NO_MEMORY				-4
 
 #define MTASK_AP_BOOT_TRY_COUNT			100 	// count of boot flag checks (with 5ms break between them)
 #define MTASK_TSS_STACK_SIZE			1024
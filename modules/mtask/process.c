@@ -1,7 +1,33 @@
 #include "process.h"
+#include "mtask.h"
+#include "string.h"
 #include "kernlib/kernmem.h"
+#include "kernlib/kerncache.h"
 #include "modules/vmemory/vmemory.h"
 
+static kmem_cache* thread_cache;
+
+static void thread_ctor(void* th)
+{
+	memset(th, 0, sizeof(thread));
+}
+
+int process_init()
+{
+	thread_cache = kmem_cache_create(sizeof(thread), 16, thread_ctor);
+	return thread_cache ? 0 : MTASK_ERR_NO_MEMORY;
+}
+
+thread* thread_alloc()
+{
+	return kmem_cache_alloc(thread_cache);
+}
+void thread_free(thread* th)
+{
+	thread_ctor(th);
+	kmem_cache_free(thread_cache, th);
+}
+
 void create_process(process* pr)
 {
 	pr->memory_hndl = kmalloc(get_mem_hndl_size());
@@ -11,9 +37,18 @@ void create_process(process* pr)
 
 thread* process_add_thread(process* pr, thread* th)
 {
-	++pr->thread_cnt;
-	pr->threads = krealloc(pr->threads, pr->thread_cnt * sizeof(thread));
-	pr->threads[pr->thread_cnt - 1] = *th;
-	th->parent_proc = pr;
-	return &pr->threads[pr->thread_cnt - 1];
+	thread* copy = thread_alloc();
+	if(!copy)
+		return NULL;
+	thread** threads = krealloc(pr->threads, (pr->thread_cnt + 1) * sizeof(thread*));
+	if(!threads){
+		thread_free(copy);
+		return NULL;
+	}
+	*copy = *th;
+	copy->parent_proc = pr;
+	copy->mem_hndl = pr->memory_hndl;
+	pr->threads = threads;
+	pr->threads[pr->thread_cnt++] = copy;
+	return copy;
 }
@@ -12,9 +12,21 @@ struct process{
 	void* memory_hndl;	// handler size is derived from get_mem_hndl_size()
 
 	size_t thread_cnt;
-	thread* threads;
+	thread** threads;
 };
 
+/* Initializes the thread cache (called by mtask_init()).
+*  Return value:
+*	0			OK
+*	non-zero	error, see mtask.h
+*/
+int process_init();
+
+/* Allocates a zeroed thread structure, aligned as required by FXSAVE, or returns NULL if out of memory. */
+thread* thread_alloc();
+/* Returns a thread structure allocated by thread_alloc() or process_add_thread(). */
+void thread_free(thread* th);
+
 /* Creates a new process that doesn't contain anything (but has a valid memory handle).
 *  Arguments:
 *	pr - process instance to initialize.
@@ -23,11 +35,11 @@ void create_process(process* pr);
 
 /* Adds a thread to the process. If scheduler is already aware of the process,
 *  it will be aware of the thread as well.
-*  Makes a copy of the thread structure rather than storing a pointer.
+*  Makes a copy of the thread structure (allocated with thread_alloc()) rather than storing a pointer.
 *  Arguments:
 *	pr - process to add thread \th\ to.
 *  Return value:
-*	pointer to thread entry in the thread array of the process.
+*	pointer to the copy, which stays valid as more threads are added, or NULL if out of memory.
 */
 thread* process_add_thread(process* pr, thread* th);
 
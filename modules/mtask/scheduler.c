@@ -6,6 +6,7 @@
 #include "mtask.h"
 #include "string.h"
 #include "kernlib/kernmem.h"
+#include "kernlib/kerncache.h"
 #include "log/boot_log.h"
 #include "dev/uart.h"
 #include "cpu/x86/apic.h"
@@ -21,6 +22,8 @@ static spinlock cpu_tree_list_lock;
 
 static thread_pqueue* cpu_sleep_pqueue_list;
 
+static kmem_cache* thread_tree_node_cache; // queueing and dequeueing a thread doesn't touch the heap
+
 static void print_cpu_tree_list()
 {
 	uart_printf("\r\n");
@@ -35,6 +38,8 @@ static void print_cpu_tree_list()
 
 extern uint64_t _ts_scheduler_advance_thread_queue[1];
 extern uint64_t _ts_scheduler_prev_threads[1];
+extern uint64_t _ts_load_mem_hndl[1];
+extern void load_mem_hndl(void* hndl);
 thread* scheduler_advance_thread_queue();
 thread** scheduler_prev_threads;
 
@@ -47,6 +52,10 @@ int scheduler_init()
 	cpu_trees = kmalloc(sizeof(thread_tree) * core_num);
 	cpu_sleep_pqueue_list = kmalloc(sizeof(thread_pqueue) * core_num);
 
+	thread_tree_node_cache = kmem_cache_create(sizeof(thread_tree_node), sizeof(void*), NULL);
+	if(!thread_tree_node_cache)
+		return MTASK_ERR_NO_MEMORY;
+
 	cpu_tree_list = NULL;
 	for(uint8_t i = 0; i < core_num; ++i){
 		thread_tree* t = cpu_trees + i;
@@ -70,6 +79,7 @@ int scheduler_init()
 	spinlock_init(&cpu_tree_list_lock);
 
 	*_ts_scheduler_advance_thread_queue = (uintptr_t)scheduler_advance_thread_queue;
+	*_ts_load_mem_hndl = (uintptr_t)load_mem_hndl;
 
 	scheduler_prev_threads = kmalloc_align(sizeof(thread*) * core_num, SCHEDULER_THREAD_ALIGN);
 	for(uint8_t i = 0; i < core_num; ++i)
@@ -189,7 +199,7 @@ static void thread_tree_add(thread_tree* tree, thread* th)
 		tree->time_slice = min_granularity;
 
 	tree->time_slice *= 1000000;
-	thread_tree_node* n = kmalloc(sizeof(thread_tree_node));
+	thread_tree_node* n = kmem_cache_alloc(thread_tree_node_cache);
 	n->thr = th;
 	th->hndl = n; th->tree = tree;
 	thread_tree_insert(tree, n);
@@ -204,7 +214,7 @@ static void thread_tree_remove(thread* th)
 	tree->time_slice *= 1000000;
 
 	thread_tree_node* n = thread_tree_delete(tree, th->hndl);
-	kfree(n);
+	kmem_cache_free(thread_tree_node_cache, n);
 }
 
 static uint64_t get_min_vruntime(thread_tree* tree)
@@ -271,7 +281,7 @@ void scheduler_sleep_thread(thread* th, uint64_t time_ns)
 static uint64_t ts_time_left = 0; // tracks time before an actual task switch
 thread* scheduler_advance_thread_queue()
 {
-	uint32_t lapic_id = lapic_read(LAPIC_REG_ID) >> 24;
+	uint32_t lapic_id = apic_cpu_id();
 
 	// Measure time passed since last interrupt
 	uint64_t timer_val = HPET_READ_REG(timer_addr, HPET_GENREG_COUNTER);
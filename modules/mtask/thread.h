@@ -24,6 +24,7 @@ typedef struct {
 		uint64_t dr0, dr1, dr2, dr3, dr6, dr7;
 		__attribute__ ((aligned(16))) unsigned char fx[512]; // memory for FXSAVE/FXRSTOR instructions
 	} state;
+	void* mem_hndl; // memory handler the thread runs in (loaded by load_context() instead of state.cr3), NULL to load state.cr3 without it's PCID
 
 	int flags;
 
@@ -2,8 +2,14 @@
 
 #include <stddef.h>
 
+#include "string.h"
 #include "dev/uart.h"
 #include "kernlib/kernmem.h"
+#include "kernlib/kerncache.h"
+#include "cpu/cpu_int.h"
+#include "cpu/spinlock.h"
+#include "cpu/x86/apic.h"
+#include "stivale2.h"
 
 #define TREE_CLR_BLACK 	0
 #define TREE_CLR_RED 	1
@@ -12,89 +18,554 @@
 #define TREE_DIR_RIGHT	1
 
 #define TREE_DIR_CHILD(n) ((n) == ((n)->parent)->child[TREE_DIR_RIGHT] ? TREE_DIR_RIGHT : TREE_DIR_LEFT)
-#define TREE_GET_SIBLING(n) ((n)->parent ? (n)->parent->child[TREE_DIR_CHILD(n)] : NULL)
+#define TREE_GET_SIBLING(n) ((n)->parent ? (n)->parent->child[1 - TREE_DIR_CHILD(n)] : NULL)
 
 #define TREE_GET_CLR(n) ((uint64_t)(n)->size >> 63)
 #define TREE_SET_CLR(n, clr) { if(clr) (n)->size = ((uint64_t)(n)->size | ((uint64_t)1 << 63)); else (n)->size = ((uint64_t)(n)->size & ~((uint64_t)1 << 63)); }
 #define TREE_GET_SIZE(n) ((uint64_t)(n)->size & ~((uint64_t)1 << 63))
-#define TREE_SET_SIZE(n, sz) { (n)->size = (sz) & ~((uint64_t)1 << 63); }
+#define TREE_SET_SIZE(n, sz) { (n)->size = ((sz) & ~((uint64_t)1 << 63)) | ((uint64_t)(n)->size & ((uint64_t)1 << 63)); }
 
 typedef struct node node;
 struct node {
 	void* addr;
 	uint64_t size;
+	uint64_t max_size;		// largest size in the subtree, lets first fit searches skip subtrees that are too small
 
 	node *child[2];
 	node *parent;
 };
 
-static struct {
+typedef struct {
 	node* root;
-} alloc_tree;
+} tree;
+
+/* Zones
+*  Free memory is split by physical address into zones, each with it's own tree and buddy free lists,
+*  so free ranges and buddy blocks never cross zone boundaries.
+*  A request for a zone is served by the zone itself or by lower zones, highest first.
+*/
+static const uint64_t zone_end[ALLOC_ZONE_CNT] = {0x100000, 0x100000000, (uint64_t)-1};
+static tree zone_trees[ALLOC_ZONE_CNT];
+
+static int zone_of(void* addr)
+{
+	int zone = ALLOC_ZONE_LOW;
+	while((uint64_t)addr >= zone_end[zone])
+		++zone;
+	return zone;
+}
 
 
-// Memory pool, since allocator uses module loader memory allocation, which relies on paging, which relies on allocator
-#define NODE_MEM_POOL_SIZE	112	// doubled rough estimate, considering that there are 48 bits adressable: log_2(memory size / 2 MB (page size)) * 2 ~ 56
-static node* node_mem_pool[NODE_MEM_POOL_SIZE];
-static size_t node_mem_pool_i;		// current index into memory pool.
+/* Shared state (the tree and the buddy allocator) is protected by alloc_spinlock, which is taken with interrupts disabled.
+*  The heap maps memory using this allocator while holding it's own lock, so the heap must not be called with alloc_spinlock held.
+*/
+static spinlock alloc_spinlock;
 
-static void node_mem_pool_init()
+static uint64_t alloc_lock()
+{
+	uint64_t flags = cpu_interrupt_save();
+	spinlock_lock(&alloc_spinlock);
+	return flags;
+}
+static void alloc_unlock(uint64_t flags)
 {
-	for(size_t i = 0; i < NODE_MEM_POOL_SIZE; ++i)
-		node_mem_pool[i] = kmalloc(sizeof(node));
+	spinlock_unlock(&alloc_spinlock);
+	cpu_interrupt_restore(flags);
 }
+
+/* Nodes come from an object cache, which takes memory from the heap. Tree operations take nodes from
+*  a spare list instead, which is filled beforehand with alloc_spinlock released.
+*/
+#define NODE_RESERVE	4	// allocator_alloc_addr() needs 2 nodes at most
+#define NODE_SPARE_MAX	32	// more freed nodes go back to the cache
+static kmem_cache* node_cache;
+static node* node_spare;	// linked through child[0]
+static size_t node_spare_cnt;
+
 static node* alloc_node()
 {
-	if(node_mem_pool_i++ >= NODE_MEM_POOL_SIZE / 2){
-		for(size_t i = node_mem_pool_i; i < NODE_MEM_POOL_SIZE; ++i){ // can't use memmove: it requires memory allocation (at least in a naive implementation)
-			node_mem_pool[i - node_mem_pool_i] = node_mem_pool[i];
-			node_mem_pool[i] = kmalloc(sizeof(node));
-		}
-		node_mem_pool_i = 0;
+	node* n = node_spare;
+	node_spare = n->child[0];
+	--node_spare_cnt;
+	return n;
+}
+static void free_node(node* n)
+{
+	if(node_spare_cnt < NODE_SPARE_MAX){
+		n->child[0] = node_spare;
+		node_spare = n;
+		++node_spare_cnt;
+	}
+	else
+		kmem_cache_free(node_cache, n);
+}
+
+/* Makes sure there are at least cnt spare nodes. alloc_spinlock should be held by the caller, it is released while
+*  the cache is called, and held again on return.
+*  Return value:
+*	0			OK
+*	non-zero	out of memory
+*/
+static int alloc_reserve_nodes(size_t cnt, uint64_t* flags)
+{
+	while(node_spare_cnt < cnt){
+		alloc_unlock(*flags);
+		node* n = kmem_cache_alloc(node_cache);
+		*flags = alloc_lock();
+		if(!n)
+			return 1;
+		free_node(n);
 	}
-	return node_mem_pool[node_mem_pool_i];
+	return 0;
 }
 
 
-void alloc_tree_insert(node* n);
-void alloc_tree_insertp(node* n, node* p, int dir);
-void alloc_tree_delete(node *n);
+void alloc_tree_insert(tree* t, node* n);
+void alloc_tree_insertp(tree* t, node* n, node* p, int dir);
+void alloc_tree_delete(tree* t, node *n);
 
-node* alloc_tree_rotate(node* p, int dir);
+node* alloc_tree_rotate(tree* t, node* p, int dir);
+void alloc_tree_update(node* n);
+void alloc_tree_update_path(node* n);
 
-#define alloc_tree_find_first_fit(size) alloc_tree_find_first_fit_r(alloc_tree.root, size)
+#define alloc_tree_find_first_fit(t, size) alloc_tree_find_first_fit_r((t)->root, size)
 node* alloc_tree_find_first_fit_r(node* n, uint64_t size);
-#define alloc_tree_find_first_fit_align(size, align) alloc_tree_find_first_fit_align_r(alloc_tree.root, size, align)
+node* alloc_tree_find_first_fit_align(tree* t, uint64_t size, uint64_t align);
 node* alloc_tree_find_first_fit_align_r(node* n, uint64_t size, uint64_t align);
-node* alloc_tree_find(void* addr);
-node* alloc_tree_find_containing(void* addr, uint64_t size);
+node* alloc_tree_find(tree* t, void* addr);
+node* alloc_tree_find_containing(tree* t, void* addr, uint64_t size);
 
-#define alloc_tree_print() alloc_tree_print_r(alloc_tree.root, 0)
+#define alloc_tree_print(t) alloc_tree_print_r((t)->root, 0)
 void alloc_tree_print_r(node* n, unsigned depth);
 
 
+/* Buddy allocator
+*  Power-of-2 sized blocks of 4 KB to 1 GB, naturally aligned, are served by a binary buddy allocator.
+*  It takes memory from the RB tree of a zone in the largest aligned blocks available, and gives all of free blocks of the zone back
+*  when the tree can't satisfy a request on it's own.
+*  Free blocks are described by per-frame arrays (order of a free block starting at the frame and links of the free list
+*  of that order), so memory of the frames themselves is never touched and doesn't have to be mapped.
+*  The arrays are taken from free memory once it's in the trees (see alloc_frame_array()), not from the heap.
+*/
+#define BUDDY_PAGE_SIZE		4096
+#define BUDDY_MAX_ORDER		18				// 1 GB blocks
+#define BUDDY_NOT_FREE		0xFF			// frame doesn't start a free block
+#define BUDDY_NIL			((uint32_t)-1)
+
+static struct {
+	uint64_t frame_cnt;
+	uint8_t* order;
+	uint32_t* next;
+	uint32_t* prev;
+	uint32_t free[ALLOC_ZONE_CNT][BUDDY_MAX_ORDER + 1];		// first frame of a free block of each order
+	uint64_t free_frames[ALLOC_ZONE_CNT];
+} buddy;
+
+#define BUDDY_FRAME(addr)		((uint64_t)(addr) / BUDDY_PAGE_SIZE)
+#define BUDDY_ADDR(frame)		((void*)((uint64_t)(frame) * BUDDY_PAGE_SIZE))
+
+static void* tree_alloc_align(int zone, uint64_t size, uint64_t align);
+static void tree_free(void* addr, uint64_t size);
+static void buddy_drain(int zone, uint64_t* flags);
+static void* alloc_align_locked(uint64_t size, uint64_t align, int zone, uint64_t* flags);
+static void free_locked(void* addr, uint64_t size, uint64_t* flags);
+
+#define FRAME_ARRAY_SIZE(size)	(((size) + (BUDDY_PAGE_SIZE - 1)) / BUDDY_PAGE_SIZE * BUDDY_PAGE_SIZE)
+
+/* Takes frames for a per-frame array from the trees, the array is reached through the physical memory window.
+*  Returns NULL if there isn't enough free memory.
+*/
+static void* alloc_frame_array(uint64_t size, uint64_t* flags)
+{
+	void* paddr = alloc_align_locked(FRAME_ARRAY_SIZE(size), BUDDY_PAGE_SIZE, ALLOC_ZONE_NORMAL, flags);
+	return paddr == (void*)-1 ? NULL : PHYS_TO_VIRT(paddr);
+}
+static void free_frame_array(void* arr, uint64_t size, uint64_t* flags)
+{
+	if(arr)
+		free_locked((void*)VIRT_TO_PHYS(arr), FRAME_ARRAY_SIZE(size), flags);
+}
+
+// Called with usable memory in the trees already, before anything is allocated through the buddy allocator
+static void buddy_init(uint64_t memory_limit, uint64_t* flags)
+{
+	uint64_t frame_cnt = BUDDY_FRAME(memory_limit);
+	if(frame_cnt > BUDDY_NIL)
+		frame_cnt = BUDDY_NIL;
+	for(int zone = 0; zone < ALLOC_ZONE_CNT; ++zone){
+		for(int i = 0; i <= BUDDY_MAX_ORDER; ++i)
+			buddy.free[zone][i] = BUDDY_NIL;
+		buddy.free_frames[zone] = 0;
+	}
+	buddy.order = alloc_frame_array(frame_cnt, flags);
+	buddy.next = alloc_frame_array(frame_cnt * sizeof(uint32_t), flags);
+	buddy.prev = alloc_frame_array(frame_cnt * sizeof(uint32_t), flags);
+	if(!buddy.order || !buddy.next || !buddy.prev){ // everything is served by the tree then
+		free_frame_array(buddy.order, frame_cnt, flags);
+		free_frame_array(buddy.next, frame_cnt * sizeof(uint32_t), flags);
+		free_frame_array(buddy.prev, frame_cnt * sizeof(uint32_t), flags);
+		return;
+	}
+	memset(buddy.order, BUDDY_NOT_FREE, frame_cnt);
+	buddy.frame_cnt = frame_cnt;
+}
+
+/* Returns order of a block satisfying the request, or -1 if it should be served by the tree. */
+static int buddy_order(uint64_t size, uint64_t align)
+{
+	if(size < BUDDY_PAGE_SIZE || size % BUDDY_PAGE_SIZE || (size & (size - 1)) || align > size)
+		return -1;
+	int order = __builtin_ctzl(size / BUDDY_PAGE_SIZE);
+	return order <= BUDDY_MAX_ORDER ? order : -1;
+}
+
+static void buddy_push(uint32_t frame, int order)
+{
+	int zone = zone_of(BUDDY_ADDR(frame));
+	buddy.order[frame] = order;
+	buddy.prev[frame] = BUDDY_NIL;
+	buddy.next[frame] = buddy.free[zone][order];
+	if(buddy.free[zone][order] != BUDDY_NIL)
+		buddy.prev[buddy.free[zone][order]] = frame;
+	buddy.free[zone][order] = frame;
+	buddy.free_frames[zone] += (uint64_t)1 << order;
+}
+static void buddy_unlink(uint32_t frame)
+{
+	int zone = zone_of(BUDDY_ADDR(frame));
+	int order = buddy.order[frame];
+	if(buddy.prev[frame] != BUDDY_NIL)
+		buddy.next[buddy.prev[frame]] = buddy.next[frame];
+	else
+		buddy.free[zone][order] = buddy.next[frame];
+	if(buddy.next[frame] != BUDDY_NIL)
+		buddy.prev[buddy.next[frame]] = buddy.prev[frame];
+	buddy.order[frame] = BUDDY_NOT_FREE;
+	buddy.free_frames[zone] -= (uint64_t)1 << order;
+}
+
+/* Returns a block (which shouldn't cross zone boundaries), merging it with free buddies.
+*  Returns 0 if the block is out of range of the buddy allocator.
+*/
+static int buddy_free(void* addr, int order)
+{
+	uint64_t frame = BUDDY_FRAME(addr);
+	if(frame + ((uint64_t)1 << order) > buddy.frame_cnt)
+		return 0;
+	int zone = zone_of(addr);
+	for(; order < BUDDY_MAX_ORDER; ++order){
+		uint64_t bud = frame ^ ((uint64_t)1 << order);
+		if(bud >= buddy.frame_cnt || buddy.order[bud] != order || zone_of(BUDDY_ADDR(bud)) != zone)
+			break;
+		buddy_unlink(bud);
+		if(bud < frame)
+			frame = bud;
+	}
+	buddy_push(frame, order);
+	return 1;
+}
+
+/* Moves the largest aligned block the tree of a zone has (of order at least min_order) to the buddy allocator.
+*  Needs 2 spare nodes. Returns 0 on success.
+*/
+static int buddy_refill(int zone, int min_order)
+{
+	for(int order = BUDDY_MAX_ORDER; order >= min_order; --order){
+		uint64_t size = (uint64_t)BUDDY_PAGE_SIZE << order;
+		void* addr = tree_alloc_align(zone, size, size);
+		if(addr == (void*)-1)
+			continue;
+		if(!buddy_free(addr, order)){
+			tree_free(addr, size);
+			continue;
+		}
+		return 0;
+	}
+	return 1;
+}
+
+/* Functions below may release alloc_spinlock to take more nodes. */
+static void* buddy_alloc(int zone, int order, uint64_t* flags)
+{
+	int i = order;
+	while(i <= BUDDY_MAX_ORDER && buddy.free[zone][i] == BUDDY_NIL)
+		++i;
+	if(i > BUDDY_MAX_ORDER){
+		if(buddy_refill(zone, order)){
+			// the block may be split between the tree and smaller free blocks
+			if(!buddy.free_frames[zone])
+				return (void*)-1;
+			buddy_drain(zone, flags);
+			if(buddy_refill(zone, order))
+				return (void*)-1;
+		}
+		for(i = order; buddy.free[zone][i] == BUDDY_NIL; ++i)
+			;
+	}
+
+	uint32_t frame = buddy.free[zone][i];
+	buddy_unlink(frame);
+	while(i > order){ // split, upper halves stay free
+		--i;
+		buddy_push(frame + ((uint32_t)1 << i), i);
+	}
+	return BUDDY_ADDR(frame);
+}
+
+/* Gives all free blocks of a zone back to it's tree. */
+static void buddy_drain(int zone, uint64_t* flags)
+{
+	for(int order = 0; order <= BUDDY_MAX_ORDER; ++order)
+		while(buddy.free[zone][order] != BUDDY_NIL){
+			if(alloc_reserve_nodes(NODE_RESERVE, flags))
+				return;
+			uint32_t frame = buddy.free[zone][order];
+			buddy_unlink(frame);
+			tree_free(BUDDY_ADDR(frame), (uint64_t)BUDDY_PAGE_SIZE << order);
+		}
+}
+
+/* Gives free blocks overlapping [addr; addr + size) back to the tree. */
+static void buddy_release(void* addr, uint64_t size, uint64_t* flags)
+{
+	uint64_t frame = BUDDY_FRAME(addr), end = BUDDY_FRAME(addr + size + BUDDY_PAGE_SIZE - 1);
+	if(end > buddy.frame_cnt)
+		end = buddy.frame_cnt;
+	while(frame < end){
+		uint64_t next = frame + 1;
+		for(int order = 0; order <= BUDDY_MAX_ORDER; ++order){
+			uint64_t start = frame & ~(((uint64_t)1 << order) - 1);
+			if(start < buddy.frame_cnt && buddy.order[start] == order){
+				if(alloc_reserve_nodes(NODE_RESERVE, flags))
+					return;
+				buddy_unlink(start);
+				tree_free(BUDDY_ADDR(start), (uint64_t)BUDDY_PAGE_SIZE << order);
+				next = start + ((uint64_t)1 << order);
+				break;
+			}
+		}
+		frame = next;
+	}
+}
+
+
+/* Per-CPU free frame lists
+*  Every CPU (identified by it's LAPIC ID) keeps a stack of free 4 KB frames, which allocator_alloc_page() and
+*  allocator_free_page() use with interrupts disabled and without taking alloc_spinlock.
+*  An empty list is refilled with FRAME_CACHE_BATCH frames, and a full one gives FRAME_CACHE_BATCH of it's oldest frames back,
+*  each with a single lock acquisition. Frames kept in the lists are counted as allocated by the rest of the allocator.
+*  Each list has a lock of it's own, which is uncontended unless another CPU gives the list's frames back.
+*/
+#define FRAME_CACHE_SIZE		64		// high watermark
+#define FRAME_CACHE_BATCH		32
+#define ALLOC_MAX_CPUS			256		// LAPIC IDs are 8-bit
+
+typedef struct {
+	spinlock lock;
+	uint64_t cnt;
+	void* frames[FRAME_CACHE_SIZE];
+} frame_cache;
+static frame_cache* frame_caches[ALLOC_MAX_CPUS];
+
+static uint32_t alloc_cpu_id()
+{
+	return apic_cpu_id();
+}
+// Returns list of the current CPU or NULL if it's not created yet (interrupts should be disabled by the caller).
+static frame_cache* frame_cache_get()
+{
+	uint32_t cpu = alloc_cpu_id();
+	return cpu < ALLOC_MAX_CPUS ? frame_caches[cpu] : NULL;
+}
+static void frame_cache_create()
+{
+	frame_cache* pc = kmalloc(sizeof(frame_cache));
+	if(!pc)
+		return;
+	spinlock_init(&pc->lock);
+	pc->cnt = 0;
+	uint64_t flags = cpu_interrupt_save();
+	uint32_t cpu = alloc_cpu_id();
+	if(cpu < ALLOC_MAX_CPUS && !frame_caches[cpu]){
+		frame_caches[cpu] = pc;
+		pc = NULL;
+	}
+	cpu_interrupt_restore(flags);
+	if(pc) // the heap has called back into the allocator and it created the list already
+		kfree(pc);
+}
+
+/* Takes up to cnt frames from the shared allocator. Returns the number of frames taken. */
+static size_t shared_alloc_frames(void** frames, size_t cnt)
+{
+	uint64_t flags = alloc_lock();
+	size_t i = 0;
+	for(; i < cnt; ++i){
+		if(alloc_reserve_nodes(NODE_RESERVE, &flags))
+			break;
+		void* frame = alloc_align_locked(BUDDY_PAGE_SIZE, BUDDY_PAGE_SIZE, ALLOC_ZONE_NORMAL, &flags);
+		if(frame == (void*)-1)
+			break;
+		frames[i] = frame;
+	}
+	alloc_unlock(flags);
+	return i;
+}
+static void shared_free_frames(void** frames, size_t cnt)
+{
+	uint64_t flags = alloc_lock();
+	for(size_t i = 0; i < cnt; ++i)
+		free_locked(frames[i], BUDDY_PAGE_SIZE, &flags);
+	alloc_unlock(flags);
+}
+
+/* Gives frames overlapping [addr; addr + size) from the lists of all CPUs back to the shared allocator.
+*  Returns the number of frames given back.
+*/
+static size_t frame_cache_release(void* addr, uint64_t size)
+{
+	size_t ret = 0;
+	for(uint32_t cpu = 0; cpu < ALLOC_MAX_CPUS; ++cpu){
+		frame_cache* pc = frame_caches[cpu];
+		if(!pc)
+			continue;
+		void* frames[FRAME_CACHE_SIZE];
+		size_t cnt = 0, kept = 0;
+		uint64_t flags = cpu_interrupt_save();
+		spinlock_lock(&pc->lock);
+		for(size_t i = 0; i < pc->cnt; ++i){
+			if(pc->frames[i] + BUDDY_PAGE_SIZE > addr && pc->frames[i] < addr + size)
+				frames[cnt++] = pc->frames[i];
+			else
+				pc->frames[kept++] = pc->frames[i];
+		}
+		pc->cnt = kept;
+		spinlock_unlock(&pc->lock);
+		cpu_interrupt_restore(flags);
+		if(cnt)
+			shared_free_frames(frames, cnt);
+		ret += cnt;
+	}
+	return ret;
+}
+
+/* Reference counts of shared frames
+*  Frames mapped by several memory handlers at once are counted, so they are freed only when the last mapping goes away.
+*  A count is the number of references besides the first one, so frames that were never shared don't need to be counted.
+*  Counts are kept for frames managed by the buddy allocator, and are protected by ref_spinlock.
+*/
+static struct {
+	uint64_t frame_cnt;
+	uint32_t* cnt;
+} frame_refs;
+static spinlock ref_spinlock;
+
+// Called with usable memory in the trees already, the array is taken the same way as the arrays of the buddy allocator
+static void frame_refs_init(uint64_t* flags)
+{
+	frame_refs.cnt = buddy.frame_cnt ? alloc_frame_array(buddy.frame_cnt * sizeof(uint32_t), flags) : NULL;
+	if(!frame_refs.cnt)
+		return;
+	memset(frame_refs.cnt, 0, buddy.frame_cnt * sizeof(uint32_t));
+	frame_refs.frame_cnt = buddy.frame_cnt;
+}
+
+int allocator_frame_ref(void* addr)
+{
+	uint64_t frame = BUDDY_FRAME(addr);
+	if(frame >= frame_refs.frame_cnt)
+		return 1;
+	uint64_t flags = cpu_interrupt_save();
+	spinlock_lock(&ref_spinlock);
+	++frame_refs.cnt[frame];
+	spinlock_unlock(&ref_spinlock);
+	cpu_interrupt_restore(flags);
+	return 0;
+}
+int allocator_frame_unref(void* addr)
+{
+	uint64_t frame = BUDDY_FRAME(addr);
+	if(frame >= frame_refs.frame_cnt)
+		return 0;
+	uint64_t flags = cpu_interrupt_save();
+	spinlock_lock(&ref_spinlock);
+	int shared = frame_refs.cnt[frame] != 0;
+	if(shared)
+		--frame_refs.cnt[frame];
+	spinlock_unlock(&ref_spinlock);
+	cpu_interrupt_restore(flags);
+	return shared;
+}
+int allocator_frame_shared(void* addr)
+{
+	uint64_t frame = BUDDY_FRAME(addr);
+	if(frame >= frame_refs.frame_cnt)
+		return 0;
+	uint64_t flags = cpu_interrupt_save();
+	spinlock_lock(&ref_spinlock);
+	int shared = frame_refs.cnt[frame] != 0;
+	spinlock_unlock(&ref_spinlock);
+	cpu_interrupt_restore(flags);
+	return shared;
+}
+
+
 // Public interface
 
+static void allocator_init_common()
+{
+	spinlock_init(&alloc_spinlock);
+	spinlock_init(&ref_spinlock);
+	node_cache = kmem_cache_create(sizeof(node), sizeof(void*), NULL);
+	for(int zone = 0; zone < ALLOC_ZONE_CNT; ++zone)
+		zone_trees[zone].root = NULL;
+}
+// Per-frame arrays are set up once free memory is in the trees
+static void allocator_init_frames(uint64_t memory_limit)
+{
+	uint64_t flags = alloc_lock();
+	buddy_init(memory_limit, &flags);
+	frame_refs_init(&flags);
+	alloc_unlock(flags);
+}
 void allocator_init(uint64_t memory_limit)
 {
-	node_mem_pool_init();
-	alloc_tree.root = alloc_node();
-	alloc_tree.root->addr = (void*)0;
-	TREE_SET_SIZE(alloc_tree.root, memory_limit);
-	alloc_tree.root->child[0] = alloc_tree.root->child[1] = alloc_tree.root->parent = NULL;
-	TREE_SET_CLR(alloc_tree.root, TREE_CLR_BLACK);
+	allocator_init_common();
+	allocator_free((void*)0, memory_limit);
+	allocator_init_frames(memory_limit);
+}
+void allocator_init_memmap(struct stivale2_mmap_entry* entries, uint64_t cnt)
+{
+	uint64_t memory_limit = 0;
+	for(uint64_t i = 0; i < cnt; ++i)
+		if(entries[i].type == STIVALE2_MMAP_USABLE && entries[i].base + entries[i].length > memory_limit)
+			memory_limit = entries[i].base + entries[i].length;
+	allocator_init_common();
+
+	uint64_t flags = alloc_lock();
+	for(uint64_t i = 0; i < cnt; ++i){
+		if(entries[i].type != STIVALE2_MMAP_USABLE)
+			continue;
+		uint64_t beg = (entries[i].base + (BUDDY_PAGE_SIZE - 1)) / BUDDY_PAGE_SIZE * BUDDY_PAGE_SIZE;
+		uint64_t end = (entries[i].base + entries[i].length) / BUDDY_PAGE_SIZE * BUDDY_PAGE_SIZE;
+		if(end > beg)
+			free_locked((void*)beg, end - beg, &flags);
+	}
+	alloc_unlock(flags);
+	allocator_init_frames(memory_limit);
 }
 
-void* allocator_alloc(uint64_t size)
+static void* tree_alloc(int zone, uint64_t size)
 {
-	node* n = alloc_tree_find_first_fit(size);
+	tree* t = &zone_trees[zone];
+	node* n = t->root ? alloc_tree_find_first_fit(t, size) : (void*)-1;
 	if(n == (void*)-1)
 		return n;
 
 	if(TREE_GET_SIZE(n) == size)
 	{ // perfect fit
 		void* ret = n->addr;
-		alloc_tree_delete(n);
+		alloc_tree_delete(t, n);
 		return ret;
 	}
 	else
@@ -102,48 +573,236 @@ void* allocator_alloc(uint64_t size)
 		void* ret = n->addr;
 		TREE_SET_SIZE(n, TREE_GET_SIZE(n) - size);
 		n->addr += size;
+		alloc_tree_update_path(n);
 		return ret;
 	}
 }
-
-void* allocator_alloc_align(uint64_t size, uint64_t align)
+void* allocator_alloc(uint64_t size)
 {
-	node* n = alloc_tree_find_first_fit_align(size, align);
-	if(n == (void*)-1)
-		return n;
+	uint64_t flags = alloc_lock();
+	void* ret = (void*)-1;
+	for(int retry = 0; retry < 2 && ret == (void*)-1; ++retry){
+		if(retry){
+			alloc_unlock(flags);
+			int released = frame_cache_release(NULL, (uint64_t)-1);
+			flags = alloc_lock();
+			if(!released)
+				break;
+		}
+		for(int zone = ALLOC_ZONE_NORMAL; zone >= ALLOC_ZONE_LOW && ret == (void*)-1; --zone){
+			if(alloc_reserve_nodes(NODE_RESERVE, &flags))
+				break;
+			ret = tree_alloc(zone, size);
+			if(ret == (void*)-1 && buddy.free_frames[zone]){
+				buddy_drain(zone, &flags);
+				ret = tree_alloc(zone, size);
+			}
+		}
+	}
+	alloc_unlock(flags);
+	return ret;
+}
 
-	uint64_t align_off = align - (uintptr_t)n->addr % align;
-	if(align_off == align)
-		align_off = 0;
+/* Marks [n->addr + align_off; n->addr + align_off + size) as occupied, the range should lie in n. */
+static void* tree_take(tree* t, node* n, uint64_t align_off, uint64_t size)
+{
 	if(TREE_GET_SIZE(n) - align_off == size)
 	{ // perfect fit
 		void* ret = n->addr + align_off;
-		alloc_tree_delete(n);
+		if(align_off > 0){ // only the unaligned part stays free
+			TREE_SET_SIZE(n, align_off);
+			alloc_tree_update_path(n);
+		}
+		else
+			alloc_tree_delete(t, n);
 		return ret;
 	}
 	else
 	{ // n->size > size, shrinking the free space and shifting addr up
-		if(align_off > 0){ // add another node, since selected address doesn't align and it splits the free space into 2 parts
-			node* _new = alloc_node();
-			_new->addr = n->addr; TREE_SET_SIZE(_new, align_off);
-			alloc_tree_insert(_new);
-		}
 		void* ret = n->addr + align_off;
 		TREE_SET_SIZE(n, TREE_GET_SIZE(n) - size - align_off);
 		n->addr += size + align_off;
+		alloc_tree_update_path(n);
+		if(align_off > 0){ // add another node, since selected address doesn't align and it splits the free space into 2 parts
+			node* _new = alloc_node();
+			_new->addr = ret - align_off; TREE_SET_SIZE(_new, align_off);
+			alloc_tree_insert(t, _new);
+		}
 		return ret;
 	}
 }
+static void* tree_alloc_align(int zone, uint64_t size, uint64_t align)
+{
+	tree* t = &zone_trees[zone];
+	node* n = t->root ? alloc_tree_find_first_fit_align(t, size, align) : (void*)-1;
+	if(n == (void*)-1)
+		return n;
+	return tree_take(t, n, (align - (uintptr_t)n->addr % align) % align, size);
+}
+// NODE_RESERVE spare nodes should be reserved by the caller
+static void* alloc_align_locked(uint64_t size, uint64_t align, int zone, uint64_t* flags)
+{
+	int order = buddy.frame_cnt ? buddy_order(size, align) : -1;
+	for(; zone >= ALLOC_ZONE_LOW; --zone){
+		if(alloc_reserve_nodes(NODE_RESERVE, flags))
+			break;
+		void* ret;
+		if(order >= 0)
+			ret = buddy_alloc(zone, order, flags);
+		else{
+			ret = tree_alloc_align(zone, size, align);
+			if(ret == (void*)-1 && buddy.free_frames[zone]){
+				buddy_drain(zone, flags);
+				ret = tree_alloc_align(zone, size, align);
+			}
+		}
+		if(ret != (void*)-1)
+			return ret;
+	}
+	return (void*)-1;
+}
+void* allocator_alloc_align(uint64_t size, uint64_t align)
+{
+	return allocator_alloc_zone(size, align, ALLOC_ZONE_NORMAL);
+}
+void* allocator_alloc_zone(uint64_t size, uint64_t align, int zone)
+{
+	if(zone == ALLOC_ZONE_NORMAL && size == BUDDY_PAGE_SIZE && align <= BUDDY_PAGE_SIZE && BUDDY_PAGE_SIZE % align == 0)
+		return allocator_alloc_page();
 
-void* allocator_alloc_addr(uint64_t size, void* addr)
+	uint64_t flags = alloc_lock();
+	void* ret = alloc_align_locked(size, align, zone, &flags);
+	alloc_unlock(flags);
+	if(ret == (void*)-1 && frame_cache_release(NULL, (uint64_t)-1)){ // frames kept in the lists may complete a block
+		flags = alloc_lock();
+		ret = alloc_align_locked(size, align, zone, &flags);
+		alloc_unlock(flags);
+	}
+	return ret;
+}
+
+void* allocator_alloc_page()
+{
+	uint64_t flags = cpu_interrupt_save();
+	frame_cache* pc = frame_cache_get();
+	if(pc){
+		spinlock_lock(&pc->lock);
+		void* frame = pc->cnt ? pc->frames[--pc->cnt] : NULL;
+		spinlock_unlock(&pc->lock);
+		if(frame){
+			cpu_interrupt_restore(flags);
+			return frame;
+		}
+	}
+	cpu_interrupt_restore(flags);
+	if(!pc)
+		frame_cache_create();
+
+	void* frames[FRAME_CACHE_BATCH];
+	size_t cnt = shared_alloc_frames(frames, FRAME_CACHE_BATCH);
+	if(!cnt)
+		return (void*)-1;
+	// the rest goes to the list of the CPU the thread is running on now
+	flags = cpu_interrupt_save();
+	pc = frame_cache_get();
+	if(pc){
+		spinlock_lock(&pc->lock);
+		while(cnt > 1 && pc->cnt < FRAME_CACHE_SIZE)
+			pc->frames[pc->cnt++] = frames[--cnt];
+		spinlock_unlock(&pc->lock);
+	}
+	cpu_interrupt_restore(flags);
+	if(cnt > 1)
+		shared_free_frames(frames + 1, cnt - 1);
+	return frames[0];
+}
+
+/* Frees [addr; addr + size) as naturally aligned blocks, the range should be aligned by BUDDY_PAGE_SIZE and lie in a single zone. */
+static void buddy_free_range(void* addr, uint64_t size)
+{
+	while(size){
+		int order = __builtin_ctzl(BUDDY_FRAME(addr) | ((uint64_t)1 << BUDDY_MAX_ORDER));
+		while(((uint64_t)BUDDY_PAGE_SIZE << order) > size)
+			--order;
+		buddy_free(addr, order);
+		addr += (uint64_t)BUDDY_PAGE_SIZE << order;
+		size -= (uint64_t)BUDDY_PAGE_SIZE << order;
+	}
+}
+size_t allocator_alloc_batch(uint64_t count, int order, int zone, allocator_run* runs, size_t max_runs)
+{
+	uint64_t block = (uint64_t)BUDDY_PAGE_SIZE << order;
+	size_t run_cnt = 0;
+	int drained = 0;
+	uint64_t flags = alloc_lock();
+	while(count && run_cnt < max_runs && zone >= ALLOC_ZONE_LOW){
+		if(alloc_reserve_nodes(NODE_RESERVE, &flags))
+			break;
+
+		// candidates are the largest range of the tree and the largest free block of the buddy allocator
+		tree* t = &zone_trees[zone];
+		node* n = t->root ? alloc_tree_find_first_fit(t, t->root->max_size) : (void*)-1;
+		uint64_t align_off = 0, tree_cnt = 0;
+		if(n != (void*)-1){
+			align_off = (block - (uintptr_t)n->addr % block) % block;
+			if(TREE_GET_SIZE(n) > align_off)
+				tree_cnt = (TREE_GET_SIZE(n) - align_off) / block;
+		}
+		int buddy_ord = BUDDY_MAX_ORDER;
+		while(buddy_ord >= order && (!buddy.frame_cnt || buddy.free[zone][buddy_ord] == BUDDY_NIL))
+			--buddy_ord;
+		uint64_t buddy_cnt = buddy_ord >= order ? (uint64_t)1 << (buddy_ord - order) : 0;
+
+		if(!tree_cnt && !buddy_cnt){
+			if(drained || !buddy.free_frames[zone]){ // the zone is exhausted
+				--zone;
+				drained = 0;
+			}
+			else{
+				buddy_drain(zone, &flags); // small free blocks may add up to ranges large enough
+				drained = 1;
+			}
+			continue;
+		}
+
+		void* addr;
+		uint64_t cnt;
+		if(tree_cnt >= buddy_cnt){
+			cnt = tree_cnt < count ? tree_cnt : count;
+			addr = tree_take(t, n, align_off, cnt * block);
+		}
+		else{
+			cnt = buddy_cnt < count ? buddy_cnt : count;
+			uint32_t frame = buddy.free[zone][buddy_ord];
+			buddy_unlink(frame);
+			addr = BUDDY_ADDR(frame);
+			buddy_free_range(addr + cnt * block, (buddy_cnt - cnt) * block); // the rest of the block stays free
+		}
+		count -= cnt;
+
+		if(run_cnt && runs[run_cnt - 1].addr + runs[run_cnt - 1].cnt * block == addr)
+			runs[run_cnt - 1].cnt += cnt;
+		else{
+			runs[run_cnt].addr = addr;
+			runs[run_cnt].cnt = cnt;
+			++run_cnt;
+		}
+	}
+	alloc_unlock(flags);
+	return run_cnt;
+}
+
+// the range should lie in a single zone
+static void* tree_alloc_addr(uint64_t size, void* addr)
 {
-	node* n = alloc_tree_find_containing(addr, size);
+	tree* t = &zone_trees[zone_of(addr)];
+	node* n = t->root ? alloc_tree_find_containing(t, addr, size) : (void*)-1;
 	if(n == (void*)-1)
 		return (void*)-1;
 
 	if(TREE_GET_SIZE(n) == size)
 	{ // perfect fit
-		alloc_tree_delete(n);
+		alloc_tree_delete(t, n);
 		return addr;
 	}
 	else
@@ -151,72 +810,200 @@ void* allocator_alloc_addr(uint64_t size, void* addr)
 		// splitting the node into 2 parts
 		void *addr1 = n->addr, *addr2 = addr + size;
 		uint64_t size1 = (uint64_t)(addr - n->addr), size2 = (uint64_t)(n->addr + TREE_GET_SIZE(n) - addr - size);
-		alloc_tree_delete(n);
+		alloc_tree_delete(t, n);
 		if(size1){
 			node* _new = alloc_node();
 			_new->addr = addr1; TREE_SET_SIZE(_new, size1);
-			alloc_tree_insert(_new);
+			alloc_tree_insert(t, _new);
 		}
 		if(size2){
 			node* _new = alloc_node();
 			_new->addr = addr2; TREE_SET_SIZE(_new, size2);
-			alloc_tree_insert(_new);
+			alloc_tree_insert(t, _new);
 		}
 		return addr;
 	}
 }
-
-node* merge_lr(node* n, void* addr)
+static void* alloc_addr_locked(uint64_t size, void* addr, uint64_t* flags)
 {
-	while(n){
-		if(n->addr + TREE_GET_SIZE(n) == addr)
-			return n;
-		int dir = addr < n->addr + TREE_GET_SIZE(n) ? TREE_DIR_LEFT : TREE_DIR_RIGHT;
-		n = n->child[dir];
+	void* ret = (void*)-1;
+	if(!alloc_reserve_nodes(NODE_RESERVE, flags))
+		ret = tree_alloc_addr(size, addr);
+	if(ret == (void*)-1){ // the range may be held by the buddy allocator or by the lists of the CPUs
+		alloc_unlock(*flags);
+		frame_cache_release(addr, size);
+		*flags = alloc_lock();
+		buddy_release(addr, size, flags);
+		if(!alloc_reserve_nodes(NODE_RESERVE, flags))
+			ret = tree_alloc_addr(size, addr);
 	}
-	return (void*)-1;
+	return ret;
 }
-node* merge_rr(node* n, void* addr, uint64_t size)
+void* allocator_alloc_addr(uint64_t size, void* addr)
 {
-	while(n){
-		if(addr + size == n->addr)
-			return n;
-		int dir = addr + size < n->addr ? TREE_DIR_LEFT : TREE_DIR_RIGHT;
-		n = n->child[dir];
+	uint64_t flags = alloc_lock();
+	uint64_t done = 0;
+	while(done < size){ // zone by zone
+		void* part = addr + done;
+		uint64_t part_size = zone_end[zone_of(part)] - (uint64_t)part;
+		if(part_size > size - done)
+			part_size = size - done;
+		if(alloc_addr_locked(part_size, part, &flags) == (void*)-1)
+			break;
+		done += part_size;
 	}
-	return (void*)-1;
+	if(done < size && done) // give back parts in other zones
+		free_locked(addr, done, &flags);
+	alloc_unlock(flags);
+	return done == size ? addr : (void*)-1;
 }
-void allocator_free(void* addr, uint64_t size)
+
+// marks [addr; addr + size) as free in the tree, merging it with adjacent free ranges
+static void tree_free_range(tree* t, void* addr, uint64_t size)
 {
+	// find free ranges right before and after the freed one
+	node *pred = NULL, *succ = NULL;
+	for(node* cur = t->root; cur; ){
+		if(cur->addr < addr){
+			pred = cur;
+			cur = cur->child[TREE_DIR_RIGHT];
+		}
+		else{
+			succ = cur;
+			cur = cur->child[TREE_DIR_LEFT];
+		}
+	}
+	int merge_l = pred && pred->addr + TREE_GET_SIZE(pred) == addr;
+	int merge_r = succ && addr + size == succ->addr;
+
+	if(merge_r){
+		if(!merge_l){ // extending the next range down keeps the tree ordered
+			succ->addr = addr;
+			TREE_SET_SIZE(succ, TREE_GET_SIZE(succ) + size);
+			alloc_tree_update_path(succ);
+			return;
+		}
+		void* pred_addr = pred->addr;
+		size += TREE_GET_SIZE(succ);
+		alloc_tree_delete(t, succ); // may move contents of other nodes, pred included
+		pred = alloc_tree_find(t, pred_addr);
+	}
+	if(merge_l){
+		TREE_SET_SIZE(pred, TREE_GET_SIZE(pred) + size);
+		alloc_tree_update_path(pred);
+		return;
+	}
+
 	node* _new = alloc_node();
 	_new->addr = addr; TREE_SET_SIZE(_new, size);
-	alloc_tree_insert(_new);
+	alloc_tree_insert(t, _new);
+}
+// the range should lie in a single zone
+static void tree_free(void* addr, uint64_t size)
+{
+	tree_free_range(&zone_trees[zone_of(addr)], addr, size);
+}
 
-	node* merge_l = _new->child[TREE_DIR_LEFT] ? merge_lr(_new->child[TREE_DIR_LEFT], addr) : NULL;
-	node* merge_r = _new->child[TREE_DIR_RIGHT] ? merge_rr(_new->child[TREE_DIR_RIGHT], addr, size) : NULL;
+static void free_locked(void* addr, uint64_t size, uint64_t* flags)
+{
+	int order = buddy.frame_cnt ? buddy_order(size, size) : -1;
+	if(order >= 0 && (uint64_t)addr % size == 0 && zone_of(addr) == zone_of(addr + size - 1) && buddy_free(addr, order))
+		return;
+	while(size){ // zone by zone
+		uint64_t part_size = zone_end[zone_of(addr)] - (uint64_t)addr;
+		if(part_size > size)
+			part_size = size;
+		if(alloc_reserve_nodes(NODE_RESERVE, flags)) // the range is lost
+			return;
+		tree_free(addr, part_size);
+		addr += part_size;
+		size -= part_size;
+	}
+}
+void allocator_free(void* addr, uint64_t size)
+{
+	if(size == BUDDY_PAGE_SIZE && (uint64_t)addr % BUDDY_PAGE_SIZE == 0){
+		allocator_free_page(addr);
+		return;
+	}
+	uint64_t flags = alloc_lock();
+	free_locked(addr, size, &flags);
+	alloc_unlock(flags);
+}
 
-	if(merge_l){
-		_new->addr = merge_l->addr;
-		TREE_SET_SIZE(_new, TREE_GET_SIZE(_new) + TREE_GET_SIZE(merge_l));
-		alloc_tree_delete(merge_l);
+void allocator_free_page(void* addr)
+{
+	uint64_t flags = cpu_interrupt_save();
+	frame_cache* pc = frame_cache_get();
+	void* frames[FRAME_CACHE_BATCH];
+	size_t cnt = 0;
+	if(pc){
+		spinlock_lock(&pc->lock);
+		if(pc->cnt == FRAME_CACHE_SIZE){ // the list is full, it's oldest frames go back
+			cnt = FRAME_CACHE_BATCH;
+			memcpy(frames, pc->frames, cnt * sizeof(void*));
+			memmove(pc->frames, pc->frames + cnt, (pc->cnt - cnt) * sizeof(void*));
+			pc->cnt -= cnt;
+		}
+		pc->frames[pc->cnt++] = addr;
+		spinlock_unlock(&pc->lock);
+		cpu_interrupt_restore(flags);
+		if(cnt)
+			shared_free_frames(frames, cnt);
+		return;
 	}
-	if(merge_r){
-		TREE_SET_SIZE(_new, TREE_GET_SIZE(_new) + TREE_GET_SIZE(merge_r));
-		alloc_tree_delete(merge_r);
+	cpu_interrupt_restore(flags);
+	frame_cache_create();
+	shared_free_frames(&addr, 1);
+}
+
+
+/* Kernel address space
+*  Free ranges of the kernel virtual address window are kept in a tree of their own, the same way as free physical memory.
+*  It's protected by alloc_spinlock and takes spare nodes along with zone trees.
+*/
+static tree vspace_tree;
+
+void allocator_vspace_init(void* base, uint64_t size)
+{
+	uint64_t flags = alloc_lock();
+	vspace_tree.root = NULL;
+	if(!alloc_reserve_nodes(NODE_RESERVE, &flags))
+		tree_free_range(&vspace_tree, base, size);
+	alloc_unlock(flags);
+}
+void* allocator_vspace_alloc(uint64_t size, uint64_t align)
+{
+	uint64_t flags = alloc_lock();
+	void* ret = (void*)-1;
+	if(!alloc_reserve_nodes(NODE_RESERVE, &flags) && vspace_tree.root){
+		node* n = alloc_tree_find_first_fit_align(&vspace_tree, size, align);
+		if(n != (void*)-1)
+			ret = tree_take(&vspace_tree, n, (align - (uintptr_t)n->addr % align) % align, size);
 	}
+	alloc_unlock(flags);
+	return ret;
+}
+void allocator_vspace_free(void* addr, uint64_t size)
+{
+	uint64_t flags = alloc_lock();
+	if(!alloc_reserve_nodes(NODE_RESERVE, &flags)) // the range is lost otherwise
+		tree_free_range(&vspace_tree, addr, size);
+	alloc_unlock(flags);
 }
 
 
 /* RB tree functions */
 
-void alloc_tree_insert(node* n)
+void alloc_tree_insert(tree* t, node* n)
 {
-	node* root = alloc_tree.root;
+	node* root = t->root;
 	if(!root){
 		TREE_SET_CLR(n, TREE_CLR_BLACK);
 		n->child[TREE_DIR_LEFT] = n->child[TREE_DIR_RIGHT] = NULL;
 		n->parent = NULL;
-		alloc_tree.root = n;
+		n->max_size = TREE_GET_SIZE(n);
+		t->root = n;
 		return;
 	}
 
@@ -226,13 +1013,13 @@ void alloc_tree_insert(node* n)
 		if(!root->child[dir]){
 			root->child[dir] = n;
 			n->child[0] = n->child[1] = NULL;
-			alloc_tree_insertp(n, root, dir);
+			alloc_tree_insertp(t, n, root, dir);
 			return;
 		}
 		root = root->child[dir];
 	}
 }
-void alloc_tree_insertp(node* n, node* p, int dir)
+void alloc_tree_insertp(tree* t, node* n, node* p, int dir)
 {
 	node	*g,		// grandparent
 			*u;		// uncle
@@ -240,10 +1027,12 @@ void alloc_tree_insertp(node* n, node* p, int dir)
 	TREE_SET_CLR(n, TREE_CLR_RED)
 	n->child[TREE_DIR_LEFT] = n->child[TREE_DIR_RIGHT] = NULL;
 	n->parent = p;
+	n->max_size = TREE_GET_SIZE(n);
 	if(!p) // inserting at root
-	{ TREE_SET_CLR(n, TREE_CLR_BLACK); alloc_tree.root = n; return; }
+	{ TREE_SET_CLR(n, TREE_CLR_BLACK); t->root = n; return; }
 
 	p->child[dir] = n;
+	alloc_tree_update_path(p); // rotations below keep max sizes correct
 
 	do{
 		// case 1: parent is black, nothing to be done
@@ -253,7 +1042,7 @@ void alloc_tree_insertp(node* n, node* p, int dir)
 
 		if(!(g = p->parent))
 		{ // case 4: parent is red and root
-			TREE_SET_CLR(p, TREE_CLR_RED);
+			TREE_SET_CLR(p, TREE_CLR_BLACK);
 			return;
 		}
 
@@ -263,12 +1052,12 @@ void alloc_tree_insertp(node* n, node* p, int dir)
 		{ // case 5-6: parent is red and uncle is black
 			if(n == p->child[1 - dir])
 			{ // case 5: parent is red, uncle is black, n is inner grandchild
-				alloc_tree_rotate(p, dir);
+				alloc_tree_rotate(t, p, dir);
 				n = p;
 				p = g->child[dir];
 			} // case 5 --> case 6
 			// case 6: parent is red, uncle is black, n is outer grandchild
-			alloc_tree_rotate(g, 1 - dir);
+			alloc_tree_rotate(t, g, 1 - dir);
 			TREE_SET_CLR(p, TREE_CLR_BLACK);
 			TREE_SET_CLR(g, TREE_CLR_RED);
 			return;
@@ -284,7 +1073,8 @@ void alloc_tree_insertp(node* n, node* p, int dir)
 
 node* alloc_tree_delete_replacement(node* n)
 {
-	if(n->child[TREE_DIR_LEFT] && n->child[TREE_DIR_RIGHT]){
+	if(n->child[TREE_DIR_LEFT] && n->child[TREE_DIR_RIGHT]){ // in-order successor
+		n = n->child[TREE_DIR_RIGHT];
 		while(n->child[TREE_DIR_LEFT])
 			n = n->child[TREE_DIR_LEFT];
 		return n;
@@ -294,22 +1084,22 @@ node* alloc_tree_delete_replacement(node* n)
 	else
 		return n->child[TREE_DIR_LEFT] ? n->child[TREE_DIR_LEFT] : n->child[TREE_DIR_RIGHT];
 }
-void alloc_tree_delete_fixbb(node* n) // fix 2 black nodes in a row
+void alloc_tree_delete_fixbb(tree* t, node* n) // fix 2 black nodes in a row
 {
-	if(n == alloc_tree.root)
+	if(n == t->root)
 		return;
 
 	node *s = TREE_GET_SIBLING(n), *p = n->parent;
 	if(!s){
 		// no sibling - proceed up the tree
-		alloc_tree_delete_fixbb(p);
+		alloc_tree_delete_fixbb(t, p);
 	}
 	else{
 		if(TREE_GET_CLR(s) == TREE_CLR_RED){
 			TREE_SET_CLR(p, TREE_CLR_RED);
 			TREE_SET_CLR(s, TREE_CLR_BLACK);
-			alloc_tree_rotate(p, TREE_DIR_CHILD(s));
-			alloc_tree_delete_fixbb(n);
+			alloc_tree_rotate(t, p, 1 - TREE_DIR_CHILD(s));
+			alloc_tree_delete_fixbb(t, n);
 		}
 		else{
 			if((s->child[TREE_DIR_LEFT] && TREE_GET_CLR(s->child[TREE_DIR_LEFT]) == TREE_CLR_RED)
@@ -321,13 +1111,13 @@ void alloc_tree_delete_fixbb(node* n) // fix 2 black nodes in a row
 					{ // left left
 						TREE_SET_CLR(s->child[TREE_DIR_LEFT], TREE_GET_CLR(s));
 						TREE_SET_CLR(s, TREE_GET_CLR(p));
-						alloc_tree_rotate(p, TREE_DIR_RIGHT);
+						alloc_tree_rotate(t, p, TREE_DIR_RIGHT);
 					}
 					else
 					{ // right left
 						TREE_SET_CLR(s->child[TREE_DIR_LEFT], TREE_GET_CLR(p));
-						alloc_tree_rotate(s, TREE_DIR_RIGHT);
-						alloc_tree_rotate(p, TREE_DIR_LEFT);
+						alloc_tree_rotate(t, s, TREE_DIR_RIGHT);
+						alloc_tree_rotate(t, p, TREE_DIR_LEFT);
 					}
 				}
 				else
@@ -335,14 +1125,14 @@ void alloc_tree_delete_fixbb(node* n) // fix 2 black nodes in a row
 					if(TREE_DIR_CHILD(s) == TREE_DIR_LEFT)
 					{ // left right
 						TREE_SET_CLR(s->child[TREE_DIR_RIGHT], TREE_GET_CLR(p));
-						alloc_tree_rotate(s, TREE_DIR_LEFT);
-						alloc_tree_rotate(p, TREE_DIR_RIGHT);
+						alloc_tree_rotate(t, s, TREE_DIR_LEFT);
+						alloc_tree_rotate(t, p, TREE_DIR_RIGHT);
 					}
 					else
 					{ // right right
 						TREE_SET_CLR(s->child[TREE_DIR_RIGHT], TREE_GET_CLR(s));
 						TREE_SET_CLR(s, TREE_GET_CLR(p));
-						alloc_tree_rotate(p, TREE_DIR_LEFT);
+						alloc_tree_rotate(t, p, TREE_DIR_LEFT);
 					}
 				}
 				TREE_SET_CLR(p, TREE_CLR_BLACK);
@@ -351,14 +1141,14 @@ void alloc_tree_delete_fixbb(node* n) // fix 2 black nodes in a row
 			{ // 2 black children
 				TREE_SET_CLR(s, TREE_CLR_RED);
 				if(TREE_GET_CLR(p) == TREE_CLR_BLACK)
-					alloc_tree_delete_fixbb(n);
+					alloc_tree_delete_fixbb(t, p);
 				else
 					TREE_SET_CLR(p, TREE_CLR_BLACK);
 			}
 		}
 	}
 }
-void alloc_tree_delete(node *n)
+void alloc_tree_delete(tree* t, node *n)
 {
 	while(n)
 	{
@@ -368,81 +1158,97 @@ void alloc_tree_delete(node *n)
 		node* p = n->parent;
 
 		if(!u){
-			if(n == alloc_tree.root)
-				alloc_tree.root = NULL;
+			if(n == t->root)
+				t->root = NULL;
 			else{
 				if(un_is_black)
-					alloc_tree_delete_fixbb(n);
+					alloc_tree_delete_fixbb(t, n);
 				else
 					if(TREE_GET_SIBLING(n))
 						TREE_SET_CLR(TREE_GET_SIBLING(n), TREE_CLR_RED);
 
 				// delete n
 				p->child[TREE_DIR_CHILD(n)] = NULL;
+				alloc_tree_update_path(p);
 			}
-			kfree(n);
+			free_node(n);
 			return;
 		}
 		if(!n->child[TREE_DIR_LEFT] || !n->child[TREE_DIR_RIGHT]){
 			// n has only 1 child
-			if(n == alloc_tree.root)
+			if(n == t->root)
 			{ // replace n with it's child if n == root
 				n->addr = u->addr; TREE_SET_SIZE(n, TREE_GET_SIZE(u));
 				n->child[TREE_DIR_LEFT] = n->child[TREE_DIR_RIGHT] = NULL;
-				kfree(u);
+				alloc_tree_update(n);
+				free_node(u);
 			}
 			else
 			{ // delete n from the tree and move u up
 				p->child[TREE_DIR_CHILD(n)] = u;
 				u->parent = p;
 				if(un_is_black)
-					alloc_tree_delete_fixbb(n);
+					alloc_tree_delete_fixbb(t, n);
 				else
 					TREE_SET_CLR(u, TREE_CLR_BLACK);
-				kfree(n);
+				alloc_tree_update_path(p);
+				free_node(n);
 			}
 			return;
 		}
-		// swap u and n
-		node tmp;
-		tmp.size = TREE_GET_SIZE(n); tmp.addr = n->addr;
-		n->size = TREE_GET_SIZE(u); n->addr = u->addr;
-		u->size = tmp.size; u->addr = tmp.addr;
+		// swap contents of u and n, colors stay with the positions
+		// (max sizes are fixed up when u is unlinked, since n is it's ancestor)
+		void* tmp_addr = n->addr; uint64_t tmp_size = TREE_GET_SIZE(n);
+		n->addr = u->addr; TREE_SET_SIZE(n, TREE_GET_SIZE(u));
+		u->addr = tmp_addr; TREE_SET_SIZE(u, tmp_size);
 		n = u;
 	}
 }
 
-/* DFS by size */
+/* Lowest addressed node of size or more, O(log n) */
 node* alloc_tree_find_first_fit_r(node* n, uint64_t size)
 {
-	if(TREE_GET_SIZE(n) >= size)
-		return n;
-
-	if(n->child[TREE_DIR_LEFT])
-	{ node* nn = alloc_tree_find_first_fit_r(n->child[TREE_DIR_LEFT], size); if(nn != (void*)-1) return nn; }
-	if(n->child[TREE_DIR_RIGHT])
-	{ node* nn = alloc_tree_find_first_fit_r(n->child[TREE_DIR_RIGHT], size); if(nn != (void*)-1) return nn; }
-
+	while(n){
+		if(n->child[TREE_DIR_LEFT] && n->child[TREE_DIR_LEFT]->max_size >= size)
+			n = n->child[TREE_DIR_LEFT];
+		else if(TREE_GET_SIZE(n) >= size)
+			return n;
+		else if(n->child[TREE_DIR_RIGHT] && n->child[TREE_DIR_RIGHT]->max_size >= size)
+			n = n->child[TREE_DIR_RIGHT];
+		else
+			break;
+	}
 	return (void*)-1;
 }
-int stack_depth = 0;
-node* alloc_tree_find_first_fit_align_r(node* n, uint64_t size, uint64_t align)
+/* Any range of size + align - 1 bytes or more has an aligned part of size bytes, so such ranges are found in O(log n).
+*  Smaller ranges only fit if they happen to be aligned well enough, those are looked for only if there are no large ranges.
+*/
+node* alloc_tree_find_first_fit_align(tree* t, uint64_t size, uint64_t align)
 {
-	if(TREE_GET_SIZE(n) - (align - (uintptr_t)n->addr % align) >= size)
+	node* n = alloc_tree_find_first_fit_r(t->root, size + align - 1);
+	if(n != (void*)-1)
 		return n;
+	return alloc_tree_find_first_fit_align_r(t->root, size, align);
+}
+/* DFS by size and alignment, skipping subtrees without ranges of size or more */
+node* alloc_tree_find_first_fit_align_r(node* n, uint64_t size, uint64_t align)
+{
+	if(!n || n->max_size < size)
+		return (void*)-1;
 
-	if(n->child[TREE_DIR_LEFT])
-	{ node* nn = alloc_tree_find_first_fit_align_r(n->child[TREE_DIR_LEFT], size, align); if(nn != (void*)-1) return nn; }
-	if(n->child[TREE_DIR_RIGHT])
-	{ node* nn = alloc_tree_find_first_fit_align_r(n->child[TREE_DIR_RIGHT], size, align); if(nn != (void*)-1) return nn; }
-
-	return (void*)-1;
+	node* nn = alloc_tree_find_first_fit_align_r(n->child[TREE_DIR_LEFT], size, align);
+	if(nn != (void*)-1)
+		return nn;
+	uint64_t align_off = (align - (uintptr_t)n->addr % align) % align;
+	if(TREE_GET_SIZE(n) >= size + align_off)
+		return n;
+	return alloc_tree_find_first_fit_align_r(n->child[TREE_DIR_RIGHT], size, align);
 }
 
 /* BT traversal by addr */
-node* alloc_tree_find(void* addr)
+node* alloc_tree_find(tree* t, void* addr)
 {
-	node* cur = alloc_tree.root;
+	node* cur = t->root;
 	while(cur){
 		if(cur->addr == addr)
 			return cur;
@@ -451,9 +1257,9 @@ node* alloc_tree_find(void* addr)
 	return (void*)-1;
 }
 /* BT traversal by addr, but the criteria is addr + size interval lying in free space */
-node* alloc_tree_find_containing(void* addr, uint64_t size)
+node* alloc_tree_find_containing(tree* t, void* addr, uint64_t size)
 {
-	node* cur = alloc_tree.root;
+	node* cur = t->root;
 	while(cur){
 		if(addr >= cur->addr && addr + size <= cur->addr + TREE_GET_SIZE(cur))
 			return cur;
@@ -464,7 +1270,7 @@ node* alloc_tree_find_containing(void* addr, uint64_t size)
 
 /* RB tree helper functions */
 
-node* alloc_tree_rotate(node* p, int dir)
+node* alloc_tree_rotate(tree* t, node* p, int dir)
 {
 	node* g = p->parent;
 	node* s = p->child[1 - dir];
@@ -479,10 +1285,27 @@ node* alloc_tree_rotate(node* p, int dir)
 	if(g)
 		g->child[p == g->child[TREE_DIR_RIGHT] ? TREE_DIR_RIGHT : TREE_DIR_LEFT] = s;
 	else
-		alloc_tree.root = s;
+		t->root = s;
+
+	// the rotated subtree holds the same nodes, so only p and s change their max sizes
+	alloc_tree_update(p);
+	alloc_tree_update(s);
 	return s;
 }
 
+void alloc_tree_update(node* n)
+{
+	n->max_size = TREE_GET_SIZE(n);
+	for(int dir = TREE_DIR_LEFT; dir <= TREE_DIR_RIGHT; ++dir)
+		if(n->child[dir] && n->child[dir]->max_size > n->max_size)
+			n->max_size = n->child[dir]->max_size;
+}
+void alloc_tree_update_path(node* n)
+{
+	for(; n; n = n->parent)
+		alloc_tree_update(n);
+}
+
 void alloc_tree_print_r(node* n, unsigned depth)
 {
 	for(unsigned i = 0; i < depth; ++i) uart_putchar('\t');
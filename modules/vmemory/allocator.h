@@ -1,13 +1,39 @@
 #ifndef ALLOCATOR_H
 #define ALLOCATOR_H
 
+#include <stddef.h>
 #include <stdint.h>
 
+/* All functions can be called from any CPU at the same time, except allocator_init() and allocator_init_memmap(). */
+
+/* Physical memory zones. Allocations are served from the requested zone or lower ones,
+*  so callers limited in which addresses they can use (like 32-bit DMA) should ask for a lower zone.
+*/
+#define ALLOC_ZONE_LOW		0		// below 1 MB
+#define ALLOC_ZONE_DMA32	1		// below 4 GB
+#define ALLOC_ZONE_NORMAL	2		// the rest
+#define ALLOC_ZONE_CNT		3
+
+/* Usable physical memory is mapped at PHYSMAP_BASE + physical address by the bootloader, and later by the virtual memory module,
+*  so frames taken from the allocator can be accessed without mapping them anywhere else.
+*/
+#define PHYSMAP_BASE				0xFFFF800000000000
+#define PHYS_TO_VIRT(paddr)			((void*)(PHYSMAP_BASE | (uint64_t)(paddr)))
+#define VIRT_TO_PHYS(vaddr)			((uint64_t)(vaddr) & ~PHYSMAP_BASE)
+
+struct stivale2_mmap_entry;
+
 /* Initializes data structures needed for managing allocation.
 *  Arguments:
 *  	mem_limit - maximum amount of physical memory from init() function.
 */
 void allocator_init(uint64_t mem_limit);
+/* Same as allocator_init(), but marks only usable memory from a memory map as free.
+*  Arguments:
+*	entries - memory map entries passed by the bootloader.
+*	cnt - number of entries.
+*/
+void allocator_init_memmap(struct stivale2_mmap_entry* entries, uint64_t cnt);
 
 /* Looks for free space size bytes long or more, then marks it as occupied and returns an address.
 *  Arguments:
@@ -25,6 +51,41 @@ void* allocator_alloc(uint64_t size);
 *	a valid pointer or (void*)-1 if there wasn't any free space of such size.
 */
 void* allocator_alloc_align(uint64_t size, uint64_t align);
+/* Same as allocator_alloc_align, but only uses the given zone or lower ones.
+*  Arguments:
+*  	size - size of requested continous space.
+*  	align - requested alingment.
+*	zone - highest zone to allocate from (ALLOC_ZONE_*).
+*  Return value:
+*	a valid pointer or (void*)-1 if there wasn't any free space of such size.
+*/
+void* allocator_alloc_zone(uint64_t size, uint64_t align, int zone);
+
+/* Allocates a single 4 KB frame, usually from a list kept by the current CPU, without taking any locks.
+*  allocator_alloc_align() calls it for such requests as well.
+*  Return value:
+*	a valid pointer or (void*)-1 if there wasn't any free space.
+*/
+void* allocator_alloc_page();
+
+/* A range of blocks returned by allocator_alloc_batch(). */
+typedef struct {
+	void* addr;
+	uint64_t cnt;		// number of blocks in the range
+} allocator_run;
+
+/* Allocates count blocks of (4 KB << order) bytes, each aligned by it's size, which don't have to be continous.
+*  Blocks are taken from the largest free ranges first, each range with a single operation, and are returned as a list of runs.
+*  Arguments:
+*	count - number of blocks requested.
+*	order - log2 of block size in 4 KB frames.
+*	zone - highest zone to allocate from (ALLOC_ZONE_*).
+*	runs - array to store runs in.
+*	max_runs - size of runs array.
+*  Return value:
+*	number of runs stored. They hold less than count blocks if runs array was filled up or there wasn't enough free space.
+*/
+size_t allocator_alloc_batch(uint64_t count, int order, int zone, allocator_run* runs, size_t max_runs);
 
 /* Simlar to allocate(), but tries to mark a certain address as occupied.
 *  Arguments:
@@ -41,5 +102,30 @@ void* allocator_alloc_addr(uint64_t size, void* addr);
 *	size - size of memory region to be marked as free.
 */
 void allocator_free(void* addr, uint64_t size);
+/* Frees a single 4 KB frame, keeping it in a list of the current CPU. allocator_free() calls it for such frames as well. */
+void allocator_free_page(void* addr);
+
+/* Kernel virtual address space: free ranges of a window reserved for kernel buffers, managed like free physical memory.
+*  allocator_vspace_init() marks [base; base + size) as free, it should be called once before other functions.
+*  allocator_vspace_alloc() returns (void*)-1 if there isn't a free range of such size and alignment.
+*/
+void allocator_vspace_init(void* base, uint64_t size);
+void* allocator_vspace_alloc(uint64_t size, uint64_t align);
+void allocator_vspace_free(void* addr, uint64_t size);
+
+/* Adds a reference to a frame (or a block starting with it) that is mapped more than once.
+*  Return value:
+*	0			OK
+*	non-zero	references to this frame can't be counted, so it shouldn't be shared
+*/
+int allocator_frame_ref(void* addr);
+/* Drops a reference to a frame added by allocator_frame_ref().
+*  Return value:
+*	0			it was the last reference, the frame should be freed by the caller
+*	non-zero	the frame is still referenced by someone else
+*/
+int allocator_frame_unref(void* addr);
+/* Returns non-zero if a frame has references besides the caller's one. */
+int allocator_frame_shared(void* addr);
 
 #endif
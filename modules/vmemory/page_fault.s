@@ -0,0 +1,37 @@
+global _vmem_page_fault_handler
+_vmem_page_fault_handler:
+	dq 0x0
+
+; #PF entry: CPU pushes an error code, faulting address is in CR2
+global page_fault_isr
+page_fault_isr:
+	; registers below are caller-saved by C calling convention
+	push rax
+	push rcx
+	push rdx
+	push rsi
+	push rdi
+	push r8
+	push r9
+	push r10
+	push r11
+	sub rsp, 8			; align stack by 16 bytes for the call (9 registers + error code are on the stack)
+
+	mov rdi, [rsp+80]	; error code
+	mov rsi, cr2
+	mov rax, _vmem_page_fault_handler
+	mov rax, [rax]		; get function pointer
+	call rax
+
+	add rsp, 8
+	pop r11
+	pop r10
+	pop r9
+	pop r8
+	pop rdi
+	pop rsi
+	pop rdx
+	pop rcx
+	pop rax
+	add rsp, 8			; pop error code
+	iretq
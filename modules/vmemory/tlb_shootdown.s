@@ -0,0 +1,33 @@
+global _vmem_tlb_shootdown_handler
+_vmem_tlb_shootdown_handler:
+	dq 0x0
+
+; IPI sent by another CPU that has invalidated translations
+global tlb_shootdown_isr
+tlb_shootdown_isr:
+	; registers below are caller-saved by C calling convention
+	push rax
+	push rcx
+	push rdx
+	push rsi
+	push rdi
+	push r8
+	push r9
+	push r10
+	push r11
+	; stack is aligned by 16 bytes for the call (9 registers + 5 values pushed by CPU)
+
+	mov rax, _vmem_tlb_shootdown_handler
+	mov rax, [rax]		; get function pointer
+	call rax
+
+	pop r11
+	pop r10
+	pop r9
+	pop r8
+	pop rdi
+	pop rsi
+	pop rdx
+	pop rcx
+	pop rax
+	iretq
@@ -5,6 +5,16 @@
 
 #include "allocator.h"
 
+#include "string.h"
+
+#include "cpu/cpu_int.h"
+#include "cpu/cpu_io.h"
+#include "cpu/spinlock.h"
+#include "cpu/x86/apic.h"
+#include "cpu/x86/cpuid.h"
+
+#include "stivale2.h"
+
 #include "bits.h"
 
 /* IA-32e paging */
@@ -21,26 +31,36 @@
 											// Page Directory Entry (PDE): maps a 2 MB page
 											// if 0, pages have size of 4 KB
 #define PFLAG_GLOBAL			(1 << 8)	// if 1, translation is global (not invalidated in TLB)
-#define PFLAG_PAT				(1 << 12)
-#define PFLAG_XD				(1 << 63)	// if 1, does not allow instruction fetches from this page (if CPU supports it)
+#define PFLAG_SHARED			(1 << 9)	// ignored by the CPU: the frame is mapped by several handles and it's references are counted
+#define PFLAG_COW				(1 << 10)	// ignored by the CPU: the page is writable, but writes fault until it's copied
+#define PFLAG_DEVICE			(1 << 11)	// ignored by the CPU: the frame wasn't taken from the allocator (memory-mapped I/O), it isn't freed on unmap
+#define PFLAG_PAT				(1 << 12)	// PAT bit of 2 MB and 1 GB page entries
+#define PFLAG_PTE_PAT			(1 << 7)	// PAT bit of 4 KB page entries, the same bit as PFLAG_PSIZE
+#define PFLAG_XD				((uint64_t)1 << 63)	// if 1, does not allow instruction fetches from this page (if CPU supports it)
+
+// Paging structures are accessed through a window of the kernel half that maps physical memory (PHYSMAP_BASE),
+// see "Physical memory window" below
 
 // PML4:
 uint64_t* pml4;
 #define PML4_ENTRIES				512
 #define PML4_ALIGN					4096
-#define GET_PML4E(addr)				((uint64_t*)((uint64_t)cur_hndl->pml4 | (GET_BITS(addr, 39, 48) << 3)))
+#define GET_PML4E(hndl, addr)		((uint64_t*)((uint64_t)(hndl)->pml4 | (GET_BITS(addr, 39, 48) << 3)))
 #define SET_PDPT(pml4e, paddr)		SET_BITS(pml4e, paddr, 0) // 51:12
 
 // PDPT:
 #define PDPT_ENTRIES				512
 #define PDPT_ALIGN					4096
-#define GET_PDPTE(addr, pml4e)		((uint64_t*)( ((pml4e) & 0xFFFFFFFFFF000) | (GET_BITS(addr, 30, 39) << 3)))
+#define GET_PDPTE(addr, pml4e)		((uint64_t*)( PHYSMAP_BASE | ((pml4e) & 0xFFFFFFFFFF000) | (GET_BITS(addr, 30, 39) << 3)))
 #define SET_PD(pdpte, paddr)		SET_BITS(pdpte, paddr, 0) // 51:12
 
+#define SET_PDPTE_PHYSADDR(pdpte, paddr)	SET_BITS(pdpte, paddr, 0) // 51:30
+#define GET_PDPTE_PHYSADDR(addr, pdpte)		(void*)( ((pdpte) & 0xFFFFFC0000000) | GET_BITS(addr, 0, 30))
+
 // PDE:
 #define PD_ENTRIES					512
 #define PD_ALIGN					4096
-#define GET_PDE(addr, pdpte)		((uint64_t*)( ((pdpte) & 0xFFFFFFFFFF000) | (GET_BITS(addr, 21, 30) << 3)))
+#define GET_PDE(addr, pdpte)		((uint64_t*)( PHYSMAP_BASE | ((pdpte) & 0xFFFFFFFFFF000) | (GET_BITS(addr, 21, 30) << 3)))
 #define SET_PT(pde, paddr)			SET_BITS(pde, paddr, 0) // 51:12
 
 #define SET_PDE_PHYSADDR(pde, paddr)		SET_BITS(pde, paddr, 0) // 51:21
@@ -49,229 +69,1708 @@ uint64_t* pml4;
 // PTE:
 #define PT_ENTRIES					512
 #define PT_ALIGN					4096
-#define GET_PTE(addr, pde)			((uint64_t*)( ((pde) & 0xFFFFFFFFFF000) | (GET_BITS(addr, 12, 21) << 3)))
+#define GET_PTE(addr, pde)			((uint64_t*)( PHYSMAP_BASE | ((pde) & 0xFFFFFFFFFF000) | (GET_BITS(addr, 12, 21) << 3)))
 
 #define SET_PTE_PHYSADDR(pte, paddr)		SET_BITS(pte, paddr, 0) // 51:12
 #define GET_PTE_PHYSADDR(addr, pte)			(void*)( ((pte) & 0xFFFFFFFFFF000) | GET_BITS(addr, 0, 12)) 
 
 #define PAGE_SIZE 4096
 #define PAGE_SIZE2 (2 * 1024 * 1024)
+#define PAGE_SIZE3 (1024 * 1024 * 1024)
 uint64_t get_mem_unit_size() { return PAGE_SIZE; }
 
+#define CPUID_EXT_FEAT_EDX_PAGE1GB		(1 << 26)
+#define CPUID_FEAT_ECX_PCID				(1 << 17)
+#define CPUID_FEAT_EDX_PAT				(1 << 16)
+#define CPUID_EXT7_EBX_INVPCID			(1 << 10)
+static int page3_supported = 0;		// 1 GB pages are used only if the CPU advertises them
+static int pcid_supported = 0;
+static int invpcid_supported = 0;
+static int pat_supported = 0;
+
+#define INVLPG(vaddr)		{ asm volatile("invlpg (%0)" :: "r" (vaddr) : "memory"); }
+
+#define CR4_PGE				(1 << 7)
+#define CR4_PCIDE			(1 << 17)
+
 
 /* Helper functions for managing context and memory unit size: */
 
-typedef struct {
+#define PCID_MAX_CPUS		256		// LAPIC IDs are 8-bit
+
+// A range of virtual memory mapped on demand
+typedef struct vmem_region vmem_region;
+struct vmem_region {
+	void* vaddr;
+	uint64_t usize;			// in pages
+	int flags;
+	vmem_region* next;
+};
+
+typedef struct mem_hndl {
 	uint64_t* pml4;
+	uint16_t pcid;
+	uint64_t pcid_gen;			// generation the PCID belongs to, 0 if the handle didn't get one yet
+	uint64_t pcid_stale[PCID_MAX_CPUS / 64];	// CPUs that may cache outdated translations tagged with the PCID
+	vmem_region* regions;		// ranges mapped on demand, see below
+	struct mem_hndl* next;		// list of all handles
 } mem_hndl;
 static mem_hndl* cur_hndl = NULL;
 
 uint64_t get_mem_hndl_size() { return sizeof(mem_hndl); }
 
-static uint64_t* get_entry(void* vaddr);
+
+/* Kernel half
+*  PML4 entries covering kernel memory (the higher half and identity mapped physical memory) are shared by all handles:
+*  they point to the same page directory pointer tables, so a new handle only copies these entries, and kernel mappings
+*  made in any handle are seen in all of them. A PML4 entry added to the kernel half is copied into every handle.
+*  Kernel pages are global, so their TLB entries survive CR3 switches.
+*/
+
+#define PML4_KERNEL_FIRST		256		// first entry of the higher half
+#define VSPACE_BASE				((void*)0xFFFFC00000000000)		// window for vmalloc() and vmap_phys(), PML4 entries 384-447
+#define VSPACE_SIZE				((uint64_t)1 << 45)
+
+static mem_hndl* hndl_list = NULL;
+static uint64_t pml4_ident_cnt = 1;		// number of entries covering identity mapped physical memory
+
+// Usable physical memory, it's mapped in the physical memory window
+typedef struct phys_range {
+	uint64_t beg, end;
+} phys_range;
+static phys_range* phys_ranges = NULL;
+static size_t phys_range_cnt = 0;
+
+static int pml4_is_kernel(uint64_t idx)
+{
+	return idx >= PML4_KERNEL_FIRST || idx < pml4_ident_cnt;
+}
+#define PML4_IDX(vaddr)			GET_BITS(vaddr, 39, 48)
+#define KERNEL_PAGE_FLAGS(vaddr)	(pml4_is_kernel(PML4_IDX(vaddr)) ? PFLAG_GLOBAL : 0)
+
+static void set_ident_limit(uint64_t limit)
+{
+	pml4_ident_cnt = (limit + ((uint64_t)1 << 39) - 1) >> 39;
+	if(!pml4_ident_cnt)
+		pml4_ident_cnt = 1;
+}
+
+static void enable_global_pages()
+{
+	uint64_t cr4;
+	asm volatile("mov %%cr4, %0" : "=r" (cr4));
+	if(!(cr4 & CR4_PGE))
+		asm volatile("mov %0, %%cr4" :: "r" (cr4 | CR4_PGE) : "memory");
+}
+
+
+/* Page attribute table
+*  Memory type of a page is picked from the IA32_PAT MSR by PAT, PCD and PWT bits of it's entry (PAT is the highest bit of the index).
+*  Entries 0-3 keep their power-on values, so PCD and PWT alone select the same types as before, and entry 4
+*  is changed to write-combining. No page had the PAT bit set before, so nothing has to be flushed.
+*  The MSR has to be the same on all CPUs.
+*/
+
+#define MSR_IA32_PAT			0x277
+
+#define PAT_UC					0x00
+#define PAT_WC					0x01
+#define PAT_WT					0x04
+#define PAT_WB					0x06
+#define PAT_UC_MINUS			0x07
+#define PAT_ENTRY(idx, type)	((uint64_t)(type) << ((idx) * 8))
+#define PAT_VALUE				(PAT_ENTRY(0, PAT_WB) | PAT_ENTRY(1, PAT_WT) | PAT_ENTRY(2, PAT_UC_MINUS) | PAT_ENTRY(3, PAT_UC)\
+								| PAT_ENTRY(4, PAT_WC) | PAT_ENTRY(5, PAT_WT) | PAT_ENTRY(6, PAT_UC_MINUS) | PAT_ENTRY(7, PAT_UC))
+
+static void init_pat()
+{
+	if(pat_supported)
+		cpu_out_msr(MSR_IA32_PAT, PAT_VALUE);
+}
+
+// Returns entry bits selecting the memory type requested by flags for a page of page_size
+static uint64_t memtype_flags(int flags, size_t page_size)
+{
+	switch(flags & VMEM_FLAG_MEMTYPE){
+		case VMEM_FLAG_WT:
+			return PFLAG_WRITETHROUGH;
+		case VMEM_FLAG_UC_MINUS:
+			return PFLAG_CACHEDISABLE;
+		case VMEM_FLAG_UC:
+			return PFLAG_CACHEDISABLE | PFLAG_WRITETHROUGH;
+		case VMEM_FLAG_WC:
+			if(!pat_supported) // the closest type that doesn't need PAT
+				return PFLAG_CACHEDISABLE;
+			return page_size == PAGE_SIZE ? PFLAG_PTE_PAT : PFLAG_PAT;
+	}
+	return 0;
+}
+
+
+/* Process-context identifiers
+*  Every handle gets a PCID, so TLB entries of different handles can coexist and switching between handles doesn't flush them.
+*  PCIDs are handed out sequentially. When they run out, a new generation starts: handles get new PCIDs when they are selected,
+*  and every CPU flushes translations of all PCIDs before it loads a PCID of the new generation.
+*  Translations of a handle are invalidated right away only on the CPU that changes the handle,
+*  other CPUs are marked stale and flush the PCID when they select the handle next time.
+*/
+
+#define PCID_CNT			4096
+#define CR3_NOFLUSH			((uint64_t)1 << 63)	// keep TLB entries tagged with the PCID being loaded
+
+#define INVPCID_ADDR		0		// a single address of a PCID
+#define INVPCID_ALL			2		// all PCIDs, including global translations
+#define INVPCID_ALL_NONGLOBAL	3	// all PCIDs, except global translations
+
+static spinlock pcid_lock;
+static uint64_t pcid_gen = 1;
+static uint16_t pcid_next = 1;		// PCID 0 is left for code that runs before any handle is loaded
+static uint64_t pcid_cpu_gen[PCID_MAX_CPUS];	// generation each CPU flushed the TLB at last
+
+static uint32_t pcid_cpu_id()
+{
+	return apic_cpu_id();
+}
+
+static void invpcid(uint64_t type, uint16_t pcid, void* vaddr)
+{
+	struct {
+		uint64_t pcid;
+		void* vaddr;
+	} desc = {pcid, vaddr};
+	asm volatile("invpcid %0, %1" :: "m" (desc), "r" (type) : "memory");
+}
+
+// Flushes non-global translations of all PCIDs on the current CPU
+static void pcid_flush_all()
+{
+	if(invpcid_supported)
+		invpcid(INVPCID_ALL_NONGLOBAL, 0, NULL);
+	else{ // toggling CR4.PGE flushes all translations
+		uint64_t cr4;
+		asm volatile("mov %%cr4, %0" : "=r" (cr4));
+		asm volatile("mov %0, %%cr4" :: "r" (cr4 ^ CR4_PGE) : "memory");
+		asm volatile("mov %0, %%cr4" :: "r" (cr4) : "memory");
+	}
+}
+
+// Loads page tables of a handle into CR3, flushing it's translations only if they may be outdated
+static void pcid_load(mem_hndl* hndl)
+{
+	uint64_t flags = cpu_interrupt_save();
+	uint64_t cr4;
+	asm volatile("mov %%cr4, %0" : "=r" (cr4));
+	if(!(cr4 & CR4_PCIDE)){ // CR4.PCIDE can only be set while CR3 holds PCID 0
+		uint64_t cr3;
+		asm volatile("mov %%cr3, %0" : "=r" (cr3));
+		asm volatile("mov %0, %%cr3" :: "r" (cr3 & ~(uint64_t)0xFFF) : "memory");
+		asm volatile("mov %0, %%cr4" :: "r" (cr4 | CR4_PCIDE) : "memory");
+	}
+
+	uint32_t cpu = pcid_cpu_id() % PCID_MAX_CPUS;
+	spinlock_lock(&pcid_lock);
+	if(hndl->pcid_gen != pcid_gen){
+		if(pcid_next == PCID_CNT){
+			++pcid_gen;
+			pcid_next = 1;
+		}
+		hndl->pcid = pcid_next++;
+		hndl->pcid_gen = pcid_gen;
+		// translations tagged with the new PCID may be left from the handle that had it in an earlier generation
+		for(size_t i = 0; i < PCID_MAX_CPUS / 64; ++i)
+			hndl->pcid_stale[i] = (uint64_t)-1;
+	}
+	if(pcid_cpu_gen[cpu] != pcid_gen){
+		pcid_flush_all();
+		pcid_cpu_gen[cpu] = pcid_gen;
+	}
+	uint64_t noflush = CR3_NOFLUSH;
+	if(hndl->pcid_stale[cpu / 64] & ((uint64_t)1 << (cpu % 64))){
+		hndl->pcid_stale[cpu / 64] &= ~((uint64_t)1 << (cpu % 64));
+		noflush = 0;
+	}
+	spinlock_unlock(&pcid_lock);
+
+	asm volatile("mov %0, %%cr3" :: "r" (VIRT_TO_PHYS(hndl->pml4) | hndl->pcid | noflush) : "memory");
+	cpu_interrupt_restore(flags);
+}
+
+/* Invalidates translation of vaddr in a handle. If the handle isn't loaded on the current CPU,
+*  the translation is invalidated with INVPCID, or the handle is flushed when it's selected next time.
+*/
+static void invalidate_page(mem_hndl* hndl, void* vaddr)
+{
+	if(!pcid_supported || pml4_is_kernel(PML4_IDX(vaddr))){ // INVLPG invalidates global translations of all PCIDs
+		INVLPG(vaddr);
+		return;
+	}
+
+	uint64_t flags = cpu_interrupt_save();
+	uint32_t cpu = pcid_cpu_id() % PCID_MAX_CPUS;
+	uint64_t cr3;
+	asm volatile("mov %%cr3, %0" : "=r" (cr3));
+	int loaded = (cr3 & ~(uint64_t)0xFFF) == VIRT_TO_PHYS(hndl->pml4);
+	int current = loaded && (cr3 & 0xFFF) == hndl->pcid;	// translations of this CPU are tagged with the handle's PCID
+	spinlock_lock(&pcid_lock);
+	int tagged = hndl->pcid_gen == pcid_gen;	// the PCID isn't given to another handle yet
+	for(size_t i = 0; i < PCID_MAX_CPUS / 64; ++i)
+		hndl->pcid_stale[i] = (uint64_t)-1;
+	if(current || (tagged && invpcid_supported))
+		hndl->pcid_stale[cpu / 64] &= ~((uint64_t)1 << (cpu % 64));
+	spinlock_unlock(&pcid_lock);
+
+	if(loaded)
+		INVLPG(vaddr);
+	if(!current && tagged && invpcid_supported)
+		invpcid(INVPCID_ADDR, hndl->pcid, vaddr);
+	cpu_interrupt_restore(flags);
+}
+/* Invalidates all non-global translations of a handle. The current CPU reloads the handle if it's loaded,
+*  other CPUs flush it when they select the handle next time.
+*/
+static void invalidate_hndl(mem_hndl* hndl)
+{
+	uint64_t flags = cpu_interrupt_save();
+	uint64_t cr3;
+	asm volatile("mov %%cr3, %0" : "=r" (cr3));
+	int loaded = (cr3 & ~(uint64_t)0xFFF) == VIRT_TO_PHYS(hndl->pml4);
+	if(pcid_supported){
+		spinlock_lock(&pcid_lock);
+		for(size_t i = 0; i < PCID_MAX_CPUS / 64; ++i)
+			hndl->pcid_stale[i] = (uint64_t)-1;
+		spinlock_unlock(&pcid_lock);
+		if(loaded)
+			pcid_load(hndl);
+	}
+	else if(loaded)
+		asm volatile("mov %0, %%cr3" :: "r" (cr3) : "memory");
+	cpu_interrupt_restore(flags);
+}
+
+/* TLB shootdown
+*  Calls that take translations away collect invalidated pages and frames freed with them in a batch.
+*  tlb_batch_flush() invalidates the pages on the current CPU one by one, or all at once above TLB_FLUSH_THRESHOLD pages,
+*  then posts the batch to a ring of requests and sends a single IPI to all other CPUs. Every CPU handles requests it
+*  hasn't seen yet (flushing everything if the ring has wrapped around) and acknowledges them by recording the last one.
+*  The sender doesn't wait for that: freed frames are kept on a list until all CPUs acknowledge the request,
+*  since other CPUs may still access them through outdated translations. List entries come from a static pool,
+*  so the heap (which unmaps memory itself) is never needed here. Only if the pool runs out the sender waits,
+*  handling requests of other CPUs meanwhile, since they may be waiting for it as well.
+*  Requests are sent only to CPUs that called vmemory_init_ap(), and to the one that initialized the module.
+*/
+
+#define TLB_FLUSH_THRESHOLD		32		// pages invalidated one by one, more pages are flushed at once
+#define TLB_BATCH_FRAMES		32		// frames kept in a batch, it's flushed early when they don't fit
+#define TLB_RING_SIZE			16		// requests kept for CPUs that didn't handle them yet
+#define TLB_SHOOTDOWN_GATE		0x40
+#define TLB_FRAME_TABLE			0		// size of a freed paging structure, it goes back to the page table pool
+#define TLB_DEFERRED_CNT		64		// requests that can wait for acknowledgements with their frames at once
+
+typedef struct {
+	void* paddr;
+	uint64_t size;
+} tlb_frame;
+
+typedef struct {
+	mem_hndl* hndl;
+	size_t page_cnt;			// only the first TLB_FLUSH_THRESHOLD pages are kept
+	void* pages[TLB_FLUSH_THRESHOLD];
+	int kernel, user;			// halves of address space the pages belong to
+	size_t frame_cnt;
+	tlb_frame frames[TLB_BATCH_FRAMES];
+} tlb_batch;
+
+typedef struct {
+	uint64_t* pml4;				// user pages are invalidated only by CPUs that have these page tables loaded
+	size_t page_cnt;
+	void* pages[TLB_FLUSH_THRESHOLD];
+	int kernel;
+} tlb_request;
+
+// Frames freed with a request that wasn't acknowledged by all CPUs yet
+typedef struct tlb_deferred tlb_deferred;
+struct tlb_deferred {
+	uint64_t gen;
+	size_t frame_cnt;
+	tlb_frame frames[TLB_BATCH_FRAMES];
+	tlb_deferred* next;
+};
+
+static spinlock tlb_lock;
+static uint64_t tlb_gen = 0;						// last posted request
+static tlb_request tlb_ring[TLB_RING_SIZE];
+static uint64_t tlb_cpu_gen[PCID_MAX_CPUS];			// last request handled by each CPU
+static uint64_t tlb_cpus[PCID_MAX_CPUS / 64];		// CPUs receiving requests
+static size_t tlb_cpu_cnt = 0;
+static tlb_deferred* tlb_deferred_list = NULL;		// in order of requests
+static tlb_deferred** tlb_deferred_tail = &tlb_deferred_list;
+static tlb_deferred tlb_deferred_pool[TLB_DEFERRED_CNT];
+static size_t tlb_deferred_used = 0;				// entries of the pool that were ever taken
+static tlb_deferred* tlb_deferred_free = NULL;
+
+#define TLB_CPU_REGISTERED(cpu)		(tlb_cpus[(cpu) / 64] & ((uint64_t)1 << ((cpu) % 64)))
+
+// Flushes all translations of the current CPU, global ones included
+static void tlb_flush_global()
+{
+	if(invpcid_supported)
+		invpcid(INVPCID_ALL, 0, NULL);
+	else{ // toggling CR4.PGE flushes all translations
+		uint64_t cr4;
+		asm volatile("mov %%cr4, %0" : "=r" (cr4));
+		asm volatile("mov %0, %%cr4" :: "r" (cr4 ^ CR4_PGE) : "memory");
+		asm volatile("mov %0, %%cr4" :: "r" (cr4) : "memory");
+	}
+}
+
+static void tlb_batch_init(tlb_batch* b, mem_hndl* hndl)
+{
+	b->hndl = hndl;
+	b->page_cnt = 0;
+	b->kernel = b->user = 0;
+	b->frame_cnt = 0;
+}
+static void tlb_batch_add_page(tlb_batch* b, void* vaddr)
+{
+	if(b->page_cnt < TLB_FLUSH_THRESHOLD)
+		b->pages[b->page_cnt] = vaddr;
+	++b->page_cnt;
+	if(pml4_is_kernel(PML4_IDX(vaddr)))
+		b->kernel = 1;
+	else
+		b->user = 1;
+}
+// Invalidates all user translations of the handle
+static void tlb_batch_add_hndl(tlb_batch* b)
+{
+	b->page_cnt = TLB_FLUSH_THRESHOLD + 1;
+	b->user = 1;
+}
+static void tlb_batch_flush(tlb_batch* b);
+// Frees a frame once no CPU can access it, translation of the frame should be added to the batch after it
+static void tlb_batch_add_frame(tlb_batch* b, void* paddr, uint64_t size)
+{
+	if(b->frame_cnt == TLB_BATCH_FRAMES)
+		tlb_batch_flush(b);
+	b->frames[b->frame_cnt].paddr = paddr;
+	b->frames[b->frame_cnt++].size = size;
+}
+// Same as tlb_batch_add_frame(), but for a paging structure
+static void tlb_batch_add_table(tlb_batch* b, uint64_t* table, int kernel)
+{
+	tlb_batch_add_frame(b, table, TLB_FRAME_TABLE);
+	if(kernel){ // paging-structure caches of all PCIDs may hold it's entries
+		b->page_cnt = TLB_FLUSH_THRESHOLD + 1;
+		b->kernel = 1;
+	}
+}
+
+static void pt_pool_free(uint64_t* table);
+// Ranges of the kernel address window are released the same way as frames, so they aren't reused while stale translations exist
+static void tlb_free_frames(tlb_frame* frames, size_t cnt)
+{
+	for(size_t i = 0; i < cnt; ++i){
+		if(frames[i].size == TLB_FRAME_TABLE)
+			pt_pool_free(frames[i].paddr);
+		else if(frames[i].paddr >= VSPACE_BASE && frames[i].paddr < VSPACE_BASE + VSPACE_SIZE)
+			allocator_vspace_free(frames[i].paddr, frames[i].size);
+		else
+			allocator_free(frames[i].paddr, frames[i].size);
+	}
+}
+
+// Handles requests posted since the last call on this CPU, tlb_lock should be held
+static void tlb_handle_requests(uint32_t cpu)
+{
+	uint64_t cr3;
+	asm volatile("mov %%cr3, %0" : "=r" (cr3));
+	int flush_all = tlb_gen - tlb_cpu_gen[cpu] > TLB_RING_SIZE;
+	for(uint64_t gen = tlb_cpu_gen[cpu] + 1; gen <= tlb_gen && !flush_all; ++gen){
+		tlb_request* req = &tlb_ring[gen % TLB_RING_SIZE];
+		int loaded = (cr3 & ~(uint64_t)0xFFF) == VIRT_TO_PHYS(req->pml4);
+		if(!req->kernel && !loaded)
+			continue;
+		if(req->page_cnt > TLB_FLUSH_THRESHOLD){
+			if(req->kernel)
+				flush_all = 1;
+			else // reloading CR3 flushes non-global translations of the current PCID
+				asm volatile("mov %0, %%cr3" :: "r" (cr3) : "memory");
+			continue;
+		}
+		for(size_t i = 0; i < req->page_cnt; ++i)
+			INVLPG(req->pages[i]);
+	}
+	if(flush_all)
+		tlb_flush_global();
+	tlb_cpu_gen[cpu] = tlb_gen;
+}
+
+// Takes an entry of the deferred frame pool, or returns NULL if all of them are used, tlb_lock should be held
+static tlb_deferred* tlb_deferred_get()
+{
+	tlb_deferred* d = tlb_deferred_free;
+	if(d)
+		tlb_deferred_free = d->next;
+	else if(tlb_deferred_used < TLB_DEFERRED_CNT)
+		d = &tlb_deferred_pool[tlb_deferred_used++];
+	return d;
+}
+
+// Detaches deferred frames of requests acknowledged by all CPUs, tlb_lock should be held
+static tlb_deferred* tlb_take_acked()
+{
+	uint64_t acked = tlb_gen;
+	for(uint32_t cpu = 0; cpu < PCID_MAX_CPUS; ++cpu)
+		if(TLB_CPU_REGISTERED(cpu) && tlb_cpu_gen[cpu] < acked)
+			acked = tlb_cpu_gen[cpu];
+	tlb_deferred* done = NULL;
+	tlb_deferred** done_tail = &done;
+	while(tlb_deferred_list && tlb_deferred_list->gen <= acked){
+		*done_tail = tlb_deferred_list;
+		done_tail = &tlb_deferred_list->next;
+		tlb_deferred_list = tlb_deferred_list->next;
+	}
+	*done_tail = NULL;
+	if(!tlb_deferred_list)
+		tlb_deferred_tail = &tlb_deferred_list;
+	return done;
+}
+
+static void tlb_batch_flush(tlb_batch* b)
+{
+	if(!b->page_cnt && !b->frame_cnt)
+		return;
+
+	uint64_t flags = cpu_interrupt_save();
+	if(b->page_cnt > TLB_FLUSH_THRESHOLD){
+		if(b->kernel)
+			tlb_flush_global();
+		if(b->user)
+			invalidate_hndl(b->hndl);
+	}
+	else
+		for(size_t i = 0; i < b->page_cnt; ++i)
+			invalidate_page(b->hndl, b->pages[i]);
+
+	uint32_t cpu = pcid_cpu_id() % PCID_MAX_CPUS;
+	spinlock_lock(&tlb_lock);
+	tlb_handle_requests(cpu); // requests of other CPUs are acknowledged before posting a new one
+	int others = tlb_cpu_cnt > (TLB_CPU_REGISTERED(cpu) ? 1 : 0);
+	if(others && b->page_cnt){
+		tlb_request* req = &tlb_ring[++tlb_gen % TLB_RING_SIZE];
+		req->pml4 = b->hndl->pml4;
+		req->page_cnt = b->page_cnt;
+		req->kernel = b->kernel;
+		for(size_t i = 0; i < b->page_cnt && i < TLB_FLUSH_THRESHOLD; ++i)
+			req->pages[i] = b->pages[i];
+		tlb_cpu_gen[cpu] = tlb_gen;
+	}
+	uint64_t gen = tlb_gen;
+	tlb_deferred* deferred = others && b->frame_cnt ? tlb_deferred_get() : NULL;
+	if(deferred){
+		deferred->gen = gen;
+		deferred->frame_cnt = b->frame_cnt;
+		memcpy(deferred->frames, b->frames, b->frame_cnt * sizeof(tlb_frame));
+		deferred->next = NULL;
+		*tlb_deferred_tail = deferred;
+		tlb_deferred_tail = &deferred->next;
+	}
+	tlb_deferred* acked = tlb_take_acked();
+	spinlock_unlock(&tlb_lock);
+
+	if(others && b->page_cnt){
+		while(lapic_read(LAPIC_REG_ICR0) & LAPIC_ICR_PENDING)
+			asm volatile("pause");
+		lapic_write(LAPIC_REG_ICR0, LAPIC_IPI_ALL_BUT_SELF | TLB_SHOOTDOWN_GATE);
+	}
+	if(others && b->frame_cnt && !deferred){ // nowhere to keep the frames, so acknowledgements are waited for
+		for(int done = 0; !done; ){
+			asm volatile("pause");
+			spinlock_lock(&tlb_lock);
+			tlb_handle_requests(cpu); // the CPUs waited for may be waiting for this one as well
+			done = 1;
+			for(uint32_t i = 0; i < PCID_MAX_CPUS; ++i)
+				if(TLB_CPU_REGISTERED(i) && tlb_cpu_gen[i] < gen)
+					done = 0;
+			spinlock_unlock(&tlb_lock);
+		}
+	}
+	cpu_interrupt_restore(flags);
+
+	if(!deferred)
+		tlb_free_frames(b->frames, b->frame_cnt);
+	if(acked){
+		tlb_deferred* last = acked;
+		for(tlb_deferred* it = acked; it; it = it->next){
+			tlb_free_frames(it->frames, it->frame_cnt);
+			last = it;
+		}
+		flags = cpu_interrupt_save();
+		spinlock_lock(&tlb_lock);
+		last->next = tlb_deferred_free;
+		tlb_deferred_free = acked;
+		spinlock_unlock(&tlb_lock);
+		cpu_interrupt_restore(flags);
+	}
+	b->page_cnt = 0;
+	b->kernel = b->user = 0;
+	b->frame_cnt = 0;
+}
+
+// Called from tlb_shootdown_isr with interrupts disabled
+static void tlb_shootdown()
+{
+	uint32_t cpu = pcid_cpu_id() % PCID_MAX_CPUS;
+	spinlock_lock(&tlb_lock);
+	tlb_handle_requests(cpu);
+	spinlock_unlock(&tlb_lock);
+	lapic_write(LAPIC_REG_EOI, 0);
+}
+
+// Makes the current CPU receive requests
+static void tlb_register_cpu()
+{
+	uint64_t flags = cpu_interrupt_save();
+	uint32_t cpu = pcid_cpu_id() % PCID_MAX_CPUS;
+	spinlock_lock(&tlb_lock);
+	if(!TLB_CPU_REGISTERED(cpu)){
+		tlb_cpus[cpu / 64] |= (uint64_t)1 << (cpu % 64);
+		++tlb_cpu_cnt;
+	}
+	tlb_cpu_gen[cpu] = tlb_gen;
+	spinlock_unlock(&tlb_lock);
+	tlb_flush_global(); // translations cached before the CPU was registered could have been taken away
+	cpu_interrupt_restore(flags);
+}
+
+/* Page table reclamation
+*  Every paging structure below PML4 keeps the number of it's present entries in bits 52-61 of the entry pointing to it,
+*  which the CPU ignores in entries that don't map a page. A table is freed as soon as it's last entry goes,
+*  which may leave the table above it empty as well. Page directory pointer tables of the kernel half are never freed,
+*  since PML4 entries pointing to them are copied into every handle.
+*/
+
+#define TABLE_ADDR_MASK			0xFFFFFFFFFF000
+#define TABLE_PTR(ent)			((uint64_t*)PHYS_TO_VIRT((ent) & TABLE_ADDR_MASK))
+#define TABLE_CNT_SHIFT			52
+#define TABLE_CNT_MASK			((uint64_t)0x3FF << TABLE_CNT_SHIFT)
+#define TABLE_CNT_ONE			((uint64_t)1 << TABLE_CNT_SHIFT)
+#define TABLE_CNT(ent)			GET_BITS(ent, TABLE_CNT_SHIFT, TABLE_CNT_SHIFT + 10)
+
+static uint64_t leaf_addr_mask(size_t page_size)
+{
+	return page_size == PAGE_SIZE3 ? 0xFFFFFC0000000 : page_size == PAGE_SIZE2 ? 0xFFFFFFFE00000 : TABLE_ADDR_MASK;
+}
+
+/* Returns the entry pointing to the table that holds an entry mapping vaddr with a page of page_size,
+*  or NULL if the table isn't counted.
+*/
+static uint64_t* table_parent(mem_hndl* hndl, void* vaddr, size_t page_size)
+{
+	uint64_t* pml4e = GET_PML4E(hndl, vaddr);
+	if(page_size == PAGE_SIZE3)
+		return pml4_is_kernel(PML4_IDX(vaddr)) ? NULL : pml4e;
+	uint64_t* pdpte = GET_PDPTE(vaddr, *pml4e);
+	if(page_size == PAGE_SIZE2)
+		return pdpte;
+	return GET_PDE(vaddr, *pdpte);
+}
+// Counts an entry mapping vaddr with a page of page_size (or pointing to a table) that was made present
+static void table_ref(mem_hndl* hndl, void* vaddr, size_t page_size)
+{
+	uint64_t* parent = table_parent(hndl, vaddr, page_size);
+	if(parent)
+		*parent += TABLE_CNT_ONE;
+}
+// Uncounts an entry that isn't present anymore, tables left empty are freed with the batch
+static void table_unref(mem_hndl* hndl, void* vaddr, size_t page_size, tlb_batch* b)
+{
+	for(; page_size <= PAGE_SIZE3; page_size *= PT_ENTRIES){
+		uint64_t* parent = table_parent(hndl, vaddr, page_size);
+		if(!parent)
+			return;
+		*parent -= TABLE_CNT_ONE;
+		if(TABLE_CNT(*parent))
+			return;
+		tlb_batch_add_table(b, TABLE_PTR(*parent), pml4_is_kernel(PML4_IDX(vaddr)));
+		*parent = 0x0;
+	}
+}
+
+static uint64_t* make_entry(mem_hndl* hndl, void* vaddr, size_t page_size);
+static uint64_t* get_entry(mem_hndl* hndl, void* vaddr, size_t* page_size);
+static int physmap_init(mem_hndl* hndl);
+
+
+/* Page table pool
+*  Paging structures are 4 KB frames taken from the physical allocator in batches and kept on a free list,
+*  linked through their first entry. Entries of paging structures hold physical addresses, and the module accesses tables
+*  through the physical memory window (see PHYSMAP_BASE), so frames don't have to be mapped anywhere else.
+*  Before the window is mapped in any handle, the bootloader's mapping of physical memory at the same address is used.
+*  Tables are freed by whichever CPU releases deferred frames (see TLB shootdown), so the list is locked,
+*  with interrupts disabled like the allocator does.
+*/
+
+#define PT_POOL_BATCH			16		// frames taken from the allocator at once
+
+static spinlock pt_pool_spinlock;
+static uint64_t* pt_pool_list = NULL;
+static size_t pt_pool_cnt = 0;
+
+static uint64_t pt_pool_lock()
+{
+	uint64_t flags = cpu_interrupt_save();
+	spinlock_lock(&pt_pool_spinlock);
+	return flags;
+}
+static void pt_pool_unlock(uint64_t flags)
+{
+	spinlock_unlock(&pt_pool_spinlock);
+	cpu_interrupt_restore(flags);
+}
+
+static void pt_pool_free(uint64_t* table)
+{
+	uint64_t flags = pt_pool_lock();
+	*table = (uint64_t)pt_pool_list;
+	pt_pool_list = table;
+	++pt_pool_cnt;
+	pt_pool_unlock(flags);
+}
+
+static int pt_pool_refill()
+{
+	size_t cnt = PT_POOL_BATCH;
+	void* paddr = allocator_alloc_align(cnt * PAGE_SIZE, PAGE_SIZE);
+	if(paddr == (void*)-1){
+		cnt = 1;
+		if((paddr = allocator_alloc_align(PAGE_SIZE, PAGE_SIZE)) == (void*)-1)
+			return VMEM_ERR_NOSPACE;
+	}
+	for(size_t i = 0; i < cnt; ++i)
+		pt_pool_free(PHYS_TO_VIRT(paddr + i * PAGE_SIZE));
+	return 0;
+}
+
+/* Returns a zeroed 4 KB page for a paging structure, or NULL if physical memory is exhausted. */
+static uint64_t* pt_pool_alloc()
+{
+	uint64_t flags = pt_pool_lock();
+	while(!pt_pool_list){ // the allocator is called with the list unlocked, another CPU may take the frames first
+		pt_pool_unlock(flags);
+		if(pt_pool_refill())
+			return NULL;
+		flags = pt_pool_lock();
+	}
+	uint64_t* table = pt_pool_list;
+	pt_pool_list = (uint64_t*)*table;
+	--pt_pool_cnt;
+	pt_pool_unlock(flags);
+	for(uint64_t i = 0; i < PT_ENTRIES; ++i)
+		table[i] = 0x0;
+	return table;
+}
+
+
 int create_mem_hndl(void* _hndl)
 {
 	mem_hndl* hndl = _hndl;
-	// allocate space for PML4 and mark all PML4 entries as not present
-	hndl->pml4 = kmalloc_align(sizeof(uint64_t) * PML4_ENTRIES, PML4_ALIGN);
+	// allocate space for PML4, all PML4 entries are not present
+	hndl->pml4 = pt_pool_alloc();
 	if(!hndl->pml4)
 		return VMEM_ERR_NOSPACE;
-	for(uint64_t i = 0; i < PML4_ENTRIES; ++i){
-		hndl->pml4[i] = 0x0;
-	}
+	hndl->pcid = 0;
+	hndl->pcid_gen = 0;
+	hndl->regions = NULL;
+	// the kernel half is the same in all handles
+	if(hndl_list)
+		for(uint64_t i = 0; i < PML4_ENTRIES; ++i)
+			if(pml4_is_kernel(i))
+				hndl->pml4[i] = hndl_list->pml4[i];
+	hndl->next = hndl_list;
+	hndl_list = hndl;
+	if(!hndl->next) // the first handle maps the physical memory window, others share it with the rest of the kernel half
+		return physmap_init(hndl);
 	return 0;
 }
 
 void* get_current_mem_hndl() { return cur_hndl; }
 
-int select_mem_hndl(void* _hndl, int activate)
+void load_mem_hndl(void* _hndl)
 {
 	mem_hndl* hndl = _hndl;
+	if(pcid_supported)
+		pcid_load(hndl);
+	else
+		asm volatile("mov %0, %%cr3" :: "r" (VIRT_TO_PHYS(hndl->pml4)) : "memory");
+}
+
+int select_mem_hndl(void* hndl, int activate)
+{
 	cur_hndl = hndl;
-	if(activate)
-		asm volatile("mov %0, %%cr3" :: "r" (hndl->pml4));
+	if(activate){
+		enable_global_pages();
+		load_mem_hndl(hndl);
+	}
 	return 0;
 }
 
+/* Frees a paging structure of the given level (1 for a page table, 2 for a page directory, 3 for a page directory pointer table)
+*  with all structures below it, and frames of pages mapped by it if free_frames is set.
+*/
+static void destroy_table(uint64_t* table, int level, int free_frames)
+{
+	for(uint64_t i = 0; i < PT_ENTRIES; ++i){
+		if(!(table[i] & PFLAG_PRESENT))
+			continue;
+		if(level > 1 && !(table[i] & PFLAG_PSIZE))
+			destroy_table(TABLE_PTR(table[i]), level - 1, free_frames);
+		else if(free_frames && !(table[i] & PFLAG_DEVICE)){
+			size_t page_size = (size_t)PAGE_SIZE << (9 * (level - 1));
+			void* paddr = (void*)(table[i] & leaf_addr_mask(page_size));
+			if(!(table[i] & PFLAG_SHARED) || !allocator_frame_unref(paddr))
+				allocator_free(paddr, page_size);
+		}
+	}
+	pt_pool_free(table);
+}
+
 int destroy_mem_hndl(void* _hndl)
 {
 	mem_hndl* hndl = _hndl;
+	mem_hndl** link = &hndl_list;
+	while(*link && *link != hndl)
+		link = &(*link)->next;
+	if(*link)
+		*link = hndl->next;
+	while(hndl->regions){
+		vmem_region* reg = hndl->regions;
+		hndl->regions = reg->next;
+		kfree(reg);
+	}
+
 	for(uint64_t i = 0; i < PML4_ENTRIES; ++i){
 		if(!(hndl->pml4[i] & PFLAG_PRESENT))
 			continue;
-		for(uint64_t j = 0; j < PDPT_ENTRIES; ++j){
-			if(!(GET_PDPTE(0, hndl->pml4[i])[j] & PFLAG_PRESENT))
+		if(pml4_is_kernel(i) && hndl_list) // kernel tables are freed only with the last handle
+			continue;
+		// memory mapped in the kernel half isn't owned by handles
+		destroy_table(TABLE_PTR(hndl->pml4[i]), 3, !pml4_is_kernel(i));
+	}
+	pt_pool_free(hndl->pml4);
+	return 0;
+}
+
+
+/* Copy-on-write
+*  A cloned handle gets it's own paging structures for the user half, but they map the same frames as the source handle.
+*  Shared frames have PFLAG_SHARED set in every entry mapping them and their references are counted by the allocator.
+*  Writable pages are made read-only in both handles and marked with PFLAG_COW, the first write to such a page
+*  gives the faulting handle it's own copy of it (or the frame itself if no one else maps it anymore).
+*  Frames are copied through a pair of pages reserved for every CPU in the kernel half, since user frames
+*  aren't necessarily mapped anywhere in the kernel.
+*/
+
+#define COPY_WINDOW_BASE		((void*)0xFFFFFF0000000000)	// PML4 entry 510, right below the kernel image
+
+// Copies size bytes of physical memory from src to dst, both should be page-aligned
+static int copy_frames(mem_hndl* hndl, void* dst, void* src, size_t size)
+{
+	uint64_t flags = cpu_interrupt_save();
+	void* window = COPY_WINDOW_BASE + (uint64_t)(pcid_cpu_id() % PCID_MAX_CPUS) * 2 * PAGE_SIZE;
+	uint64_t *dst_ent, *src_ent;
+	for(int i = 0; i < 2; ++i){ // windows stay mapped once they are used
+		uint64_t* ent = make_entry(hndl, window + i * PAGE_SIZE, PAGE_SIZE);
+		if(!ent){
+			cpu_interrupt_restore(flags);
+			return VMEM_ERR_NOSPACE;
+		}
+		if(!(*ent & PFLAG_PRESENT)){
+			*ent = PFLAG_PRESENT;
+			table_ref(hndl, window + i * PAGE_SIZE, PAGE_SIZE);
+		}
+		*(i ? &src_ent : &dst_ent) = ent;
+	}
+	for(size_t off = 0; off < size; off += PAGE_SIZE){
+		*dst_ent = 0x0;
+		SET_PTE_PHYSADDR(*dst_ent, (uint64_t)dst + off);
+		*dst_ent |= PFLAG_PRESENT | PFLAG_CANWRITE | PFLAG_GLOBAL;
+		*src_ent = 0x0;
+		SET_PTE_PHYSADDR(*src_ent, (uint64_t)src + off);
+		*src_ent |= PFLAG_PRESENT | PFLAG_GLOBAL;
+		INVLPG(window);
+		INVLPG(window + PAGE_SIZE);
+		memcpy(window, window + PAGE_SIZE, PAGE_SIZE);
+	}
+	cpu_interrupt_restore(flags);
+	return 0;
+}
+
+/* Gives the current handle it's own copy of a shared page at vaddr (aligned by page_size), or just takes the frame
+*  if other handles don't map it anymore. A copy-on-write page becomes writable.
+*  The old translation is invalidated with the batch.
+*/
+static int unshare_page(mem_hndl* hndl, void* vaddr, uint64_t* ent, size_t page_size, tlb_batch* batch)
+{
+	uint64_t mask = leaf_addr_mask(page_size);
+	void* paddr = (void*)(*ent & mask);
+	if(allocator_frame_shared(paddr)){
+		void* copy = allocator_alloc_zone(page_size, page_size, ALLOC_ZONE_NORMAL);
+		if(copy == (void*)-1)
+			return VMEM_ERR_NOSPACE;
+		if(copy_frames(hndl, copy, paddr, page_size)){
+			allocator_free(copy, page_size);
+			return VMEM_ERR_NOSPACE;
+		}
+		*ent = (*ent & ~mask) | (uint64_t)copy;
+		if(!allocator_frame_unref(paddr)) // other handles have dropped the frame meanwhile
+			tlb_batch_add_frame(batch, paddr, page_size);
+		tlb_batch_add_page(batch, vaddr);
+	}
+	else // only write access is added, other CPUs take a spurious page fault if they have the read-only translation
+		invalidate_page(hndl, vaddr);
+	if(*ent & PFLAG_COW)
+		*ent |= PFLAG_CANWRITE;
+	*ent &= ~(PFLAG_SHARED | PFLAG_COW);
+	return 0;
+}
+
+/* Copies a paging structure of the given level (1 for a page table, 2 for a page directory, 3 for a page directory pointer table)
+*  into dst, sharing pages mapped by it. Memory-mapped I/O (PFLAG_DEVICE) is mapped by both handles as it is, without copy-on-write.
+*  Fails if a frame of some other page can't be counted by the allocator.
+*/
+static int clone_table(uint64_t* src, uint64_t* dst, int level, uint64_t* cnt)
+{
+	*cnt = 0;
+	for(uint64_t i = 0; i < PT_ENTRIES; ++i){
+		if(!(src[i] & PFLAG_PRESENT))
+			continue;
+		if(level == 1 || (src[i] & PFLAG_PSIZE)){
+			size_t page_size = (size_t)PAGE_SIZE << (9 * (level - 1));
+			if(src[i] & PFLAG_DEVICE){ // it's never freed, so it doesn't have to be counted
+				dst[i] = src[i];
+				++*cnt;
 				continue;
-			kfree(GET_PDE(0, GET_PDPTE(0, hndl->pml4[i])[j]));
+			}
+			if(allocator_frame_ref((void*)(src[i] & leaf_addr_mask(page_size))))
+				return VMEM_ERR_NOSPACE; // the frame would be freed by the first handle to unmap it
+			if(src[i] & PFLAG_CANWRITE)
+				src[i] = (src[i] & ~PFLAG_CANWRITE) | PFLAG_COW;
+			src[i] |= PFLAG_SHARED;
+			dst[i] = src[i];
+			++*cnt;
+			continue;
 		}
-		kfree(GET_PDPTE(0, hndl->pml4[i]));
+		uint64_t* table = pt_pool_alloc();
+		if(!table)
+			return VMEM_ERR_NOSPACE;
+		uint64_t table_cnt;
+		int err = clone_table(TABLE_PTR(src[i]), table, level - 1, &table_cnt);
+		dst[i] = (src[i] & ~(TABLE_ADDR_MASK | TABLE_CNT_MASK)) | VIRT_TO_PHYS(table) | table_cnt << TABLE_CNT_SHIFT;
+		++*cnt;
+		if(err)
+			return err;
 	}
-	kfree(hndl->pml4);
 	return 0;
 }
 
+int clone_mem_hndl(void* _src, void* _dst)
+{
+	mem_hndl *src = _src, *dst = _dst;
+	int err = create_mem_hndl(dst);
+	if(err)
+		return err;
+
+	vmem_region** link = &dst->regions;
+	for(vmem_region* reg = src->regions; reg; reg = reg->next){
+		vmem_region* copy = kmalloc(sizeof(vmem_region));
+		if(!copy)
+			return VMEM_ERR_NOSPACE;
+		*copy = *reg;
+		copy->next = NULL;
+		*link = copy;
+		link = &copy->next;
+	}
+
+	for(uint64_t i = 0; i < PML4_ENTRIES && !err; ++i){
+		if(pml4_is_kernel(i) || !(src->pml4[i] & PFLAG_PRESENT))
+			continue;
+		uint64_t* pdpt = pt_pool_alloc();
+		if(!pdpt){
+			err = VMEM_ERR_NOSPACE;
+			break;
+		}
+		uint64_t cnt;
+		err = clone_table(TABLE_PTR(src->pml4[i]), pdpt, 3, &cnt);
+		dst->pml4[i] = (src->pml4[i] & ~(TABLE_ADDR_MASK | TABLE_CNT_MASK)) | VIRT_TO_PHYS(pdpt) | cnt << TABLE_CNT_SHIFT;
+	}
+	// pages of the source handle became read-only
+	tlb_batch batch;
+	tlb_batch_init(&batch, src);
+	tlb_batch_add_hndl(&batch);
+	tlb_batch_flush(&batch);
+	return err;
+}
+
 
 /* Memory mapping functions: */
 
 /* Makes an entry for specified virtual address.
 *  If there was already an entry, the existing entry is returned, so check for the present bit.
+*  The same goes for a larger page that is already mapped at vaddr: it's entry is returned.
 *  Argument page_size governs at what level the function stops and puts size bit (or doesn't put size bit if this is a 4kb page).
 *  Return value:
-*	Returns a pointer to this entry, or NULL if:
-*	- Physical address allocated by the kernel memory manager (kernlib.h) is too high.
-*	- Kernel memory manager couldn't allocate more memory.
+*	Returns a pointer to this entry, or NULL if the page table pool couldn't get more physical memory.
 */
-static uint64_t* make_entry(void* vaddr, size_t page_size)
+static uint64_t* make_entry(mem_hndl* hndl, void* vaddr, size_t page_size)
 {
-	uint64_t* pml4e = GET_PML4E(vaddr);
+	uint64_t* pml4e = GET_PML4E(hndl, vaddr);
 	if(!(*pml4e & PFLAG_PRESENT)){ // allocate space for a page directory pointer table
-		uint64_t* new_pdpt = kmalloc_align(sizeof(uint64_t) * PDPT_ENTRIES, PDPT_ALIGN);
+		uint64_t* new_pdpt = pt_pool_alloc();
 		if(!new_pdpt)
 			return NULL;
-		for(uint64_t i = 0; i < PDPT_ENTRIES; ++i)
-			new_pdpt[i] = 0x0;
-		SET_PDPT(*pml4e, (uint64_t)new_pdpt);
+		*pml4e = 0x0;
+		SET_PDPT(*pml4e, VIRT_TO_PHYS(new_pdpt));
 		*pml4e |= PFLAG_PRESENT | PFLAG_CANWRITE;
+		if(pml4_is_kernel(PML4_IDX(vaddr)))
+			for(mem_hndl* h = hndl_list; h; h = h->next)
+				h->pml4[PML4_IDX(vaddr)] = *pml4e;
 	}
 
 	uint64_t* pdpte = GET_PDPTE(vaddr, *pml4e);
+	if(page_size == PAGE_SIZE3){
+		if(!(*pdpte & PFLAG_PRESENT))
+			*pdpte |= PFLAG_PSIZE;
+		return pdpte;
+	}
+	if(*pdpte & PFLAG_PSIZE)
+		return pdpte;
 	if(!(*pdpte & PFLAG_PRESENT)){ // allocate space for a page directory
-		uint64_t* new_pd = kmalloc_align(sizeof(uint64_t) * PD_ENTRIES, PD_ALIGN);
+		uint64_t* new_pd = pt_pool_alloc();
 		if(!new_pd)
 			return NULL;
-		for(uint64_t i = 0; i < PD_ENTRIES; ++i)
-			new_pd[i] = 0x0;
-		SET_PD(*pdpte, (uint64_t)new_pd);
+		*pdpte = 0x0;
+		SET_PD(*pdpte, VIRT_TO_PHYS(new_pd));
 		*pdpte |= PFLAG_PRESENT | PFLAG_CANWRITE;
+		table_ref(hndl, vaddr, PAGE_SIZE3);
 	}
 
+	uint64_t* pde = GET_PDE(vaddr, *pdpte);
 	if(page_size == PAGE_SIZE2){
-		uint64_t* pde = GET_PDE(vaddr, *pdpte);
-		*pde |= PFLAG_PSIZE;
+		if(!(*pde & PFLAG_PRESENT))
+			*pde |= PFLAG_PSIZE;
 		return pde;
 	}
 	
 	// otherwise page_size == PAGE_SIZE
-	uint64_t* pde = GET_PDE(vaddr, *pdpte);
+	if(*pde & PFLAG_PSIZE)
+		return pde;
 	if(!(*pde & PFLAG_PRESENT)){ // allocate space for a page table
-		uint64_t* new_pt = kmalloc_align(sizeof(uint64_t) * PT_ENTRIES, PT_ALIGN);
+		uint64_t* new_pt = pt_pool_alloc();
 		if(!new_pt)
 			return NULL;
-		for(uint64_t i = 0; i < PT_ENTRIES; ++i)
-			new_pt[i] = 0x0;
-		SET_PT(*pde, (uint64_t)new_pt);
+		*pde = 0x0;
+		SET_PT(*pde, VIRT_TO_PHYS(new_pt));
 		*pde |= PFLAG_PRESENT | PFLAG_CANWRITE;
+		table_ref(hndl, vaddr, PAGE_SIZE2);
 	}
 
 	uint64_t* pte = GET_PTE(vaddr, *pde);
 	return pte;
 }
 /* Gets entry for specified virtual address.
+*  If page_size is not NULL, size of the page mapped by the entry is written to it.
 *  Return value:
 *	Returns a pointer to corresponding entry, or NULL if any of indirection tables are not present.
 */
-static uint64_t* get_entry(void* vaddr)
+static uint64_t* get_entry(mem_hndl* hndl, void* vaddr, size_t* page_size)
 {
-	uint64_t* pml4e = GET_PML4E(vaddr);
+	uint64_t* pml4e = GET_PML4E(hndl, vaddr);
 	if(!(*pml4e & PFLAG_PRESENT))
 		return NULL;
 	uint64_t* pdpte = GET_PDPTE(vaddr, *pml4e);
 	if(!(*pdpte & PFLAG_PRESENT))
 		return NULL;
+	if(*pdpte & PFLAG_PSIZE){
+		if(page_size)
+			*page_size = PAGE_SIZE3;
+		return pdpte;
+	}
 	uint64_t* pde = GET_PDE(vaddr, *pdpte);
 	if(!(*pde & PFLAG_PRESENT))
 		return NULL;
-	if(*pde & PFLAG_PSIZE)
+	if(*pde & PFLAG_PSIZE){
+		if(page_size)
+			*page_size = PAGE_SIZE2;
 		return pde;
+	}
 	uint64_t* pte = GET_PTE(vaddr, *pde);
+	if(page_size)
+		*page_size = PAGE_SIZE;
 	return pte;
 }
+/* Replaces a 2 MB page containing vaddr with a page table mapping the same physical memory with 4 KB pages.
+*  Return value:
+*	Returns a pointer to the new entry for vaddr, or NULL if the page table couldn't be allocated.
+*/
+static uint64_t* split_page2(mem_hndl* hndl, void* vaddr, uint64_t* pde)
+{
+	uint64_t* new_pt = pt_pool_alloc();
+	if(!new_pt)
+		return NULL;
+	uint64_t paddr = *pde & 0xFFFFFFFE00000;
+	uint64_t flags = *pde & (PFLAG_PRESENT | PFLAG_CANWRITE | PFLAG_SUPERVISOR | PFLAG_WRITETHROUGH | PFLAG_CACHEDISABLE | PFLAG_GLOBAL | PFLAG_DEVICE);
+	if(*pde & PFLAG_PAT)
+		flags |= PFLAG_PTE_PAT;
+	for(uint64_t i = 0; i < PT_ENTRIES; ++i){
+		new_pt[i] = 0x0;
+		SET_PTE_PHYSADDR(new_pt[i], paddr + i * PAGE_SIZE);
+		new_pt[i] |= flags;
+	}
+	*pde = 0x0;
+	SET_PT(*pde, VIRT_TO_PHYS(new_pt));
+	*pde |= PFLAG_PRESENT | PFLAG_CANWRITE | (uint64_t)PT_ENTRIES << TABLE_CNT_SHIFT;
+	invalidate_page(hndl, vaddr);
+	return GET_PTE(vaddr, *pde);
+}
+/* Replaces a 1 GB page containing vaddr with a page directory mapping the same physical memory with 2 MB pages.
+*  Return value:
+*	Returns a pointer to the new entry for vaddr, or NULL if the page directory couldn't be allocated.
+*/
+static uint64_t* split_page3(mem_hndl* hndl, void* vaddr, uint64_t* pdpte)
+{
+	uint64_t* new_pd = pt_pool_alloc();
+	if(!new_pd)
+		return NULL;
+	uint64_t paddr = *pdpte & 0xFFFFFC0000000;
+	uint64_t flags = *pdpte & (PFLAG_PRESENT | PFLAG_CANWRITE | PFLAG_SUPERVISOR | PFLAG_WRITETHROUGH | PFLAG_CACHEDISABLE | PFLAG_GLOBAL | PFLAG_DEVICE | PFLAG_PAT);
+	for(uint64_t i = 0; i < PD_ENTRIES; ++i){
+		new_pd[i] = 0x0;
+		SET_PDE_PHYSADDR(new_pd[i], paddr + i * PAGE_SIZE2);
+		new_pd[i] |= flags | PFLAG_PSIZE;
+	}
+	*pdpte = 0x0;
+	SET_PD(*pdpte, VIRT_TO_PHYS(new_pd));
+	*pdpte |= PFLAG_PRESENT | PFLAG_CANWRITE | (uint64_t)PD_ENTRIES << TABLE_CNT_SHIFT;
+	invalidate_page(hndl, vaddr);
+	return GET_PDE(vaddr, *pdpte);
+}
+
+/* Returns the largest page size that can map vaddr to paddr, if usize pages are left to map. */
+static size_t pick_page_size(void* vaddr, void* paddr, uint64_t usize)
+{
+	if(page3_supported && (uintptr_t)vaddr % PAGE_SIZE3 == 0 && (uintptr_t)paddr % PAGE_SIZE3 == 0 && usize >= PAGE_SIZE3 / PAGE_SIZE)
+		return PAGE_SIZE3;
+	if((uintptr_t)vaddr % PAGE_SIZE2 == 0 && (uintptr_t)paddr % PAGE_SIZE2 == 0 && usize >= PAGE_SIZE2 / PAGE_SIZE)
+		return PAGE_SIZE2;
+	return PAGE_SIZE;
+}
+
+/* Large page promotion
+*  A page table which maps all of it's 512 entries with the same attributes is replaced by a single 2 MB page.
+*  If frames of the pages are physically continous and aligned already, only the page directory entry changes,
+*  and mapping functions do it on their own once they fill a page table. Otherwise, collapse_pages() copies the pages
+*  into a new 2 MB frame and frees the old ones. The page table is freed in both cases.
+*/
+
+#define PROMOTE_NONE			0
+#define PROMOTE_COPY			1		// frames have to be copied
+#define PROMOTE_IN_PLACE		2		// frames are continous and aligned
+
+// Bits of a page table entry besides the frame address that have to match in all entries
+#define PTE_ATTR(pte)			((pte) & ~(TABLE_ADDR_MASK | PFLAG_ACCESSED | PFLAG_DIRTY))
+
+static int promote_check(uint64_t pde)
+{
+	if(!(pde & PFLAG_PRESENT) || (pde & PFLAG_PSIZE) || TABLE_CNT(pde) != PT_ENTRIES)
+		return PROMOTE_NONE;
+	uint64_t* pt = TABLE_PTR(pde);
+	uint64_t attr = PTE_ATTR(pt[0]);
+	if(attr & (PFLAG_SHARED | PFLAG_COW))
+		return PROMOTE_NONE;
+	int continous = (pt[0] & TABLE_ADDR_MASK) % PAGE_SIZE2 == 0;
+	for(uint64_t i = 0; i < PT_ENTRIES; ++i){
+		if(PTE_ATTR(pt[i]) != attr)
+			return PROMOTE_NONE;
+		if((pt[i] & TABLE_ADDR_MASK) != (pt[0] & TABLE_ADDR_MASK) + i * PAGE_SIZE)
+			continous = 0;
+	}
+	if(continous)
+		return PROMOTE_IN_PLACE;
+	return attr & PFLAG_DEVICE ? PROMOTE_NONE : PROMOTE_COPY; // memory-mapped I/O can't be moved
+}
+
+/* Replaces a page table covering vaddr (aligned by 2 MB) with a 2 MB page, if it can be done without copying
+*  or copy is set. Old translations, frames and the page table are freed with the batch.
+*  Return value:
+*	0			OK, or the page table can't be replaced
+*	non-zero	error, see error codes in vmemory.h
+*/
+static int promote_page2(mem_hndl* hndl, void* vaddr, int copy, int zone, tlb_batch* b)
+{
+	uint64_t* pml4e = GET_PML4E(hndl, vaddr);
+	if(!(*pml4e & PFLAG_PRESENT))
+		return 0;
+	uint64_t* pdpte = GET_PDPTE(vaddr, *pml4e);
+	if(!(*pdpte & PFLAG_PRESENT) || (*pdpte & PFLAG_PSIZE))
+		return 0;
+	uint64_t* pde = GET_PDE(vaddr, *pdpte);
+	int res = promote_check(*pde);
+	if(res == PROMOTE_NONE || (res == PROMOTE_COPY && !copy))
+		return 0;
+
+	uint64_t* pt = TABLE_PTR(*pde);
+	void* paddr = (void*)(pt[0] & TABLE_ADDR_MASK);
+	if(res == PROMOTE_COPY){
+		paddr = allocator_alloc_zone(PAGE_SIZE2, PAGE_SIZE2, zone);
+		if(paddr == (void*)-1)
+			return VMEM_ERR_NOSPACE;
+		for(uint64_t i = 0; i < PT_ENTRIES; ++i)
+			if(copy_frames(hndl, paddr + i * PAGE_SIZE, (void*)(pt[i] & TABLE_ADDR_MASK), PAGE_SIZE)){
+				allocator_free(paddr, PAGE_SIZE2);
+				return VMEM_ERR_NOSPACE;
+			}
+	}
+	*pde = (PTE_ATTR(pt[0]) & ~PFLAG_PTE_PAT) | PFLAG_PSIZE;
+	if(pt[0] & PFLAG_PTE_PAT)
+		*pde |= PFLAG_PAT;
+	SET_PDE_PHYSADDR(*pde, (uint64_t)paddr);
+
+	if(res == PROMOTE_COPY)
+		for(uint64_t i = 0; i < PT_ENTRIES; ++i){
+			tlb_batch_add_frame(b, (void*)(pt[i] & TABLE_ADDR_MASK), PAGE_SIZE);
+			tlb_batch_add_page(b, vaddr + i * PAGE_SIZE);
+		}
+	else // remaining 4 KB translations map the same memory
+		tlb_batch_add_page(b, vaddr);
+	tlb_batch_add_table(b, pt, pml4_is_kernel(PML4_IDX(vaddr)));
+	return 0;
+}
+
+// Promotes page tables covering [vaddr; vaddr + usize pages) that don't need copying
+static void promote_range(mem_hndl* hndl, void* vaddr, uint64_t usize)
+{
+	tlb_batch batch;
+	tlb_batch_init(&batch, hndl);
+	void* end = vaddr + usize * PAGE_SIZE;
+	for(vaddr -= (uintptr_t)vaddr % PAGE_SIZE2; vaddr < end; vaddr += PAGE_SIZE2)
+		promote_page2(hndl, vaddr, 0, 0, &batch);
+	tlb_batch_flush(&batch);
+}
 
 
 // Public interface
 
+#define PAGE_FAULT_GATE			14
+
+static void page_fault(uint64_t err, void* addr);
+extern uint64_t _vmem_page_fault_handler[1];
+extern void page_fault_isr();
+extern uint64_t _vmem_tlb_shootdown_handler[1];
+extern void tlb_shootdown_isr();
+
+static void detect_features()
+{
+	uint32_t eax, ebx, ecx, edx;
+	if(cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx))
+		page3_supported = (edx & CPUID_EXT_FEAT_EDX_PAGE1GB) != 0;
+	if(cpuid(0x1, 0, &eax, &ebx, &ecx, &edx)){
+		pcid_supported = (ecx & CPUID_FEAT_ECX_PCID) != 0;
+		pat_supported = (edx & CPUID_FEAT_EDX_PAT) != 0;
+	}
+	if(cpuid(0x7, 0, &eax, &ebx, &ecx, &edx))
+		invpcid_supported = (ebx & CPUID_EXT7_EBX_INVPCID) != 0;
+	spinlock_init(&pcid_lock);
+	spinlock_init(&tlb_lock);
+	spinlock_init(&pt_pool_spinlock);
+}
+
+static void init_common()
+{
+	detect_features();
+	init_pat();
+	*_vmem_page_fault_handler = (uintptr_t)page_fault;
+	cpu_interrupt_set_gate(page_fault_isr, PAGE_FAULT_GATE, CPU_INT_TYPE_INTERRUPT);
+	*_vmem_tlb_shootdown_handler = (uintptr_t)tlb_shootdown;
+	cpu_interrupt_set_gate(tlb_shootdown_isr, TLB_SHOOTDOWN_GATE, CPU_INT_TYPE_INTERRUPT);
+	tlb_register_cpu();
+}
+
 int vmemory_init(uint64_t mem_limit)
 {
+	if(!(phys_ranges = kmalloc(sizeof(phys_range))))
+		return VMEM_ERR_NOSPACE;
+	phys_ranges[0].beg = 0;
+	phys_ranges[0].end = mem_limit;
+	phys_range_cnt = 1;
+	init_common();
+	set_ident_limit(mem_limit);
 	allocator_init(mem_limit);
+	allocator_vspace_init(VSPACE_BASE, VSPACE_SIZE);
+	return 0;
+}
+int vmemory_init_memmap(struct stivale2_mmap_entry* entries, uint64_t cnt)
+{
+	init_common();
+	if(!(phys_ranges = kmalloc(cnt * sizeof(phys_range))))
+		return VMEM_ERR_NOSPACE;
+	uint64_t limit = 0x100000000; // memory-mapped I/O is identity mapped below 4 GB
+	for(uint64_t i = 0; i < cnt; ++i){
+		if(entries[i].base + entries[i].length > limit)
+			limit = entries[i].base + entries[i].length;
+		if(entries[i].type == STIVALE2_MMAP_USABLE){ // partial pages at the edges aren't treated as RAM
+			phys_ranges[phys_range_cnt].beg = (entries[i].base + (PAGE_SIZE - 1)) & ~(uint64_t)(PAGE_SIZE - 1);
+			phys_ranges[phys_range_cnt++].end = (entries[i].base + entries[i].length) & ~(uint64_t)(PAGE_SIZE - 1);
+		}
+	}
+	set_ident_limit(limit);
+	allocator_init_memmap(entries, cnt);
+	allocator_vspace_init(VSPACE_BASE, VSPACE_SIZE);
 	return 0;
 }
+int vmemory_init_ap()
+{
+	enable_global_pages();
+	init_pat();
+	tlb_register_cpu();
+	return 0;
+}
+
+// Returns the highest physical memory zone allowed by map_alloc flags
+static int flags_zone(int flags)
+{
+	if(flags & VMEM_FLAG_ZONE_LOW)
+		return ALLOC_ZONE_LOW;
+	if(flags & VMEM_FLAG_ZONE_DMA32)
+		return ALLOC_ZONE_DMA32;
+	return ALLOC_ZONE_NORMAL;
+}
 
-#define MAP_PAGE(vaddr, paddr)\
+#define MAP_PAGE(hndl, vaddr, paddr, attr)\
 {\
-	uint64_t* ent = make_entry(vaddr, PAGE_SIZE);\
+	uint64_t* ent = make_entry(hndl, vaddr, PAGE_SIZE);\
 	if(!ent)\
 		return VMEM_ERR_NOSPACE;\
 	if(*ent & PFLAG_PRESENT)\
 		return VMEM_ERR_VIRT_OCCUPIED;\
 	SET_PTE_PHYSADDR(*ent, (uint64_t)paddr);\
-	*ent |= PFLAG_PRESENT | PFLAG_CANWRITE;\
+	*ent |= PFLAG_PRESENT | PFLAG_CANWRITE | KERNEL_PAGE_FLAGS(vaddr) | (attr);\
+	table_ref(hndl, vaddr, PAGE_SIZE);\
 }
-#define MAP_PAGE2(vaddr, paddr)\
+#define MAP_PAGE2(hndl, vaddr, paddr, attr)\
 {\
-	uint64_t* ent = make_entry(vaddr, PAGE_SIZE2);\
+	uint64_t* ent = make_entry(hndl, vaddr, PAGE_SIZE2);\
 	if(!ent)\
 		return VMEM_ERR_NOSPACE;\
 	if(*ent & PFLAG_PRESENT)\
 		return VMEM_ERR_VIRT_OCCUPIED;\
 	SET_PDE_PHYSADDR(*ent, (uint64_t)paddr);\
-	*ent |= PFLAG_PRESENT | PFLAG_CANWRITE;\
+	*ent |= PFLAG_PRESENT | PFLAG_CANWRITE | KERNEL_PAGE_FLAGS(vaddr) | (attr);\
+	table_ref(hndl, vaddr, PAGE_SIZE2);\
 }
-
-#define MAP_PAGE_ALLOC(vaddr)\
+#define MAP_PAGE3(hndl, vaddr, paddr, attr)\
 {\
-	void* paddr = allocator_alloc_align(PAGE_SIZE, PAGE_SIZE);\
-	if(paddr == (void*)-1)\
+	uint64_t* ent = make_entry(hndl, vaddr, PAGE_SIZE3);\
+	if(!ent)\
 		return VMEM_ERR_NOSPACE;\
-	MAP_PAGE(vaddr, paddr);\
+	if(*ent & PFLAG_PRESENT)\
+		return VMEM_ERR_VIRT_OCCUPIED;\
+	SET_PDPTE_PHYSADDR(*ent, (uint64_t)paddr);\
+	*ent |= PFLAG_PRESENT | PFLAG_CANWRITE | KERNEL_PAGE_FLAGS(vaddr) | (attr);\
+	table_ref(hndl, vaddr, PAGE_SIZE3);\
 }
-#define MAP_PAGE2_ALLOC(vaddr)\
+// Maps a page of the size chosen by pick_page_size()
+#define MAP_PAGE_ANY(hndl, vaddr, paddr, page_size, attr)\
 {\
-	void* paddr = allocator_alloc_align(PAGE_SIZE2, PAGE_SIZE2);\
-	if(paddr == (void*)-1)\
-		break;\
-	MAP_PAGE2(vaddr, paddr);\
+	if(page_size == PAGE_SIZE3)\
+		MAP_PAGE3(hndl, vaddr, paddr, attr)\
+	else if(page_size == PAGE_SIZE2)\
+		MAP_PAGE2(hndl, vaddr, paddr, attr)\
+	else\
+		MAP_PAGE(hndl, vaddr, paddr, attr)\
 }
 
-#define UNMAP_PAGE(vaddr)\
-{\
-	uint64_t* ent = get_entry(vaddr);\
-	if(!ent)\
-		return VMEM_NOT_MAPPED;\
-	allocator_free((void*)(GET_PDE_PHYSADDR(vaddr, *ent)), PAGE_SIZE);\
-	*ent &= ~PFLAG_PRESENT;\
+
+/* Physical memory window
+*  Usable physical memory is mapped at PHYSMAP_BASE + physical address (PML4 entries 256-383) in the kernel half,
+*  so paging structures and other frames taken from the allocator can be reached without being identity mapped
+*  in live kernel address space. The window is mapped when the first handle is created, the bootloader's mapping
+*  at the same address is used until then. Memory-mapped I/O isn't mapped, so it never gets a cacheable alias.
+*/
+
+#define PHYSMAP_SIZE			((uint64_t)1 << 46)
+
+static int physmap_map_range(mem_hndl* hndl, uint64_t beg, uint64_t end)
+{
+	if(end > PHYSMAP_SIZE)
+		end = PHYSMAP_SIZE;
+	beg -= beg % PAGE_SIZE;
+	end += (PAGE_SIZE - end % PAGE_SIZE) % PAGE_SIZE;
+	while(beg < end){
+		void* vaddr = PHYS_TO_VIRT(beg);
+		size_t page_size;
+		uint64_t* ent = get_entry(hndl, vaddr, &page_size);
+		if(ent && (*ent & PFLAG_PRESENT)){ // neighbouring ranges may share a page
+			beg += page_size - beg % page_size;
+			continue;
+		}
+		page_size = pick_page_size(vaddr, (void*)beg, (end - beg) / PAGE_SIZE);
+		MAP_PAGE_ANY(hndl, vaddr, beg, page_size, PFLAG_DEVICE);
+		beg += page_size;
+	}
+	return 0;
 }
-#define UNMAP_PAGE2(vaddr)\
-{\
-	uint64_t* ent = get_entry(vaddr);\
-	if(!ent)\
-		return VMEM_NOT_MAPPED;\
-	allocator_free((void*)(GET_PDE_PHYSADDR(vaddr, *ent)), PAGE_SIZE2);\
-	*ent &= ~PFLAG_PRESENT;\
+static int physmap_init(mem_hndl* hndl)
+{
+	int err = 0;
+	for(size_t i = 0; i < phys_range_cnt && !err; ++i)
+		err = physmap_map_range(hndl, phys_ranges[i].beg, phys_ranges[i].end);
+	return err;
 }
 
+#define MAP_ALLOC_RUNS		16		// runs taken from the allocator at once
+#define MAP_ALLOC_CACHED	32		// up to this many 4 KB pages are taken from the per-CPU frame list one by one
+#define PAGE2_ORDER			9		// log2(PAGE_SIZE2 / PAGE_SIZE)
+#define PAGE3_ORDER			18		// log2(PAGE_SIZE3 / PAGE_SIZE)
+
+// Same as MAP_PAGE_ANY, but returns an error code instead of returning from the caller
+static int map_page_any(void* vaddr, void* paddr, size_t page_size, uint64_t attr)
+{
+	MAP_PAGE_ANY(cur_hndl, vaddr, paddr, page_size, attr);
+	return 0;
+}
+
+/* Maps cnt pages of (PAGE_SIZE << order) bytes (order is 0, PAGE2_ORDER or PAGE3_ORDER) starting at vaddr,
+*  taking physical memory with a few batch allocations. A few 4 KB pages are taken from the per-CPU frame list instead,
+*  which doesn't need the allocator lock. Frames that couldn't be mapped are freed.
+*  The number of pages mapped is stored in done, it's less than cnt without an error only if there isn't enough physical memory.
+*/
+static int map_alloc_batch(void* vaddr, uint64_t cnt, int order, int zone, uint64_t* done)
+{
+	*done = 0;
+	if(!order && cnt <= MAP_ALLOC_CACHED && zone == ALLOC_ZONE_NORMAL){
+		for(; *done < cnt; ++*done, vaddr += PAGE_SIZE){
+			void* paddr = allocator_alloc_page();
+			if(paddr == (void*)-1)
+				break;
+			int err = map_page_any(vaddr, paddr, PAGE_SIZE, 0);
+			if(err){
+				allocator_free_page(paddr);
+				return err;
+			}
+		}
+		return 0;
+	}
+
+	allocator_run runs[MAP_ALLOC_RUNS];
+	uint64_t block = (uint64_t)PAGE_SIZE << order;
+	while(*done < cnt){
+		size_t run_cnt = allocator_alloc_batch(cnt - *done, order, zone, runs, MAP_ALLOC_RUNS);
+		if(!run_cnt)
+			break;
+		for(size_t i = 0; i < run_cnt; ++i)
+			for(uint64_t j = 0; j < runs[i].cnt; ++j, vaddr += block, ++*done){
+				int err = map_page_any(vaddr, runs[i].addr + j * block, block, 0);
+				if(err){ // the rest of the runs isn't mapped
+					allocator_free(runs[i].addr + j * block, (runs[i].cnt - j) * block);
+					while(++i < run_cnt)
+						allocator_free(runs[i].addr, runs[i].cnt * block);
+					return err;
+				}
+			}
+	}
+	return 0;
+}
+
+/* Undoes the mapping of [vaddr; vaddr + usize * PAGE_SIZE) made by a function that failed partway,
+*  frames of the pages are freed as well if free_frames is set (except for PFLAG_DEVICE pages).
+*/
+static void unmap_partial(void* vaddr, uint64_t usize, int free_frames)
+{
+	tlb_batch batch;
+	tlb_batch_init(&batch, cur_hndl);
+	while(usize){
+		size_t page_size;
+		uint64_t* ent = get_entry(cur_hndl, vaddr, &page_size);
+		uint64_t old = *ent;
+		*ent = 0;
+		if(free_frames && !(old & PFLAG_DEVICE))
+			tlb_batch_add_frame(&batch, (void*)(old & leaf_addr_mask(page_size)), page_size);
+		tlb_batch_add_page(&batch, vaddr);
+		table_unref(cur_hndl, vaddr, page_size, &batch);
+		vaddr += page_size;
+		usize -= page_size / PAGE_SIZE;
+	}
+	tlb_batch_flush(&batch);
+}
+
+
+/* Demand paging
+*  map_alloc() with VMEM_FLAG_LAZY only records the range in a list of regions, and the page fault handler maps a zeroed
+*  frame when a page of the range is touched for the first time. Regions in the kernel half are kept in a list shared by
+*  all handles, since their page tables are shared as well.
+*/
+
+#define PF_ERR_PRESENT			(1 << 0)	// the page was present, so the fault is a protection violation
+#define PF_ERR_WRITE			(1 << 1)
+#define PF_ERR_USER				(1 << 2)
+#define FAULT_AROUND_PAGES		16			// size of an aligned window of pages mapped with VMEM_FLAG_FAULT_AROUND
+
+static vmem_region* kernel_regions = NULL;
+
+static vmem_region* region_find(mem_hndl* hndl, void* vaddr)
+{
+	vmem_region* lists[] = {hndl->regions, kernel_regions};
+	for(size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); ++i)
+		for(vmem_region* reg = lists[i]; reg; reg = reg->next)
+			if(vaddr >= reg->vaddr && vaddr < reg->vaddr + reg->usize * PAGE_SIZE)
+				return reg;
+	return NULL;
+}
+static int region_overlaps(mem_hndl* hndl, void* vaddr, uint64_t usize)
+{
+	vmem_region* lists[] = {hndl->regions, kernel_regions};
+	for(size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); ++i)
+		for(vmem_region* reg = lists[i]; reg; reg = reg->next)
+			if(vaddr < reg->vaddr + reg->usize * PAGE_SIZE && reg->vaddr < vaddr + usize * PAGE_SIZE)
+				return 1;
+	return 0;
+}
+/* Removes [vaddr; vaddr + usize pages) from regions.
+*  Return value:
+*	0					OK
+*	VMEM_ERR_NOSPACE	a region couldn't be split in two
+*/
+static int region_remove(mem_hndl* hndl, void* vaddr, uint64_t usize)
+{
+	void* end = vaddr + usize * PAGE_SIZE;
+	vmem_region** lists[] = {&hndl->regions, &kernel_regions};
+	for(size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); ++i)
+		for(vmem_region** link = lists[i]; *link; ){
+			vmem_region* reg = *link;
+			void* reg_end = reg->vaddr + reg->usize * PAGE_SIZE;
+			if(reg_end <= vaddr || reg->vaddr >= end){
+				link = &reg->next;
+				continue;
+			}
+			if(reg->vaddr < vaddr && reg_end > end){ // the range is cut out of the middle
+				vmem_region* tail = kmalloc(sizeof(vmem_region));
+				if(!tail)
+					return VMEM_ERR_NOSPACE;
+				tail->vaddr = end;
+				tail->usize = (reg_end - end) / PAGE_SIZE;
+				tail->flags = reg->flags;
+				tail->next = reg->next;
+				reg->next = tail;
+				reg->usize = (vaddr - reg->vaddr) / PAGE_SIZE;
+				return 0;
+			}
+			if(reg->vaddr < vaddr){
+				reg->usize = (vaddr - reg->vaddr) / PAGE_SIZE;
+				link = &reg->next;
+			}
+			else if(reg_end > end){
+				reg->usize = (reg_end - end) / PAGE_SIZE;
+				reg->vaddr = end;
+				link = &reg->next;
+			}
+			else{
+				*link = reg->next;
+				kfree(reg);
+			}
+		}
+	return 0;
+}
+
+static int map_lazy(void* vaddr, uint64_t usize, int flags)
+{
+	if(region_overlaps(cur_hndl, vaddr, usize))
+		return VMEM_ERR_VIRT_OCCUPIED;
+	vmem_region* reg = kmalloc(sizeof(vmem_region));
+	if(!reg)
+		return VMEM_ERR_NOSPACE;
+	reg->vaddr = vaddr;
+	reg->usize = usize;
+	reg->flags = flags;
+	vmem_region** list = pml4_is_kernel(PML4_IDX(vaddr)) ? &kernel_regions : &cur_hndl->regions;
+	reg->next = *list;
+	*list = reg;
+	return 0;
+}
+
+// Maps a zeroed frame at vaddr of the current handle, unless something is mapped there already
+static int map_demand_page(mem_hndl* hndl, void* vaddr, int zone)
+{
+	uint64_t* ent = make_entry(hndl, vaddr, PAGE_SIZE);
+	if(!ent)
+		return VMEM_ERR_NOSPACE;
+	if(*ent & PFLAG_PRESENT)
+		return 0;
+	void* paddr = allocator_alloc_zone(PAGE_SIZE, PAGE_SIZE, zone);
+	if(paddr == (void*)-1)
+		return VMEM_ERR_NOSPACE;
+	SET_PTE_PHYSADDR(*ent, (uint64_t)paddr);
+	*ent |= PFLAG_PRESENT | PFLAG_CANWRITE | KERNEL_PAGE_FLAGS(vaddr);
+	table_ref(hndl, vaddr, PAGE_SIZE);
+	memset(vaddr, 0, PAGE_SIZE);
+	return 0;
+}
+
+// Returns the handle loaded into CR3 or NULL if it's not a handle of this module
+static mem_hndl* loaded_hndl()
+{
+	uint64_t cr3;
+	asm volatile("mov %%cr3, %0" : "=r" (cr3));
+	for(mem_hndl* hndl = hndl_list; hndl; hndl = hndl->next)
+		if(VIRT_TO_PHYS(hndl->pml4) == (cr3 & ~(uint64_t)0xFFF))
+			return hndl;
+	return NULL;
+}
+
+// Called from page_fault_isr with interrupts disabled, doesn't return if the fault can't be handled
+static void page_fault(uint64_t err, void* addr)
+{
+	mem_hndl* hndl = loaded_hndl();
+	if(hndl && (err & PF_ERR_PRESENT) && (err & PF_ERR_WRITE)){
+		size_t page_size;
+		uint64_t* ent = get_entry(hndl, addr, &page_size);
+		int res = -1;
+		if(ent && (*ent & PFLAG_CANWRITE) && (!(err & PF_ERR_USER) || (*ent & PFLAG_SUPERVISOR))){ // another CPU has copied the page, the translation of this CPU is outdated
+			invalidate_page(hndl, addr);
+			res = 0;
+		}
+		else if(ent && (*ent & PFLAG_COW)){
+			tlb_batch batch;
+			tlb_batch_init(&batch, hndl);
+			res = unshare_page(hndl, addr - (uintptr_t)addr % page_size, ent, page_size, &batch);
+			tlb_batch_flush(&batch);
+		}
+		if(!res)
+			return;
+	}
+	vmem_region* reg = hndl && !(err & PF_ERR_PRESENT) ? region_find(hndl, addr) : NULL;
+	if(reg){
+		void* page = addr - (uintptr_t)addr % PAGE_SIZE;
+		int zone = flags_zone(reg->flags);
+		int res = map_demand_page(hndl, page, zone);
+		if(!res && (reg->flags & VMEM_FLAG_FAULT_AROUND)){
+			void* window = page - (uintptr_t)page % (FAULT_AROUND_PAGES * PAGE_SIZE);
+			for(void* vaddr = window; vaddr < window + FAULT_AROUND_PAGES * PAGE_SIZE; vaddr += PAGE_SIZE)
+				if(vaddr >= reg->vaddr && vaddr < reg->vaddr + reg->usize * PAGE_SIZE && map_demand_page(hndl, vaddr, zone))
+					break; // neighbours are optional
+		}
+		if(!res)
+			promote_range(hndl, page, 1);
+		if(!res)
+			return;
+	}
+	uart_printf("Page fault at 0x%p, error code 0x%X\r\n", addr, (unsigned)err);
+	asm volatile("cli; hlt");
+}
+
+
 int map_alloc(void* vaddr, uint64_t usize, int flags)
 {
 	if(flags & VMEM_FLAG_SIZE_IN_BYTES)
 		usize = (usize + (PAGE_SIZE - 1)) / PAGE_SIZE;
+	if((flags & VMEM_FLAG_LAZY) && !(flags & VMEM_FLAG_MAINTAIN_CONTINUITY))
+		return map_lazy(vaddr, usize, flags);
+	int zone = flags_zone(flags);
+	void* beg = vaddr;
+	uint64_t beg_usize = usize;
+	int err = 0;
 
 	if(flags & VMEM_FLAG_MAINTAIN_CONTINUITY){
-		void* paddr = allocator_alloc_align(usize * PAGE_SIZE, PAGE_SIZE);
+		void* paddr = allocator_alloc_zone(usize * PAGE_SIZE, PAGE_SIZE, zone);
 		if(paddr == (void*)-1)
 			return VMEM_ERR_NOSPACE;
-		for(; usize && (uintptr_t)paddr % PAGE_SIZE2 > 0 && (uintptr_t)vaddr % PAGE_SIZE2 > 0; --usize, vaddr += PAGE_SIZE, paddr += PAGE_SIZE)
-			MAP_PAGE(vaddr, paddr);
-		for(; usize >= PAGE_SIZE2 / PAGE_SIZE; usize -= PAGE_SIZE2 / PAGE_SIZE, vaddr += PAGE_SIZE2, paddr += PAGE_SIZE2)
-			MAP_PAGE2(vaddr, paddr);
-		for(; usize; --usize, vaddr += PAGE_SIZE, paddr += PAGE_SIZE)
-			MAP_PAGE(vaddr, paddr);
+		while(usize){
+			size_t page_size = pick_page_size(vaddr, paddr, usize);
+			if((err = map_page_any(vaddr, paddr, page_size, 0))){
+				allocator_free(paddr, usize * PAGE_SIZE); // the mapped part is freed with it's pages below
+				break;
+			}
+			vaddr += page_size; paddr += page_size;
+			usize -= page_size / PAGE_SIZE;
+		}
 	}
 	else{
-		for(; usize && (uintptr_t)vaddr % PAGE_SIZE2 > 0; --usize, vaddr += PAGE_SIZE) 
-			MAP_PAGE_ALLOC(vaddr); 
-		for(; usize >= PAGE_SIZE2 / PAGE_SIZE; usize -= PAGE_SIZE2 / PAGE_SIZE, vaddr += PAGE_SIZE2)
-			MAP_PAGE2_ALLOC(vaddr);
-		for(; usize; --usize, vaddr += PAGE_SIZE)
-			MAP_PAGE_ALLOC(vaddr);
+		// 4 KB pages up to a 2 MB boundary, then 2 MB pages up to a 1 GB boundary and 1 GB pages while there are free 1 GB frames,
+		// then 2 MB pages while there are free 2 MB frames, then 4 KB pages for the rest
+		uint64_t head = ((PAGE_SIZE2 - (uintptr_t)vaddr % PAGE_SIZE2) % PAGE_SIZE2) / PAGE_SIZE;
+		if(head > usize)
+			head = usize;
+		uint64_t done;
+		err = map_alloc_batch(vaddr, head, 0, zone, &done);
+		vaddr += done * PAGE_SIZE; usize -= done;
+		if(!err && done < head)
+			err = VMEM_ERR_NOSPACE;
+
+		uint64_t head2 = ((PAGE_SIZE3 - (uintptr_t)vaddr % PAGE_SIZE3) % PAGE_SIZE3) / PAGE_SIZE2;
+		if(!err && page3_supported && usize / (PAGE_SIZE2 / PAGE_SIZE) >= head2 + PAGE_SIZE3 / PAGE_SIZE2){
+			err = map_alloc_batch(vaddr, head2, PAGE2_ORDER, zone, &done);
+			vaddr += done * PAGE_SIZE2; usize -= done * (PAGE_SIZE2 / PAGE_SIZE);
+			if(!err && done == head2){
+				err = map_alloc_batch(vaddr, usize / (PAGE_SIZE3 / PAGE_SIZE), PAGE3_ORDER, zone, &done);
+				vaddr += done * PAGE_SIZE3; usize -= done * (PAGE_SIZE3 / PAGE_SIZE);
+			}
+		}
+
+		if(!err){
+			err = map_alloc_batch(vaddr, usize / (PAGE_SIZE2 / PAGE_SIZE), PAGE2_ORDER, zone, &done);
+			vaddr += done * PAGE_SIZE2; usize -= done * (PAGE_SIZE2 / PAGE_SIZE);
+		}
+		if(!err){
+			err = map_alloc_batch(vaddr, usize, 0, zone, &done);
+			vaddr += done * PAGE_SIZE; usize -= done;
+			if(!err && usize)
+				err = VMEM_ERR_NOSPACE;
+		}
+	}
+	if(err){ // nothing of the range stays mapped
+		unmap_partial(beg, (vaddr - beg) / PAGE_SIZE, 1);
+		return err;
+	}
+	promote_range(cur_hndl, beg, beg_usize);
+	return 0;
+}
+
+/* Returns the end of the longest part of [paddr, end) starting at paddr that is either all usable RAM or all outside of it,
+*  usable is set to 1 in the former case and to 0 in the latter.
+*/
+static void* phys_part_end(void* paddr, void* end, int* usable)
+{
+	*usable = 0;
+	for(size_t i = 0; i < phys_range_cnt; ++i){
+		if((uint64_t)paddr >= phys_ranges[i].beg && (uint64_t)paddr < phys_ranges[i].end){
+			*usable = 1;
+			return phys_ranges[i].end < (uint64_t)end ? (void*)phys_ranges[i].end : end;
+		}
+		if(phys_ranges[i].beg > (uint64_t)paddr && phys_ranges[i].beg < (uint64_t)end)
+			end = (void*)phys_ranges[i].beg;
+	}
+	return end;
+}
+// Gives usable RAM in [paddr, end) back to the allocator
+static void release_phys(void* paddr, void* end)
+{
+	int usable;
+	for(void* part = paddr, *part_end; part < end; part = part_end){
+		part_end = phys_part_end(part, end, &usable);
+		if(usable)
+			allocator_free(part, part_end - part);
+	}
+}
+// Takes usable RAM in [paddr, end) from the allocator, either all of it or nothing if some part is allocated already
+static int take_phys(void* paddr, void* end)
+{
+	int usable;
+	for(void* part = paddr, *part_end; part < end; part = part_end){
+		part_end = phys_part_end(part, end, &usable);
+		if(usable && allocator_alloc_addr(part_end - part, part) == (void*)-1){
+			release_phys(paddr, part); // the parts taken already
+			return VMEM_ERR_PHYS_OCCUPIED;
+		}
 	}
 	return 0;
 }
@@ -281,14 +1780,72 @@ int map_phys(void* vaddr, void* paddr, uint64_t usize, int flags)
 	if(flags & VMEM_FLAG_SIZE_IN_BYTES)
 		usize = (usize + (PAGE_SIZE - 1)) / PAGE_SIZE;
 
-	allocator_alloc_addr(usize * PAGE_SIZE, paddr);
+	void* end = paddr + usize * PAGE_SIZE;
+	int usable;
+	if(!(flags & VMEM_FLAG_RESERVED) && take_phys(paddr, end))
+		return VMEM_ERR_PHYS_OCCUPIED;
 
-	for(; usize && (uintptr_t)paddr % PAGE_SIZE2 > 0 && (uintptr_t)vaddr % PAGE_SIZE2 > 0; --usize, vaddr += PAGE_SIZE, paddr += PAGE_SIZE)
-		MAP_PAGE(vaddr, paddr);
-	for(; usize >= PAGE_SIZE2 / PAGE_SIZE; usize -= PAGE_SIZE2 / PAGE_SIZE, vaddr += PAGE_SIZE2, paddr += PAGE_SIZE2)
-		MAP_PAGE2(vaddr, paddr);
-	for(; usize; --usize, vaddr += PAGE_SIZE, paddr += PAGE_SIZE)
-		MAP_PAGE(vaddr, paddr);
+	void* beg = vaddr;
+	uint64_t beg_usize = usize;
+	int err = 0;
+	while(paddr < end && !err){ // anything outside of usable RAM is memory-mapped I/O or firmware memory, which is never freed
+		void* part_end = phys_part_end(paddr, end, &usable);
+		while(paddr < part_end){
+			size_t page_size = pick_page_size(vaddr, paddr, (part_end - paddr) / PAGE_SIZE);
+			if((err = map_page_any(vaddr, paddr, page_size, (usable ? 0 : PFLAG_DEVICE) | memtype_flags(flags, page_size))))
+				break;
+			vaddr += page_size; paddr += page_size;
+		}
+	}
+	if(err){ // nothing of the range stays mapped or taken, RAM of the mapped part is given back once it's translations are flushed
+		unmap_partial(beg, (vaddr - beg) / PAGE_SIZE, !(flags & VMEM_FLAG_RESERVED));
+		if(!(flags & VMEM_FLAG_RESERVED))
+			release_phys(paddr, end);
+		return err;
+	}
+	promote_range(cur_hndl, beg, beg_usize);
+	return 0;
+}
+
+int reserve_phys(void* paddr, uint64_t usize, int flags)
+{
+	if(flags & VMEM_FLAG_SIZE_IN_BYTES)
+		usize = (usize + (PAGE_SIZE - 1)) / PAGE_SIZE;
+	return take_phys(paddr, paddr + usize * PAGE_SIZE);
+}
+
+// Unmaps pages of [vaddr; vaddr + usize * PAGE_SIZE), their translations and frames are freed with the batch
+static int unmap_pages(void* vaddr, uint64_t usize, tlb_batch* batch)
+{
+	while(usize){
+		size_t page_size;
+		uint64_t* ent = get_entry(cur_hndl, vaddr, &page_size);
+		if(!ent || !(*ent & PFLAG_PRESENT)){
+			if(!region_find(cur_hndl, vaddr))
+				return VMEM_NOT_MAPPED;
+			// a page of a demand paged region that wasn't touched yet
+			vaddr += PAGE_SIZE;
+			--usize;
+			continue;
+		}
+		if(page_size > PAGE_SIZE && ((uintptr_t)vaddr % page_size || usize < page_size / PAGE_SIZE)){
+			// only a part of the large page is unmapped, the rest stays mapped with smaller pages
+			if(((*ent & PFLAG_SHARED) && unshare_page(cur_hndl, vaddr - (uintptr_t)vaddr % page_size, ent, page_size, batch))
+			|| !(page_size == PAGE_SIZE3 ? split_page3(cur_hndl, vaddr, ent) : split_page2(cur_hndl, vaddr, ent)))
+				return VMEM_ERR_NOSPACE;
+			continue;
+		}
+
+		void* paddr = (void*)(*ent & leaf_addr_mask(page_size));
+		uint64_t old = *ent;
+		*ent = 0; // mapping functions OR the address into an entry, so nothing of the old one can be left
+		if(!(old & PFLAG_DEVICE) && (!(old & PFLAG_SHARED) || !allocator_frame_unref(paddr)))
+			tlb_batch_add_frame(batch, paddr, page_size);
+		tlb_batch_add_page(batch, vaddr);
+		table_unref(cur_hndl, vaddr, page_size, batch);
+		vaddr += page_size;
+		usize -= page_size / PAGE_SIZE;
+	}
 	return 0;
 }
 
@@ -297,11 +1854,91 @@ int unmap(void* vaddr, uint64_t usize, int flags)
 	if(flags & VMEM_FLAG_SIZE_IN_BYTES)
 		usize = (usize + (get_mem_unit_size() - 1)) / PAGE_SIZE;
 
-	for(; usize && (uintptr_t)vaddr % PAGE_SIZE2 > 0; --usize, vaddr += PAGE_SIZE) 
-		UNMAP_PAGE(vaddr);
-	for(; usize >= PAGE_SIZE2 / PAGE_SIZE; usize -= PAGE_SIZE2 / PAGE_SIZE, vaddr += PAGE_SIZE2)
-		UNMAP_PAGE2(vaddr);
-	for(; usize; --usize, vaddr += PAGE_SIZE) 
-		UNMAP_PAGE(vaddr);
-	return 0;
+	tlb_batch batch;
+	tlb_batch_init(&batch, cur_hndl);
+	int err = unmap_pages(vaddr, usize, &batch);
+	tlb_batch_flush(&batch);
+	return err ? err : region_remove(cur_hndl, vaddr, usize);
+}
+
+int collapse_pages(void* vaddr, uint64_t usize, int flags)
+{
+	if(flags & VMEM_FLAG_SIZE_IN_BYTES)
+		usize = (usize + (PAGE_SIZE - 1)) / PAGE_SIZE;
+
+	tlb_batch batch;
+	tlb_batch_init(&batch, cur_hndl);
+	int err = 0;
+	void* end = vaddr + usize * PAGE_SIZE;
+	for(vaddr += (PAGE_SIZE2 - (uintptr_t)vaddr % PAGE_SIZE2) % PAGE_SIZE2; vaddr + PAGE_SIZE2 <= end && !err; vaddr += PAGE_SIZE2)
+		err = promote_page2(cur_hndl, vaddr, 1, flags_zone(flags), &batch);
+	tlb_batch_flush(&batch);
+	return err;
+}
+
+
+/* Kernel address space
+*  Buffers that don't need a particular address are mapped in a window of the higher half (see VSPACE_BASE).
+*  Every range is followed by an unmapped guard gap, so running past the end of a buffer faults instead of corrupting the next one.
+*  Large ranges are aligned for 2 MB and 1 GB pages.
+*/
+
+#define VSPACE_GUARD			PAGE_SIZE
+
+// Reserves a range of the window usize pages long, followed by a guard gap
+static void* vspace_reserve(uint64_t usize)
+{
+	uint64_t align = usize >= PAGE_SIZE3 / PAGE_SIZE ? PAGE_SIZE3 : usize >= PAGE_SIZE2 / PAGE_SIZE ? PAGE_SIZE2 : PAGE_SIZE;
+	void* vaddr = allocator_vspace_alloc(usize * PAGE_SIZE + VSPACE_GUARD, align);
+	return vaddr == (void*)-1 ? NULL : vaddr;
+}
+/* Unmaps the first mapped_usize pages of a range usize pages long and releases the range
+*  once no CPU holds it's translations.
+*/
+static int vspace_release(void* vaddr, uint64_t mapped_usize, uint64_t usize)
+{
+	tlb_batch batch;
+	tlb_batch_init(&batch, cur_hndl);
+	int err = unmap_pages(vaddr, mapped_usize, &batch);
+	if(!err)
+		err = region_remove(cur_hndl, vaddr, usize);
+	if(!err)
+		tlb_batch_add_frame(&batch, vaddr, usize * PAGE_SIZE + VSPACE_GUARD);
+	tlb_batch_flush(&batch);
+	return err;
+}
+
+void* vmalloc(uint64_t usize, int flags)
+{
+	if(flags & VMEM_FLAG_SIZE_IN_BYTES)
+		usize = (usize + (PAGE_SIZE - 1)) / PAGE_SIZE;
+	void* vaddr = vspace_reserve(usize);
+	if(!vaddr)
+		return NULL;
+	if(map_alloc(vaddr, usize, flags & ~VMEM_FLAG_SIZE_IN_BYTES)){ // nothing stays mapped
+		vspace_release(vaddr, 0, usize);
+		return NULL;
+	}
+	return vaddr;
+}
+
+void* vmap_phys(void* paddr, uint64_t usize, int flags)
+{
+	if(flags & VMEM_FLAG_SIZE_IN_BYTES)
+		usize = (usize + (PAGE_SIZE - 1)) / PAGE_SIZE;
+	void* vaddr = vspace_reserve(usize);
+	if(!vaddr)
+		return NULL;
+	if(map_phys(vaddr, paddr, usize, flags & ~VMEM_FLAG_SIZE_IN_BYTES)){ // nothing stays mapped
+		vspace_release(vaddr, 0, usize);
+		return NULL;
+	}
+	return vaddr;
+}
+
+int vfree(void* vaddr, uint64_t usize, int flags)
+{
+	if(flags & VMEM_FLAG_SIZE_IN_BYTES)
+		usize = (usize + (PAGE_SIZE - 1)) / PAGE_SIZE;
+	return vspace_release(vaddr, usize, usize);
 }
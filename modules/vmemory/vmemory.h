@@ -12,6 +12,20 @@
 #define VMEM_FLAG_WRITE						0b0010		// R/W set: pages can be written to (otherwise read-only)
 #define VMEM_FLAG_SIZE_IN_BYTES				0b0100		// usize argument specifies size in bytes, not memory unit
 #define VMEM_FLAG_MAINTAIN_CONTINUITY		0b1000		// allocate a continous chunk of memory (only affects map_alloc)
+#define VMEM_FLAG_ZONE_DMA32				0b10000		// allocate physical memory below 4 GB (only affects map_alloc)
+#define VMEM_FLAG_ZONE_LOW					0b100000	// allocate physical memory below 1 MB (only affects map_alloc)
+#define VMEM_FLAG_LAZY						0b1000000	// map pages when they are touched for the first time (only affects map_alloc without VMEM_FLAG_MAINTAIN_CONTINUITY)
+#define VMEM_FLAG_FAULT_AROUND				0b10000000	// with VMEM_FLAG_LAZY, also map untouched neighbours of a touched page
+
+// Memory type of pages (only affects map_phys and vmap_phys), one of:
+#define VMEM_FLAG_WB						0b00000000000	// write-back (default)
+#define VMEM_FLAG_WT						0b00100000000	// write-through
+#define VMEM_FLAG_UC						0b01000000000	// uncacheable, for memory-mapped I/O
+#define VMEM_FLAG_UC_MINUS					0b01100000000	// uncacheable, but can be overridden by MTRRs
+#define VMEM_FLAG_WC						0b10000000000	// write-combining: writes are buffered and merged, for framebuffers and device rings
+#define VMEM_FLAG_MEMTYPE					0b11100000000
+
+#define VMEM_FLAG_RESERVED					0b100000000000	// physical memory was taken with reserve_phys() beforehand (only affects map_phys)
 
 #define VMEM_ERR_NOSPACE			-1			// Not enough free space for allocation
 #define VMEM_ERR_PHYS_OCCUPIED		-2			// Specified physical memory is already occupied
@@ -31,6 +45,24 @@
 *	non-zero 	error, see code above
 */
 int vmemory_init(uint64_t mem_limit);
+/* Same as vmemory_init(), but only memory marked as usable in the memory map is used for allocation.
+*  Free memory is split into zones (below 1 MB, below 4 GB and the rest), see VMEM_FLAG_ZONE_* flags.
+*  Arguments:
+*       entries - memory map entries passed by the bootloader.
+*       cnt - number of entries.
+*  Return value:
+*	0 			OK
+*	non-zero 	error, see code above
+*/
+struct stivale2_mmap_entry;
+int vmemory_init_memmap(struct stivale2_mmap_entry* entries, uint64_t cnt);
+/* Prepares an application processor for using memory handlers, called on every AP once it's started.
+*  Translations taken away by unmap() are invalidated only on CPUs that called it (and the one that initialized the module).
+*  Return value:
+*	0 			OK
+*	non-zero 	error, see code above
+*/
+int vmemory_init_ap();
 
 /* Returns size of memory unit used (page, buddy allocator chunk, byte), in bytes. */
 uint64_t get_mem_unit_size();
@@ -39,6 +71,8 @@ uint64_t get_mem_unit_size();
 uint64_t get_mem_hndl_size();
 /* Creates (initializes) a memory handler.
 *  Memory for a handler is allocated externally, using get_mem_hndl_size().
+*  Kernel memory (the higher half and identity mapped physical memory) is mapped the same way in all handlers,
+*  mapping it in one handler maps it in all of them.
 *  Return value:
 *	0 			OK
 *	non-zero 	error, see code above
@@ -49,27 +83,48 @@ int create_mem_hndl(void* hndl);
 *  Arguments:
 *	hndl - memory handler
 *	activate - if 0, just changes current handler, if 1, also uses it for address translation and/or memory protection.
+*	           If the CPU supports PCIDs, translations of the handler cached earlier are kept in TLB.
 *  Return value:
 *	0 			OK
 *	non-zero 	error, see code above
 */
 int select_mem_hndl(void* hndl, int activate);
+/* Uses a memory handler for address translation, the same way as select_mem_hndl() with activate set,
+*  but doesn't change the current handler. Called on thread switches, since a CR3 value saved earlier
+*  may hold a PCID that was given to another handler by now.
+*/
+void load_mem_hndl(void* hndl);
 /* Returns currently selected memory handler (not just CR3 value,
 *  but memory handler operated on by vmemory module functions.
 */
 void* get_current_mem_hndl();
 /* Destroys (frees) a memory handler.
 *  Memory for a handler is allocated externally, using get_mem_hndl_size().
+*  Page tables of the handler and physical memory mapped in it's user half are freed, the handler shouldn't be loaded on any CPU.
 *  Return value:
 *	0 			OK
 *	non-zero 	error, see code above
 */
 int destroy_mem_hndl(void* hndl);
+/* Creates a memory handler that maps the same memory as src (copy-on-write).
+*  Pages of the user half are shared read-only by both handlers, and the first write to a page that was writable
+*  gives the writing handler it's own copy of it. Pages that aren't mapped yet (VMEM_FLAG_LAZY) are reserved in dst as well.
+*  Memory-mapped I/O is mapped by both handlers as it is.
+*  Memory for dst is allocated externally, using get_mem_hndl_size(), create_mem_hndl() shouldn't be called on it.
+*  Arguments:
+*	src - memory handler to copy
+*	dst - memory handler to create
+*  Return value:
+*	0 			OK
+*	non-zero 	error, see code above. dst is created anyway and should be destroyed.
+*/
+int clone_mem_hndl(void* src, void* dst);
 
 
 /* Memory mapping functions: */
 
 /* Maps a chunk of memory on specified virtual address to some physical address returned by the allocator.
+*  With VMEM_FLAG_LAZY, the range is only reserved and pages are mapped to zeroed memory by the page fault handler.
 *  Arguments:
 *	vaddr - [page-aligned] virtual address to map
 *	usize - size of the memory chunk in memory units
@@ -81,6 +136,10 @@ int destroy_mem_hndl(void* hndl);
 int map_alloc(void* vaddr, uint64_t usize, int flags);
 
 /* Maps a chunk of memory on specified virtual address to specified physical address.
+*  Memory type flags (VMEM_FLAG_WB, VMEM_FLAG_WC, ...) choose how accesses to the chunk are cached.
+*  The same physical memory shouldn't be mapped with different memory types.
+*  Usable RAM in the chunk is taken from the allocator and freed by unmap(), VMEM_ERR_PHYS_OCCUPIED is returned
+*  if any of it is allocated already. The rest of the chunk (memory-mapped I/O, firmware memory) is never freed.
 *  Arguments:
 *	vaddr - [page-aligned] virtual address to map
 *	paddr - [page-aligned] physical address to map to
@@ -92,7 +151,22 @@ int map_alloc(void* vaddr, uint64_t usize, int flags);
 */
 int map_phys(void* vaddr, void* paddr, uint64_t usize, int flags);
 
+/* Takes a chunk of physical memory from the allocator without mapping it, so it can be mapped later with VMEM_FLAG_RESERVED.
+*  Used for memory that is already in use before the module is initialized (e.g. the kernel heap).
+*  Parts of the chunk outside of usable RAM are skipped.
+*  Arguments:
+*	paddr - [page-aligned] physical address of the chunk
+*	usize - size of the memory chunk in memory units
+*	flags - virtual memory module flags, see above
+*  Return value:
+*	0			OK
+*	non-zero	error, see error codes above
+*/
+int reserve_phys(void* paddr, uint64_t usize, int flags);
+
 /* Unmaps a chunk of memory on specified virtual address.
+*  Pages reserved with VMEM_FLAG_LAZY don't have to be touched to be unmapped.
+*  Other CPUs invalidate the translations asynchronously, freed physical memory is reused only after all of them do.
 *  Arguments:
 *	vaddr - [page-aligned] virtual address to map
 *	usize - size of the memory chunk in memory units
@@ -103,4 +177,51 @@ int map_phys(void* vaddr, void* paddr, uint64_t usize, int flags);
 */
 int unmap(void* vaddr, uint64_t usize, int flags);
 
+/* Replaces 4 KB pages of a chunk of memory with 2 MB pages where possible, which saves TLB entries.
+*  Every 2 MB aligned part of the chunk with all pages mapped the same way is moved into a single 2 MB frame,
+*  old frames are freed. Mapping functions do it on their own for parts that don't have to be moved (frames are continous).
+*  Pages of the chunk shouldn't be accessed by other CPUs until it returns.
+*  Arguments:
+*	vaddr - [page-aligned] virtual address of the chunk
+*	usize - size of the memory chunk in memory units
+*	flags - virtual memory module flags, see above (zone flags select memory for new frames)
+*  Return value:
+*	0			OK
+*	non-zero	error, see error codes above
+*/
+int collapse_pages(void* vaddr, uint64_t usize, int flags);
+
+
+/* Kernel address space functions: */
+
+/* Maps a chunk of memory at a virtual address picked in a window of the kernel half, the same way as map_alloc().
+*  Physical memory doesn't have to be continous, unless VMEM_FLAG_MAINTAIN_CONTINUITY is set.
+*  Chunks are separated by unmapped guard pages, so accesses past the end of a chunk fault.
+*  Arguments:
+*	usize - size of the memory chunk in memory units
+*	flags - virtual memory module flags, see above
+*  Return value:
+*	virtual address of the chunk, or NULL if there wasn't enough virtual or physical memory
+*/
+void* vmalloc(uint64_t usize, int flags);
+/* Same as vmalloc(), but maps the chunk to specified physical address, the same way as map_phys().
+*  Arguments:
+*	paddr - [page-aligned] physical address to map to
+*	usize - size of the memory chunk in memory units
+*	flags - virtual memory module flags, see above
+*  Return value:
+*	virtual address of the chunk, or NULL if there wasn't enough virtual memory
+*/
+void* vmap_phys(void* paddr, uint64_t usize, int flags);
+/* Unmaps a chunk returned by vmalloc() or vmap_phys(), the same way as unmap(), and gives it's virtual addresses back.
+*  Arguments:
+*	vaddr - virtual address of the chunk
+*	usize - size of the chunk in memory units, the same as it was mapped with
+*	flags - virtual memory module flags, see above
+*  Return value:
+*	0			OK
+*	non-zero	error, see error codes above
+*/
+int vfree(void* vaddr, uint64_t usize, int flags);
+
 #endif